@@ -412,12 +412,12 @@ void __fastcall TMainForm::MouseScrollHandler(TOpenGLWindow* Sender, double delt
 
 void __fastcall TMainForm::TimerTimer(TObject *Sender)
 {
-	/// Redraw OpenGL window every 20ms
+	/// Check OpenGL window every 20ms
 	/// OpenGL window does not have a redraw loop
-	/// Need to call Render to update display
+	/// Only redrawn if something changed, otherwise just handles window events
 
 	if(openglWindow == nullptr) return;
-	openglWindow->Render();
+	openglWindow->RenderIfNeeded();
 }
 //---------------------------------------------------------------------------
 
@@ -7,86 +7,191 @@
 #include <debugapi.h>
 #include <iostream>
 #include <fstream>
+#include <thread>
+#include <algorithm>
+#include <cfloat>
+#include <climits>
 #include <glm/gtx/string_cast.hpp>
 
+#if defined(__SSE__) || defined(_M_X64) || defined(_M_AMD64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+#define FRUSTUM_SSE
+#endif
+
 #include "OpenGLWindow.h"
 //---------------------------------------------------------------------------
 #pragma package(smart_init)
 //---------------------------------------------------------------------------
+/// Camera and light state shared by the color and texture shaders
+/// Filled from GLSceneUniforms in a uniform buffer at binding point sceneBinding
+/// light_dir is negative of light direction
+/// tiles is the number of light tiles across and down and the number of point lights
+#define SCENE_BLOCK "layout (std140) uniform Scene {\n" \
+	"   mat4 pvm;\n" \
+	"   vec3 light_dir;\n" \
+	"   vec3 light_color;\n" \
+	"   vec3 ambient_color;\n" \
+	"   ivec4 tiles;\n" \
+	"} scene;\n"
+
+/// Light from the point lights reaching pos, for fragment shaders after SCENE_BLOCK
+/// The view is split into tiles and only the lights listed for the fragment's tile
+/// are added, the lists are made on the CPU by BinLights
+/// lightData holds position and radius, then color, of each light
+/// tileLights holds the first and count of each tile's list, then the lists
+#define POINT_LIGHTS "uniform samplerBuffer lightData;\n" \
+	"uniform usamplerBuffer tileLights;\n" \
+	"vec3 pointLights(vec3 pos, vec3 norm)\n" \
+	"{\n" \
+	"   vec3 light = vec3(0.0);\n" \
+	"   if(scene.tiles.z == 0) return light;\n" \
+	"   vec4 clip = scene.pvm * vec4(pos, 1.0);\n" \
+	"   ivec2 tile = clamp(ivec2((clip.xy / clip.w * 0.5 + 0.5) * vec2(scene.tiles.xy)), ivec2(0), scene.tiles.xy - 1);\n" \
+	"   int header = 2 * (tile.y * scene.tiles.x + tile.x);\n" \
+	"   int first = int(texelFetch(tileLights, header).r);\n" \
+	"   int last = first + int(texelFetch(tileLights, header + 1).r);\n" \
+	"   for(int i=first; i<last; i++) {\n" \
+	"      int l = 2 * int(texelFetch(tileLights, i).r);\n" \
+	"      vec4 posradius = texelFetch(lightData, l);\n" \
+	"      vec3 tolight = posradius.xyz - pos;\n" \
+	"      float dist = length(tolight);\n" \
+	"      float falloff = clamp(1.0 - dist * dist / (posradius.w * posradius.w), 0.0, 1.0);\n" \
+	"      float diff = max(dot(norm, tolight / max(dist, 0.0001)), 0.0);\n" \
+	"      light += texelFetch(lightData, l + 1).rgb * (falloff * falloff * diff);\n" \
+	"   }\n" \
+	"   return light;\n" \
+	"}\n"
+
+static const int sceneBinding = 0;
+static const int lightUnit = 2;   // texture units of the point light buffers
+static const int tileUnit = 3;
+static const int tileSize = 32;   // pixels across a light tile
+
+// windows keeping GLFW initialised, it is terminated when the last one is destroyed
+static int glfwWindows = 0;
+
 /// Vertex shader to color triangle by color of vertices
 /// Shades triangle based on angle to light
 /// Reads position, normal and color from vertex buffer
-/// input pvm is composite perspective / view / model matrix
+/// scene.pvm is composite perspective / view / model matrix
 const char *colorVertexSource ="#version 330 core\n"
 	"layout (location = 0) in vec3 pos;\n"
 	"layout (location = 1) in vec3 norm;\n"
 	"layout (location = 2) in vec3 color;\n"
-	"uniform mat4 pvm;\n"
+	SCENE_BLOCK
+	"invariant gl_Position;\n"
 	"out vec3 normalvec;\n"
 	"out vec3 vertcolor;\n"
+	"out vec3 vertpos;\n"
 	"void main()\n"
 	"{\n"
-	"   gl_Position = pvm * vec4(pos, 1.0);\n"
+	"   gl_Position = scene.pvm * vec4(pos, 1.0);\n"
 	"   vertcolor = color;\n"
 	"   normalvec = norm;\n"
+	"   vertpos = pos;\n"
 	"}\0";
 
 /// Pixel shader to color triangle by color of vertices
-/// Shades triangle based on angle to light
-/// input light_dir is negative of light direction
+/// Shades triangle based on angle to light and to the point lights of its tile
+/// Light direction and colors from scene block
 const char *colorFragmentSource = "#version 330 core\n"
-	"uniform vec3 light_dir;\n"
-	"uniform vec3 light_color;\n"
-	"uniform vec3 ambient_color;\n"
+	SCENE_BLOCK
+	POINT_LIGHTS
 	"in vec3 normalvec;\n"
 	"in vec3 vertcolor;\n"
+	"in vec3 vertpos;\n"
 	"out vec4 fragcolor;\n"
 	"void main()\n"
 	"{\n"
 	"	vec3 norm = normalize(normalvec);\n"
-	"	float diff = max(dot(norm, light_dir), 0.0);\n"
-	"   vec3 color = vertcolor * (diff * light_color + ambient_color);\n"
+	"	float diff = max(dot(norm, scene.light_dir), 0.0);\n"
+	"   vec3 color = vertcolor * (diff * scene.light_color + scene.ambient_color + pointLights(vertpos, norm));\n"
 	"   fragcolor = vec4(color, 1.0f);\n"
 	"}\n\0";
 
 /// Vertex shader to color triangle using texture
 /// Shades triangle based on angle to light
 /// Reads position, normal and texture coordinates from vertex buffer
-/// input pvm is composite perspective / view / model matrix
+/// scene.pvm is composite perspective / view / model matrix
 const char *textureVertexSource ="#version 330 core\n"
 	"layout (location = 0) in vec3 pos;\n"
 	"layout (location = 1) in vec3 norm;\n"
 	"layout (location = 2) in vec3 color;\n"
 	"layout (location = 3) in vec2 tex;\n"
-	"uniform mat4 pvm;\n"
+	SCENE_BLOCK
+	"invariant gl_Position;\n"
 	"out vec3 vertnormal;\n"
 	"out vec3 vertcolor;\n"
 	"out vec2 texcoord;\n"
+	"out vec3 vertpos;\n"
 	"void main()\n"
 	"{\n"
-	"   gl_Position = pvm * vec4(pos, 1.0);\n"
+	"   gl_Position = scene.pvm * vec4(pos, 1.0);\n"
 	"   texcoord = tex;\n"
 	"   vertnormal = norm;\n"
 	"   vertcolor = color;\n"
+	"   vertpos = pos;\n"
 	"}\0";
 
 /// Pixel shader to color triangle using texture
-/// Shades triangle based on angle to light
-/// input light_dir is negative of light direction
+/// Shades triangle based on angle to light and to the point lights of its tile
+/// Light direction and colors from scene block
 const char *textureFragmentSource = "#version 330 core\n"
 	"uniform sampler2D texture0;\n"
-	"uniform vec3 light_dir;\n"
-	"uniform vec3 light_color;\n"
-	"uniform vec3 ambient_color;\n"
+	SCENE_BLOCK
+	POINT_LIGHTS
 	"in vec3 vertnormal;\n"
 	"in vec3 vertcolor;\n"
 	"in vec2 texcoord;\n"
+	"in vec3 vertpos;\n"
+	"out vec4 fragcolor;\n"
+	"void main()\n"
+	"{\n"
+	"	vec3 norm = normalize(vertnormal);\n"
+	"	float diff = max(dot(norm, scene.light_dir), 0.0);\n"
+	"   vec3 color = diff * scene.light_color + pointLights(vertpos, norm) + vertcolor + scene.ambient_color;\n"
+	"   fragcolor = texture(texture0, texcoord) * vec4(color, 1.0);\n"
+	"}\n\0";
+
+/// Vertex shader to color triangle using a layer of a texture array
+/// As texture vertex shader with the layer of each vertex passed on
+const char *batchVertexSource ="#version 330 core\n"
+	"layout (location = 0) in vec3 pos;\n"
+	"layout (location = 1) in vec3 norm;\n"
+	"layout (location = 2) in vec3 color;\n"
+	"layout (location = 3) in vec2 tex;\n"
+	"layout (location = 4) in float layer;\n"
+	SCENE_BLOCK
+	"invariant gl_Position;\n"
+	"out vec3 vertnormal;\n"
+	"out vec3 vertcolor;\n"
+	"out vec3 texcoord;\n"
+	"out vec3 vertpos;\n"
+	"void main()\n"
+	"{\n"
+	"   gl_Position = scene.pvm * vec4(pos, 1.0);\n"
+	"   texcoord = vec3(tex, layer);\n"
+	"   vertnormal = norm;\n"
+	"   vertcolor = color;\n"
+	"   vertpos = pos;\n"
+	"}\0";
+
+/// Pixel shader to color triangle using a layer of a texture array
+/// Light direction and colors from scene block
+const char *batchFragmentSource = "#version 330 core\n"
+	"uniform sampler2DArray texture0;\n"
+	SCENE_BLOCK
+	POINT_LIGHTS
+	"in vec3 vertnormal;\n"
+	"in vec3 vertcolor;\n"
+	"in vec3 texcoord;\n"
+	"in vec3 vertpos;\n"
 	"out vec4 fragcolor;\n"
 	"void main()\n"
 	"{\n"
 	"	vec3 norm = normalize(vertnormal);\n"
-	"	float diff = max(dot(norm, light_dir), 0.0);\n"
-	"   vec3 color = diff * light_color + vertcolor + ambient_color;\n"
+	"	float diff = max(dot(norm, scene.light_dir), 0.0);\n"
+	"   vec3 color = diff * scene.light_color + pointLights(vertpos, norm) + vertcolor + scene.ambient_color;\n"
 	"   fragcolor = texture(texture0, texcoord) * vec4(color, 1.0);\n"
 	"}\n\0";
 
@@ -122,11 +227,197 @@ const char *billboardFragmentSource = "#version 330 core\n"
     "   if(fragcolor.a == 0) discard;\n"
 	"}\n\0";
 
+/// Vertex shader for the depth pre-pass
+/// Position is invariant and calculated as in the color and texture shaders so
+/// the main pass finds exactly the same depth
+const char *depthVertexSource ="#version 330 core\n"
+	"layout (location = 0) in vec3 pos;\n"
+	SCENE_BLOCK
+	"invariant gl_Position;\n"
+	"void main()\n"
+	"{\n"
+	"   gl_Position = scene.pvm * vec4(pos, 1.0);\n"
+	"}\0";
+
+/// Pixel shader for the depth pre-pass, color is not written
+const char *depthFragmentSource = "#version 330 core\n"
+	"out vec4 fragcolor;\n"
+	"void main()\n"
+	"{\n"
+	"   fragcolor = vec4(1.0);\n"
+	"}\n\0";
+
+/// Vertex shader to draw a chunk bounding box for an occlusion query
+/// Reads corner of a cube from -1 to 1 from vertex buffer
+/// center and extent are the center and half size of the box
+const char *boxVertexSource ="#version 330 core\n"
+	"layout (location = 0) in vec3 pos;\n"
+	SCENE_BLOCK
+	"uniform vec3 center;\n"
+	"uniform vec3 extent;\n"
+	"void main()\n"
+	"{\n"
+	"   gl_Position = scene.pvm * vec4(center + pos * extent, 1.0);\n"
+	"}\0";
+
+/// Pixel shader for occlusion query boxes
+/// Color is not written, only the samples passing the depth test are counted
+const char *boxFragmentSource = "#version 330 core\n"
+	"out vec4 fragcolor;\n"
+	"void main()\n"
+	"{\n"
+	"   fragcolor = vec4(1.0);\n"
+	"}\n\0";
+
+/// Compute shader testing chunk boxes against the frustum planes, GL 4.3
+/// Writes a DrawArraysIndirectCommand for each chunk, with no instances if the chunk
+/// is outside or has no triangles uploaded yet
+/// triangles is the number of triangles that can be drawn from the buffer
+/// If cull is false every chunk is drawn
+const char *cullComputeSource = "#version 430 core\n"
+	"layout (local_size_x = 64) in;\n"
+	"struct Box { vec4 center; vec4 extent; };\n"
+	"struct Command { uint count; uint instanceCount; uint first; uint baseInstance; };\n"
+	"layout (std430, binding = 0) readonly buffer Boxes { Box boxes[]; };\n"
+	"layout (std430, binding = 1) writeonly buffer Commands { Command commands[]; };\n"
+	"uniform vec4 planes[6];\n"
+	"uniform int chunks;\n"
+	"uniform int triangles;\n"
+	"uniform bool cull;\n"
+	"const int chunkSize = CHUNK_SIZE;\n"
+	"void main()\n"
+	"{\n"
+	"   int c = int(gl_GlobalInvocationID.x);\n"
+	"   if(c >= chunks) return;\n"
+	"   vec3 center = boxes[c].center.xyz;\n"
+	"   vec3 extent = boxes[c].extent.xyz;\n"
+	"   bool inside = true;\n"
+	"   for(int p=0; p<6 && cull; p++) {\n"
+	"      if(dot(planes[p].xyz, center) + planes[p].w + dot(abs(planes[p].xyz), extent) < 0.0) inside = false;\n"
+	"   }\n"
+	"   int first = c * chunkSize;\n"
+	"   int count = clamp(triangles - first, 0, chunkSize);\n"
+	"   commands[c].count = uint(count * 3);\n"
+	"   commands[c].instanceCount = (inside && count > 0) ? 1u : 0u;\n"
+	"   commands[c].first = uint(first * 3);\n"
+	"   commands[c].baseInstance = 0u;\n"
+	"}\n\0";
+
+/// Vertex shader for passes over the whole viewport
+/// Vertices 0 to 2 make a triangle covering the viewport, no vertex buffer is read
+/// uvScale is the part of the texture used
+const char *screenVertexSource ="#version 330 core\n"
+	"uniform vec2 uvScale;\n"
+	"out vec2 uv;\n"
+	"void main()\n"
+	"{\n"
+	"   vec2 corner = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);\n"
+	"   uv = corner * uvScale;\n"
+	"   gl_Position = vec4(corner * 2.0 - 1.0, 0.0, 1.0);\n"
+	"}\0";
+
+/// Pixel shader to scale the 3D pass up to the window
+/// Filtered reads are kept half a texel inside the used part of the texture
+const char *upscaleFragmentSource = "#version 330 core\n"
+	"in vec2 uv;\n"
+	"out vec4 fragcolor;\n"
+	"uniform sampler2D image;\n"
+	"uniform vec2 uvScale;\n"
+	"uniform vec2 texelSize;\n"
+	"void main()\n"
+	"{\n"
+	"   fragcolor = texture(image, min(uv, uvScale - 0.5 * texelSize));\n"
+	"}\n\0";
+
+/// Pixel shader for FXAA, antialiasing edges found from the luma of neighbouring pixels
+/// Pixels with little contrast are copied, others are blended along the edge direction
+/// Also scales the 3D pass up to the window when both are used
+const char *fxaaFragmentSource = "#version 330 core\n"
+	"in vec2 uv;\n"
+	"out vec4 fragcolor;\n"
+	"uniform sampler2D image;\n"
+	"uniform vec2 uvScale;\n"
+	"uniform vec2 texelSize;\n"
+	"const float spanMax = 8.0;\n"
+	"const float reduceMul = 1.0 / 8.0;\n"
+	"const float reduceMin = 1.0 / 128.0;\n"
+	"vec3 fetch(vec2 pos)\n"
+	"{\n"
+	"   return texture(image, clamp(pos, 0.5 * texelSize, uvScale - 0.5 * texelSize)).rgb;\n"
+	"}\n"
+	"float luma(vec3 color)\n"
+	"{\n"
+	"   return dot(color, vec3(0.299, 0.587, 0.114));\n"
+	"}\n"
+	"void main()\n"
+	"{\n"
+	"   vec3 rgbM = fetch(uv);\n"
+	"   float lumaNW = luma(fetch(uv + vec2(-1.0, -1.0) * texelSize));\n"
+	"   float lumaNE = luma(fetch(uv + vec2(1.0, -1.0) * texelSize));\n"
+	"   float lumaSW = luma(fetch(uv + vec2(-1.0, 1.0) * texelSize));\n"
+	"   float lumaSE = luma(fetch(uv + vec2(1.0, 1.0) * texelSize));\n"
+	"   float lumaM = luma(rgbM);\n"
+	"   float lumaMin = min(lumaM, min(min(lumaNW, lumaNE), min(lumaSW, lumaSE)));\n"
+	"   float lumaMax = max(lumaM, max(max(lumaNW, lumaNE), max(lumaSW, lumaSE)));\n"
+	"   if(lumaMax - lumaMin < max(0.0312, lumaMax * 0.125)) {\n"
+	"      fragcolor = vec4(rgbM, 1.0);\n"
+	"      return;\n"
+	"   }\n"
+	"   vec2 dir = vec2(-((lumaNW + lumaNE) - (lumaSW + lumaSE)), (lumaNW + lumaSW) - (lumaNE + lumaSE));\n"
+	"   float dirReduce = max((lumaNW + lumaNE + lumaSW + lumaSE) * 0.25 * reduceMul, reduceMin);\n"
+	"   float rcpDirMin = 1.0 / (min(abs(dir.x), abs(dir.y)) + dirReduce);\n"
+	"   dir = clamp(dir * rcpDirMin, vec2(-spanMax), vec2(spanMax)) * texelSize;\n"
+	"   vec3 rgbA = 0.5 * (fetch(uv + dir * (1.0 / 3.0 - 0.5)) + fetch(uv + dir * (2.0 / 3.0 - 0.5)));\n"
+	"   vec3 rgbB = rgbA * 0.5 + 0.25 * (fetch(uv - dir * 0.5) + fetch(uv + dir * 0.5));\n"
+	"   float lumaB = luma(rgbB);\n"
+	"   fragcolor = vec4((lumaB < lumaMin || lumaB > lumaMax) ? rgbA : rgbB, 1.0);\n"
+	"}\n\0";
+
+//---------------------------------------------------------------------------
+
+static unsigned int __fastcall CreateComputeShader(const char* computesource)
+{
+	/// Internal function to compile a compute shader from a source string, GL 4.3
+	/// Uniform locations should be looked up once after this returns
+
+	int  success;
+	char infoLog[512];
+
+	unsigned int computeShader;
+	computeShader = glCreateShader(GL_COMPUTE_SHADER);
+	glShaderSource(computeShader, 1, &computesource, NULL);
+	glCompileShader(computeShader);
+
+	glGetShaderiv(computeShader, GL_COMPILE_STATUS, &success);
+	if(!success) {
+		glGetShaderInfoLog(computeShader, 512, NULL, infoLog);
+		ShowMessage(infoLog);
+		return 0;
+	}
+
+	unsigned int shaderprogram;
+	shaderprogram = glCreateProgram();
+	glAttachShader(shaderprogram, computeShader);
+	glLinkProgram(shaderprogram);
+
+	glGetProgramiv(shaderprogram, GL_LINK_STATUS, &success);
+	if(!success) {
+		glGetProgramInfoLog(shaderprogram, 512, NULL, infoLog);
+		ShowMessage(infoLog);
+		return 0;
+	}
+	glDeleteShader(computeShader);
+
+	return shaderprogram;
+}
 //---------------------------------------------------------------------------
 
 static unsigned int __fastcall CreateShader(const char* vertexsource, const char* fragmentsource)
 {
 	/// Internal function to compile shaders from source strings
+	/// Programs using the Scene block are bound to the scene uniform buffer
+	/// and their point light buffers to lightUnit and tileUnit
+	/// Other uniform locations should be looked up once after this returns
 
 	int  success;
 	char infoLog[512];
@@ -174,6 +465,22 @@ static unsigned int __fastcall CreateShader(const char* vertexsource, const char
 	glDeleteShader(vertexShader);
 	glDeleteShader(fragmentShader);
 
+	// camera and light state come from the scene uniform buffer
+	unsigned int sceneblock = glGetUniformBlockIndex(shaderprogram, "Scene");
+	if(sceneblock != GL_INVALID_INDEX) glUniformBlockBinding(shaderprogram, sceneblock, sceneBinding);
+
+	// point light buffers are read from fixed units, the bound program is restored
+	int lightloc = glGetUniformLocation(shaderprogram, "lightData");
+	int tileloc = glGetUniformLocation(shaderprogram, "tileLights");
+	if(lightloc >= 0 || tileloc >= 0) {
+		GLint current = 0;
+		glGetIntegerv(GL_CURRENT_PROGRAM, &current);
+		glUseProgram(shaderprogram);
+		glUniform1i(lightloc, lightUnit);
+		glUniform1i(tileloc, tileUnit);
+		glUseProgram(current);
+	}
+
 	return shaderprogram;
 }
 //---------------------------------------------------------------------------
@@ -219,6 +526,166 @@ static bool __fastcall RayTriangle(glm::vec3& raystart, glm::vec3& raydir, float
 
 }
 //---------------------------------------------------------------------------
+
+static void __fastcall ParallelFor(int count, int mincount, const std::function<void(int, int, int)>& func)
+{
+	/// Splits 0..count into one block per hardware thread and runs func(block, begin, end) on each
+	/// Runs on calling thread only if count is less than mincount
+
+	int threads = std::thread::hardware_concurrency();
+	if(threads < 1) threads = 1;
+	if(count < mincount) threads = 1;
+
+	int blocksize = (count + threads - 1) / threads;
+
+	std::vector<std::thread> workers;
+	for(int t=1; t<threads; t++) {
+		int begin = t * blocksize;
+		int end = std::min(count, begin + blocksize);
+		workers.emplace_back(func, t, begin, end);
+	}
+	func(0, 0, std::min(count, blocksize));
+
+	for(std::thread& worker : workers) {
+		worker.join();
+	}
+}
+//---------------------------------------------------------------------------
+
+static unsigned int __fastcall MortonCode(glm::vec3 pos)
+{
+	/// 30 bit Morton code of a point in the unit cube
+	/// Interleaves 10 bits from each axis
+
+	unsigned int code[3];
+	for(int a=0; a<3; a++) {
+		unsigned int v = (unsigned int)glm::clamp(pos[a] * 1024.0f, 0.0f, 1023.0f);
+		v = (v * 0x00010001u) & 0xFF0000FFu;
+		v = (v * 0x00000101u) & 0x0F00F00Fu;
+		v = (v * 0x00000011u) & 0xC30C30C3u;
+		v = (v * 0x00000005u) & 0x49249249u;
+		code[a] = v;
+	}
+	return (code[0] << 2) | (code[1] << 1) | code[2];
+}
+//---------------------------------------------------------------------------
+
+template<class T> static void MortonSort(std::vector<T>& list, std::vector<int>& remap, std::vector<int>& unmap)
+{
+	/// Reorders triangles by Morton code of their centroid for better cache locality
+	/// Keys are sorted by a parallel LSD radix sort, 8 bits per pass
+	/// remap is updated to give storage index from caller index
+	/// unmap is updated to give caller index from storage index
+
+	const int count = list.size();
+	if(count < 2) return;
+
+	// scene bounds for normalising centroids
+	glm::vec3 minpos(FLT_MAX);
+	glm::vec3 maxpos(-FLT_MAX);
+	for(T& tri : list) {
+		for(int v=0; v<3; v++) {
+			glm::vec3 p(tri.vert[v].pos[0], tri.vert[v].pos[1], tri.vert[v].pos[2]);
+			minpos = glm::min(minpos, p);
+			maxpos = glm::max(maxpos, p);
+		}
+	}
+	glm::vec3 scale = 1.0f / glm::max(maxpos - minpos, glm::vec3(1e-20f));
+
+	std::vector<unsigned int> keys(count);
+	std::vector<int> order(count);
+	std::vector<unsigned int> tempkeys(count);
+	std::vector<int> temporder(count);
+
+	ParallelFor(count, 65536, [&](int block, int begin, int end) {
+		for(int i=begin; i<end; i++) {
+			T& tri = list[i];
+			glm::vec3 center(0.0f);
+			for(int v=0; v<3; v++) {
+				center += glm::vec3(tri.vert[v].pos[0], tri.vert[v].pos[1], tri.vert[v].pos[2]);
+			}
+			center = (center / 3.0f - minpos) * scale;
+			keys[i] = MortonCode(center);
+			order[i] = i;
+		}
+	});
+
+	int threads = std::thread::hardware_concurrency();
+	if(threads < 1 || count < 65536) threads = 1;
+	std::vector<int> histogram(threads * 256);
+
+	// 30 bit keys need 4 passes
+	for(int shift=0; shift<32; shift+=8) {
+
+		// count digits in each block
+		std::fill(histogram.begin(), histogram.end(), 0);
+		ParallelFor(count, 65536, [&](int block, int begin, int end) {
+			int* hist = &histogram[block * 256];
+			for(int i=begin; i<end; i++) {
+				hist[(keys[i] >> shift) & 0xFF]++;
+			}
+		});
+
+		// offsets are ordered by digit then block so sort is stable
+		int offset = 0;
+		for(int d=0; d<256; d++) {
+			for(int b=0; b<threads; b++) {
+				int n = histogram[b * 256 + d];
+				histogram[b * 256 + d] = offset;
+				offset += n;
+			}
+		}
+
+		// scatter
+		ParallelFor(count, 65536, [&](int block, int begin, int end) {
+			int* hist = &histogram[block * 256];
+			for(int i=begin; i<end; i++) {
+				int dest = hist[(keys[i] >> shift) & 0xFF]++;
+				tempkeys[dest] = keys[i];
+				temporder[dest] = order[i];
+			}
+		});
+
+		keys.swap(tempkeys);
+		order.swap(temporder);
+	}
+
+	// gather triangles in sorted order
+	std::vector<T> sorted(count);
+	ParallelFor(count, 65536, [&](int block, int begin, int end) {
+		for(int i=begin; i<end; i++) {
+			sorted[i] = list[order[i]];
+		}
+	});
+	list.swap(sorted);
+
+	// existing caller index of each old storage index
+	if(unmap.size() != count) {
+		unmap.resize(count);
+		for(int i=0; i<count; i++) unmap[i] = i;
+	}
+
+	std::vector<int> newunmap(count);
+	remap.resize(count);
+	for(int i=0; i<count; i++) {
+		int caller = unmap[order[i]];
+		newunmap[i] = caller;
+		remap[caller] = i;
+	}
+	unmap.swap(newunmap);
+}
+//---------------------------------------------------------------------------
+
+static unsigned int __fastcall UniqueId()
+{
+	/// A number not returned before
+	/// Marks new buffer objects and triangle orders so windows sharing a scene
+	/// can tell when their vertex arrays or chunks are out of date
+
+	static std::atomic<unsigned int> last(0);
+	return ++last;
+}
+//---------------------------------------------------------------------------
 //---------------------------------------------------------------------------
 
 static void error_callback(int error, const char* description)
@@ -271,6 +738,15 @@ static void scroll_callback(GLFWwindow* window, double xoffset, double yoffset)
 	TOpenGLWindow* openglwindow = (TOpenGLWindow*)glfwGetWindowUserPointer(window);
 	if(openglwindow != nullptr) openglwindow->MouseScrollCallback(xoffset, yoffset);
 }
+//---------------------------------------------------------------------------
+
+static void window_refresh_callback(GLFWwindow* window)
+{
+	/// Called by glfw when the window contents need to be redrawn
+	/// Sends call to openglwindow object stored in user pointer
+	TOpenGLWindow* openglwindow = (TOpenGLWindow*)glfwGetWindowUserPointer(window);
+	if(openglwindow != nullptr) openglwindow->RefreshCallback();
+}
 
 //---------------------------------------------------------------------------
 //---------------------------------------------------------------------------
@@ -325,10 +801,79 @@ void GLAPIENTRY message_callback( GLenum source, GLenum type, GLuint id, GLenum
 }
 //---------------------------------------------------------------------------
 
-TOpenGLWindow::TOpenGLWindow(int width, int height, int samples, const char* title)
+GLScene::GLScene()
+	: colorBuffer(sizeof(GLColorTriangle), GL_DYNAMIC_DRAW)
+{
+	/// Constructor
+	/// Shaders are created by the first window once it has a context
+
+	colorMin = glm::vec3(FLT_MAX);
+	colorMax = glm::vec3(-FLT_MAX);
+	colorLayout = UniqueId();
+	lightRevision = 0;
+	colorShader = 0;
+	textureShader = 0;
+	depthShader = 0;
+	font = nullptr;
+	uploadThread = nullptr;
+	decodeThread = nullptr;
+	textureBatch = nullptr;
+	uploadFence = nullptr;
+	dataChanged = true;
+	revision = 0;
+	windows = 0;
+}
+//---------------------------------------------------------------------------
+
+GLScene::~GLScene()
+{
+	/// Destructor deletes buffers, textures and shaders
+	/// Called by the last window drawing the scene with its context current
+
+	colorBuffer.Release();
+	textureList.clear();
+
+	if(textureBatch != nullptr) {
+		delete textureBatch;
+		textureBatch = nullptr;
+	}
+	if(uploadThread != nullptr) {
+		delete uploadThread;
+		uploadThread = nullptr;
+	}
+	if(decodeThread != nullptr) {
+		delete decodeThread;
+		decodeThread = nullptr;
+	}
+
+	if(font != nullptr) {
+		delete font;
+		font = nullptr;
+	}
+
+	if(uploadFence != nullptr) glDeleteSync(uploadFence);
+	glDeleteProgram(colorShader);
+	glDeleteProgram(textureShader);
+	glDeleteProgram(depthShader);
+}
+//---------------------------------------------------------------------------
+//---------------------------------------------------------------------------
+
+TOpenGLWindow::TOpenGLWindow(int width, int height, int samples, const char* title, TOpenGLWindow* share, GLWindowMode mode, GLCulling culling)
+	: colorView(sizeof(GLColorVertex)), batchView(sizeof(GLBatchVertex)), streamBuffer(4 * 1024 * 1024),
+	  commands(65536), frameTimer(300), frameCapture(3)
 {
 	/// TOpenGLWindow constructor
 	/// Creates GLFW window, shaders and default font
+	/// If share is set this window draws the scene of share, from its own camera and
+	/// with its own light and text, without copying any buffers or textures
+	/// Triangles and textures added through either window appear in both
+	/// Windows sharing a scene are drawn on the thread that created them
+	/// OFFSCREEN mode hides the window and draws width x height frames with samples
+	/// samples per pixel into a framebuffer, without swapping or waiting for vsync,
+	/// for rendering images on machines with no display; read them with GetImage
+	/// GPU culling tests chunks against the frustum in a compute shader and draws them
+	/// with indirect commands, if the context is GL 4.3 or later, see GPUCulling
 
 	OnKeyEvent = nullptr;
 	OnResizeEvent = nullptr;
@@ -347,66 +892,195 @@ TOpenGLWindow::TOpenGLWindow(int width, int height, int samples, const char* tit
 	lightDir = glm::vec3(-0.5f, -0.8f, -1.0f);
 	lightDir = -glm::normalize(lightDir);
 
-	dataChanged = true;
+	redrawNeeded = true;
+	drawnRevision = 0;
+	threaded = false;
+	stopRender = false;
+	renderIdle = false;
+	queuedTextures = 0;
+	windowWidth = width;
+	windowHeight = height;
+	framePacing = GLFramePacing::VSYNC;
+	frameInterval = std::chrono::steady_clock::duration::zero();
+	dynamicResolution = false;
+	targetFrameTime = 14.0;
+	minRenderScale = 0.5f;
+	renderScale = 1.0f;
+	fxaa = false;
+	sceneTarget = nullptr;
+	upscalePass = nullptr;
+	fxaaPass = nullptr;
 	window = nullptr;
-	colorShader = 0;
-	textureShader = 0;
-	colorVAO = 0;
+	glfwUser = false;
+	offscreen = mode == GLWindowMode::OFFSCREEN;
+	imageWidth = width;
+	imageHeight = height;
+	imageSamples = samples;
+	renderTarget = nullptr;
+	gpuCulling = false;
+	cullCompute = nullptr;
+	captureTarget = nullptr;
+	captureCallback = nullptr;
+	captureContinuous = false;
+	colorView.array.Attribute(0, 3, 0);                   // position
+	colorView.array.Attribute(1, 3, 3 * sizeof(float));   // norm
+	colorView.array.Attribute(2, 3, 6 * sizeof(float));   // color
+	batchView.array.Attribute(0, 3, 0);                    // position
+	batchView.array.Attribute(1, 3, 3 * sizeof(float));    // norm
+	batchView.array.Attribute(2, 3, 6 * sizeof(float));    // color
+	batchView.array.Attribute(3, 2, 9 * sizeof(float));    // texture coord
+	batchView.array.Attribute(4, 1, 11 * sizeof(float));   // layer
 	backFaceCull = true;
+	frustumCull = true;
+	occlusionCull = false;
+	depthPrepass = false;
 	depthText = false;
 	highlightPoint = -1;
 	highlightTexture = -1;
     highlightTriangle = -1;
+	boxQuery = nullptr;
+	sceneUBO = 0;
+	sceneChanged = true;
+	viewWidth = 0;
+	viewHeight = 0;
+	tilesX = 1;
+	tilesY = 1;
+	binnedLights = 0;
+	lightBuffer = 0;
+	lightTexture = 0;
+	tileBuffer = 0;
+	tileTexture = 0;
+
+	GLFWwindow* sharewindow = nullptr;
+	if(share != nullptr && share->window != nullptr) {
+		// windows sharing a scene are drawn on one thread
+		share->RenderThread(false);
+		sharewindow = share->window;
+	}
 
 	window = nullptr;
-	CreateWindow(width, height, samples, title);
+	CreateWindow(width, height, samples, title, sharewindow, offscreen, culling == GLCulling::GPU);
+
+	if(sharewindow != nullptr && window != nullptr) scene = share->scene;
+	else scene = std::make_shared<GLScene>();
+	scene->windows++;
+
+	if(scene->colorShader == 0) {
+		scene->colorShader = CreateShader(colorVertexSource, colorFragmentSource);
+		scene->textureShader = CreateShader(textureVertexSource, textureFragmentSource);
+		scene->depthShader = CreateShader(depthVertexSource, depthFragmentSource);
+		scene->font = new GLFont((wchar_t*)L"FONT_PNG", (wchar_t*)L"FONT_CSV");
+	}
 
-	colorShader = CreateShader(colorVertexSource, colorFragmentSource);
-	textureShader = CreateShader(textureVertexSource, textureFragmentSource);
+	// uniform buffer for camera and light, filled at first render
+	glGenBuffers(1, &sceneUBO);
+	glBindBuffer(GL_UNIFORM_BUFFER, sceneUBO);
+	glBufferData(GL_UNIFORM_BUFFER, sizeof(GLSceneUniforms), NULL, GL_DYNAMIC_DRAW);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	glBindBufferBase(GL_UNIFORM_BUFFER, sceneBinding, sceneUBO);
 
-	defaultFont = new GLFont((wchar_t*)L"FONT_PNG", (wchar_t*)L"FONT_CSV");
+	windowText = new GLText(scene->font);
 }
 //---------------------------------------------------------------------------
 
 TOpenGLWindow::~TOpenGLWindow()
 {
 	/// Destructor
-	/// Cleanup GLFW
-	if(colorVAO > 0) {
-		glDeleteVertexArrays(1, &colorVAO);
-		colorVAO = 0;
+	/// The scene is deleted with the last window drawing it
+	/// GLFW is terminated when the last window is destroyed
+	RenderThread(false);
+	MakeCurrent();
+	frameTimer.Release();
+	frameCapture.Release();
+	colorView.Release();
+	batchView.Release();
+	textureViews.clear();
+	streamBuffer.Release();
+	if(sceneUBO > 0) glDeleteBuffers(1, &sceneUBO);
+	if(lightTexture > 0) glDeleteTextures(1, &lightTexture);
+	if(tileTexture > 0) glDeleteTextures(1, &tileTexture);
+	if(lightBuffer > 0) glDeleteBuffers(1, &lightBuffer);
+	if(tileBuffer > 0) glDeleteBuffers(1, &tileBuffer);
+
+	if(boxQuery != nullptr) {
+		delete boxQuery;
+		boxQuery = nullptr;
+	}
+	if(cullCompute != nullptr) {
+		delete cullCompute;
+		cullCompute = nullptr;
+	}
+	if(renderTarget != nullptr) {
+		delete renderTarget;
+		renderTarget = nullptr;
+	}
+	if(captureTarget != nullptr) {
+		delete captureTarget;
+		captureTarget = nullptr;
 	}
-	if(colorVBO > 0) {
-		glDeleteBuffers(1, &colorVBO);
-		colorVBO = 0;
+	if(sceneTarget != nullptr) {
+		delete sceneTarget;
+		sceneTarget = nullptr;
 	}
+	if(upscalePass != nullptr) {
+		delete upscalePass;
+		upscalePass = nullptr;
+	}
+	if(fxaaPass != nullptr) {
+		delete fxaaPass;
+		fxaaPass = nullptr;
+	}
+	if(windowText != nullptr) {
+		delete windowText;
+		windowText = nullptr;
+	}
+
+	// deleted here, with this context current, if no other window draws it
+	scene->windows--;
+	scene.reset();
 
 	if(window != nullptr) {
 		glfwDestroyWindow(window);
         window = nullptr;
 	}
-	glfwTerminate();
+	if(glfwUser && --glfwWindows == 0) glfwTerminate();
 }
 //---------------------------------------------------------------------------
 
-void __fastcall TOpenGLWindow::CreateWindow(int width, int height, int samples, const char* title)
+void __fastcall TOpenGLWindow::CreateWindow(int width, int height, int samples, const char* title, GLFWwindow* share, bool hidden, bool gpuculling)
 {
 	/// Create GLFW window
 	/// Setup for OpenGL version 3.3
-
-	if (!glfwInit()) {
+	/// If gpuculling a 4.3 context is asked for first and GPU culling is used if the
+	/// context has it, otherwise the window falls back to 3.3 and culls on the CPU
+	/// If share is set the context shares buffers, textures and shaders with it
+	/// If hidden the window is never shown and only provides a context, so is
+	/// made as small as possible
+	/// GLFW is initialised by the first window
+
+	if (glfwWindows == 0 && !glfwInit()) {
 		// Initialization failed
 		ShowMessage("GLFW initialization failed !!!");
 		return;
 	}
+	glfwWindows++;
+	glfwUser = true;
 	glfwSetErrorCallback(error_callback);
 
-	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
-	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
 	glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
-	glfwWindowHint(GLFW_SAMPLES, samples);
+	glfwWindowHint(GLFW_SAMPLES, hidden ? 0 : samples);
+	if(hidden) glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+
+	// 4.3 first if asked for, then 3.3, failing to get 4.3 is not reported
+	for(int attempt = gpuculling ? 0 : 1; attempt < 2 && window == nullptr; attempt++) {
+		glfwSetErrorCallback(attempt == 0 ? NULL : error_callback);
+		glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, attempt == 0 ? 4 : 3);
+		glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+		window = glfwCreateWindow(hidden ? 1 : width, hidden ? 1 : height, title, NULL, share);
+	}
+	glfwSetErrorCallback(error_callback);
+	glfwWindowHint(GLFW_VISIBLE, GLFW_TRUE);
 
-	window = glfwCreateWindow(width, height, title, NULL, NULL);
 	if (!window) {
 		// Window or OpenGL context creation failed
 		ShowMessage("Window or OpenGL context creation failed !!!");
@@ -424,6 +1098,14 @@ void __fastcall TOpenGLWindow::CreateWindow(int width, int height, int samples,
 		return;
 	}
 
+	// a 3.3 request may still give a later version
+	gpuCulling = gpuculling && GLAD_GL_VERSION_4_3;
+
+	glVersion = (char*)glGetString(GL_VERSION);
+	glVendor = (char*)glGetString(GL_VENDOR);
+	glRenderer = (char*)glGetString(GL_RENDERER);
+	glShaderVersion = (char*)glGetString(GL_SHADING_LANGUAGE_VERSION);
+
 	glViewport(0, 0, width, height);
 	glfwSwapInterval(1);
 
@@ -432,6 +1114,7 @@ void __fastcall TOpenGLWindow::CreateWindow(int width, int height, int samples,
 	glfwSetCursorPosCallback(window, cursor_position_callback);
 	glfwSetKeyCallback(window, key_callback);
 	glfwSetScrollCallback(window, scroll_callback);
+	glfwSetWindowRefreshCallback(window, window_refresh_callback);
 
 
 	#ifdef _DEBUG
@@ -442,11 +1125,53 @@ void __fastcall TOpenGLWindow::CreateWindow(int width, int height, int samples,
 }
 //---------------------------------------------------------------------------
 
+void __fastcall TOpenGLWindow::BackgroundUpload(bool enable)
+{
+	/// Upload large buffers and textures on a loader thread
+	/// The loader has its own hidden window with a context shared with this window
+	/// Data appears in the window when its upload has completed
+	/// The loader window is created and destroyed on the calling thread with the
+	/// context current here, so a render thread is stopped while this runs
+
+	if(window == nullptr) return;
+
+	bool restart = threaded;
+	if(restart) RenderThread(false);
+
+	if(enable && scene->uploadThread == nullptr) {
+		scene->uploadThread = new GLUploadThread(window);
+		if(!scene->uploadThread->Running()) {
+			delete scene->uploadThread;
+			scene->uploadThread = nullptr;
+		}
+	}
+	else if(!enable && scene->uploadThread != nullptr) {
+		// buffers and textures wait for their jobs before the thread is stopped
+		scene->colorBuffer.Finish();
+		for(GLTexture& tex : scene->textureList) {
+			tex.FinishUploads();
+		}
+		delete scene->uploadThread;
+		scene->uploadThread = nullptr;
+	}
+
+	if(restart) RenderThread(true);
+}
+//---------------------------------------------------------------------------
+
 void __fastcall TOpenGLWindow::ClearTextures()
 {
 	/// Delete added textures
 
-	textureList.clear();
+	if(Defer([=]() { ClearTextures(); })) {
+		queuedTextures = 0;
+		return;
+	}
+	MakeCurrent();
+
+	scene->textureList.clear();
+	if(scene->textureBatch != nullptr) scene->textureBatch->Invalidate();
+	SceneEdited();
 }
 //---------------------------------------------------------------------------
 
@@ -454,11 +1179,22 @@ void __fastcall TOpenGLWindow::ClearData()
 {
 	/// Delete added triangle data
 
-	colorList.clear();
+	if(Defer([=]() { ClearData(); })) return;
 
-	for(GLTexture& tex : textureList) {
+	scene->colorList.clear();
+	scene->colorRemap.clear();
+	scene->colorUnmap.clear();
+	scene->colorMin = glm::vec3(FLT_MAX);
+	scene->colorMax = glm::vec3(-FLT_MAX);
+	scene->colorBuffer.Invalidate();
+	scene->colorLayout = UniqueId();
+	scene->dataChanged = true;
+	SceneEdited();
+
+	for(GLTexture& tex : scene->textureList) {
 		tex.ClearTriangles();
 	}
+	if(scene->textureBatch != nullptr) scene->textureBatch->Invalidate();
 }
 //---------------------------------------------------------------------------
 
@@ -466,7 +1202,10 @@ void __fastcall TOpenGLWindow::ClearText2D()
 {
 	/// Delete added screen text
 
-	defaultFont->ClearText2D();
+	if(Defer([=]() { ClearText2D(); })) return;
+
+	windowText->ClearText2D();
+	redrawNeeded = true;
 }
 //---------------------------------------------------------------------------
 
@@ -474,7 +1213,10 @@ void __fastcall TOpenGLWindow::ClearText3D()
 {
 	/// Delete added world text
 
-	defaultFont->ClearText3D();
+	if(Defer([=]() { ClearText3D(); })) return;
+
+	windowText->ClearText3D();
+	redrawNeeded = true;
 }
 //---------------------------------------------------------------------------
 
@@ -482,11 +1224,24 @@ int  __fastcall TOpenGLWindow::AddTexture(const std::wstring& file, bool flip)
 {
 	/// Creates texture from bitmap file
 	/// Returns the index of the texture in the texture list
+	/// The file is loaded in the background and the texture is grey until it is ready
+
+	if(Defer([=]() { AddTexture(file, flip); })) return queuedTextures++;
+	MakeCurrent();
 
-	GLTexture& tex = textureList.emplace_back();
-	tex.LoadTextureFromFile(file, flip);
+	GLTexture& tex = scene->textureList.emplace_back();
+	if(scene->uploadThread != nullptr) {
+		tex.LoadTextureFromFile(file, flip, scene->uploadThread);
+	}
+	else {
+		// decode on worker, placeholder shown until ready
+		if(scene->decodeThread == nullptr) scene->decodeThread = new GLUploadThread(nullptr);
+		tex.LoadTextureAsync(file, flip, scene->decodeThread);
+	}
+	if(scene->textureBatch != nullptr) scene->textureBatch->Invalidate();
+	SceneEdited();
 
-	return textureList.size() - 1;
+	return scene->textureList.size() - 1;
 }
 //---------------------------------------------------------------------------
 
@@ -496,1620 +1251,5241 @@ int  __fastcall TOpenGLWindow::AddTexture(TBitmap* textureBMP, bool flip)
 	/// Returns the index of the texture in the texture list
 	/// If flip, bitmap is flipped vertically
 
-	GLTexture& tex = textureList.emplace_back();
-	tex.LoadTextureFromBitmap(textureBMP, flip);
+	if(OffRenderThread()) {
+		// copied as the caller may free the bitmap before the command runs
+		TBitmap* copy = new TBitmap();
+		copy->Assign(textureBMP);
+		Defer([=]() { AddTexture(copy, flip); delete copy; });
+		return queuedTextures++;
+	}
+	MakeCurrent();
+
+	GLTexture& tex = scene->textureList.emplace_back();
+	tex.LoadTextureFromBitmap(textureBMP, flip, scene->uploadThread, scene->uploadScheduler.Limited());
+	if(scene->textureBatch != nullptr) scene->textureBatch->Invalidate();
+	SceneEdited();
 
-	return textureList.size() - 1;
+	return scene->textureList.size() - 1;
 }
 //---------------------------------------------------------------------------
 
 void __fastcall TOpenGLWindow::CreateColorArrays()
 {
-	/// Set up vertex data and buffers and configure vertex attributes
-	/// for color triangles
-
-	if(colorVAO > 0) {
-		glDeleteVertexArrays(1, &colorVAO);
-		colorVAO = 0;
-	}
-	if(colorVBO > 0) {
-		glDeleteBuffers(1, &colorVBO);
-		colorVBO = 0;
-	}
-	if(colorList.size() == 0) return;
+	/// Upload color triangles to the vertex buffer
+	/// Only triangles added since the last upload are copied to the buffer
+	/// Windows attach their vertex arrays again if the buffer was reallocated
 
-	glGenVertexArrays(1, &colorVAO);
-	glBindVertexArray(colorVAO);
-
-	glGenBuffers(1, &colorVBO);
-	glBindBuffer(GL_ARRAY_BUFFER, colorVBO);
-	glBufferData(GL_ARRAY_BUFFER, colorList.size() * sizeof(GLColorTriangle), colorList.data(), GL_STATIC_DRAW);
+	scene->colorBuffer.Upload(scene->colorList.data(), scene->colorList.size(), scene->uploadThread, &scene->uploadScheduler);
+}
+//---------------------------------------------------------------------------
 
-	// position
-	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(GLColorVertex), (void*)0);
-	glEnableVertexAttribArray(0);
+void __fastcall TOpenGLWindow::SortTriangles()
+{
+	/// Reorder color and texture triangles by Morton code of their centroid
+	/// Spatially close triangles become close in memory which helps picking and depth testing
+	/// Indices in GLPickResult and passed to SetElementColor are not changed by sorting
 
-	// norm
-	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(GLColorVertex), (void*)(3 * sizeof(float)));
-	glEnableVertexAttribArray(1);
+	if(Defer([=]() { SortTriangles(); })) return;
 
-	// color
-	glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(GLColorVertex), (void*)(6 * sizeof(float)));
-	glEnableVertexAttribArray(2);
+	MortonSort(scene->colorList, scene->colorRemap, scene->colorUnmap);
+	scene->colorBuffer.Invalidate();
+	scene->colorLayout = UniqueId();
+	scene->dataChanged = true;
+	SceneEdited();
 
-	glBindVertexArray(0);
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	for(GLTexture& tex : scene->textureList) {
+		tex.SortTriangles();
+	}
+	if(scene->textureBatch != nullptr) scene->textureBatch->Invalidate();
 }
 //---------------------------------------------------------------------------
 
-void __fastcall TOpenGLWindow::Render()
+float __fastcall TOpenGLWindow::UploadPriority(glm::vec3& minpos, glm::vec3& maxpos)
 {
-	/// Draw the triangles and text to the window
-
-	if(backFaceCull) {
-		glEnable(GL_CULL_FACE);
-		glCullFace(GL_BACK);
-	}
-	else {
-		glDisable(GL_CULL_FACE);
-	}
-	glDisable(GL_BLEND);
-	glEnable(GL_DEPTH_TEST);
+	/// Approximate size on screen of a bounding box used to order uploads
+	/// Boxes behind the camera get a low priority
 
-	// setup perspective view from camera position
-	int width, height;
-	glfwGetWindowSize(window, &width, &height);
-	glViewport(0, 0, width, height);
-	glm::mat4 projection = glm::perspective(cameraFOV, (float)width / (float)height, cameraNear, cameraFar);
+	if(minpos.x > maxpos.x) return 0.0f;   // empty
 
-	glm::mat4 lookat = glm::lookAt(cameraPos, cameraLookat, cameraUp);
-	glm::mat4 pvm = projection * lookat;
+	glm::vec3 center = (minpos + maxpos) * 0.5f;
+	float radius = glm::length(maxpos - minpos) * 0.5f;
+	glm::vec3 tocenter = center - cameraPos;
+	float dist = glm::length(tocenter);
 
-	// clear screen
-	glClearColor (0.1, 0.1, 0.2, 0.0);
-	glClearDepth(1.0f);
-	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	if(dist <= radius) return FLT_MAX;   // camera inside box
 
-	if(dataChanged) {
-		CreateColorArrays();
-		dataChanged = false;
-	}
+	float size = radius / dist;
 
-	if(colorList.size() > 0) {
-		// draw color triangles
-		glUseProgram(colorShader);
+	glm::vec3 viewdir = glm::normalize(cameraLookat - cameraPos);
+	if(glm::dot(tocenter, viewdir) < -radius) size *= 0.01f;
 
-		int pvm_loc = glGetUniformLocation(colorShader, "pvm");
-		glUniformMatrix4fv(pvm_loc, 1, GL_FALSE, glm::value_ptr(pvm));
-		int light_loc = glGetUniformLocation(colorShader, "light_dir");
-		glUniform3fv(light_loc, 1, glm::value_ptr(lightDir));
-		int color_loc = glGetUniformLocation(colorShader, "light_color");
-		glUniform3fv(color_loc, 1, glm::value_ptr(lightColor));
-		int ambient_loc = glGetUniformLocation(colorShader, "ambient_color");
-		glUniform3fv(ambient_loc, 1, glm::value_ptr(ambientColor));
+	return size;
+}
+//---------------------------------------------------------------------------
 
-		glBindVertexArray(colorVAO);
+void __fastcall TOpenGLWindow::BatchTextures(GLTextureBatching mode, int layersize)
+{
+	/// Put the triangles of all textures in one shared buffer to cut draw calls
+	/// MULTIDRAW: one glMultiDrawArrays for each texture
+	/// ARRAY: textures are copied and resized to layersize into the layers of a texture
+	/// array and all textured triangles are drawn with one call
+	/// ARRAY falls back to MULTIDRAW if there are more textures than array layers
+	/// NONE: one draw call for each texture
 
-		glDrawArrays(GL_TRIANGLES, 0, colorList.size() * 3);
-	}
+	if(Defer([=]() { BatchTextures(mode, layersize); })) return;
 
-	if(textureList.size() > 0) {
-		// draw texture triangles
-		glUseProgram(textureShader);
+	if(window == nullptr) return;
+	MakeCurrent();
 
-		int pvm_loc = glGetUniformLocation(textureShader, "pvm");
-		glUniformMatrix4fv(pvm_loc, 1, GL_FALSE, glm::value_ptr(pvm));
-		int light_loc = glGetUniformLocation(textureShader, "light_dir");
-		glUniform3fv(light_loc, 1, glm::value_ptr(lightDir));
-		int color_loc = glGetUniformLocation(textureShader, "light_color");
-		glUniform3fv(color_loc, 1, glm::value_ptr(lightColor));
-		int ambient_loc = glGetUniformLocation(textureShader, "ambient_color");
-		glUniform3fv(ambient_loc, 1, glm::value_ptr(ambientColor));
+	if(scene->textureBatch != nullptr) {
+		delete scene->textureBatch;
+		scene->textureBatch = nullptr;
+	}
 
-		for(GLTexture& tex : textureList) {
-            tex.Render();
-		}
+	if(mode != GLTextureBatching::NONE) {
+		scene->textureBatch = new GLTextureBatch(mode == GLTextureBatching::ARRAY, layersize, scene->textureShader);
 	}
+	SceneEdited();
+}
+//---------------------------------------------------------------------------
 
-	// draw text
-	defaultFont->Render3D(window, pvm, depthText);
-	defaultFont->Render2D(window);
+void __fastcall TOpenGLWindow::SetUploadBudget(int bytes, double milliseconds)
+{
+	/// Limit the data uploaded to the GPU in one frame
+	/// bytes is the maximum number of bytes, 0 for no limit
+	/// milliseconds is the maximum time spent uploading, 0 for no limit
+	/// Data that does not fit is uploaded in following frames, largest on screen first
+	/// Triangles are drawn as they arrive, textures when complete
 
-	// display result
-	glfwSwapBuffers(window);
-    glfwPollEvents();
+	if(Defer([=]() { SetUploadBudget(bytes, milliseconds); })) return;
+
+	scene->uploadScheduler.SetBudget(bytes, milliseconds);
 }
 //---------------------------------------------------------------------------
 
-void __fastcall TOpenGLWindow::SetCamera(glm::vec3& pos, glm::vec3& lookat, glm::vec3& up)
+void __fastcall TOpenGLWindow::UpdateScene()
 {
-	/// Set camera position, lookat point and up vector
+	/// Upload camera and light state to the scene uniform buffer
+	/// Only called when SetCamera, SetLightDir, SetLightColor, SetAmbientColor,
+	/// the point lights or the window size changed them
 
-	cameraPos = pos;
-	cameraLookat = lookat;
-	cameraUp = up;
+	glm::mat4 projection = glm::perspective(cameraFOV, (float)viewWidth / (float)viewHeight, cameraNear, cameraFar);
+	glm::mat4 lookat = glm::lookAt(cameraPos, cameraLookat, cameraUp);
+	scenePVM = projection * lookat;
+	sceneFrustum.Set(scenePVM);
+
+	GLSceneUniforms uniforms;
+	memcpy(uniforms.pvm, glm::value_ptr(scenePVM), sizeof(uniforms.pvm));
+	memcpy(uniforms.lightDir, glm::value_ptr(lightDir), 3 * sizeof(float));
+	memcpy(uniforms.lightColor, glm::value_ptr(lightColor), 3 * sizeof(float));
+	memcpy(uniforms.ambientColor, glm::value_ptr(ambientColor), 3 * sizeof(float));
+	uniforms.lightDir[3] = uniforms.lightColor[3] = uniforms.ambientColor[3] = 0.0f;
+
+	tilesX = std::max(1, (viewWidth + tileSize - 1) / tileSize);
+	tilesY = std::max(1, (viewHeight + tileSize - 1) / tileSize);
+	uniforms.tiles[0] = tilesX;
+	uniforms.tiles[1] = tilesY;
+	uniforms.tiles[2] = scene->pointLights.size();
+	uniforms.tiles[3] = 0;
+
+	glBindBuffer(GL_UNIFORM_BUFFER, sceneUBO);
+	glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(GLSceneUniforms), &uniforms);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
 }
 //---------------------------------------------------------------------------
 
-void __fastcall TOpenGLWindow::AddText2D(float x, float y, float height, GLTextPos horiz_align, GLTextPos vert_align, const char* str, glm::vec3 color)
+void __fastcall TOpenGLWindow::BinLights()
 {
-	/// Display text on screen using default font
-	/// x, y are screen position (0 to 1)
-	/// height is character size
-	/// horiz_align, vert_align are position of text relative to x,y
-	/// Can be LEFT, CENTER or RIGHT / ABOVE, CENTER or BELOW
-	/// str is the text string - ASCII only
-	/// color is the text color
+	/// Make the list of point lights reaching each tile of the view and upload it
+	/// with the lights to the texture buffers read by the shaders
+	/// A light's tiles are those covered by the box around its sphere on screen,
+	/// all tiles if the box reaches behind the camera, none if it is outside the view
+	/// Called after UpdateScene as the camera or lights changed
+
+	binnedLights = scene->lightRevision;
+	std::vector<GLPointLight>& lights = scene->pointLights;
+	if(lights.size() == 0) return;
+
+	if(lightBuffer == 0) {
+		glGenBuffers(1, &lightBuffer);
+		glGenTextures(1, &lightTexture);
+		glBindTexture(GL_TEXTURE_BUFFER, lightTexture);
+		glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, lightBuffer);
+
+		glGenBuffers(1, &tileBuffer);
+		glGenTextures(1, &tileTexture);
+		glBindTexture(GL_TEXTURE_BUFFER, tileTexture);
+		glTexBuffer(GL_TEXTURE_BUFFER, GL_R32UI, tileBuffer);
+		glBindTexture(GL_TEXTURE_BUFFER, 0);
+	}
 
-    if(str == nullptr || strlen(str) == 0) return;
-	defaultFont->AddText2D(x, y, height, horiz_align, vert_align, str, color);
+	// tiles covered by each light, counted per tile
+	int tilecount = tilesX * tilesY;
+	tileData.assign(tilecount * 2, 0);
+	lightTiles.resize(lights.size());
+	int total = 0;
+	for(int l=0; l<lights.size(); l++) {
+		GLPointLight& light = lights[l];
+		glm::ivec4& range = lightTiles[l];
+		range = glm::ivec4(0, 0, -1, -1);
+
+		glm::vec3 extent(light.radius);
+		if(!sceneFrustum.Intersects(light.position, extent)) continue;
+
+		glm::vec2 minpos(1.0f);
+		glm::vec2 maxpos(-1.0f);
+		bool behind = false;
+		for(int c=0; c<8 && !behind; c++) {
+			glm::vec3 corner = light.position + glm::vec3((c & 1) ? light.radius : -light.radius,
+				(c & 2) ? light.radius : -light.radius, (c & 4) ? light.radius : -light.radius);
+			glm::vec4 clip = scenePVM * glm::vec4(corner, 1.0f);
+			if(clip.w <= 0.0001f) {
+				behind = true;
+			}
+			else {
+				glm::vec2 ndc = glm::vec2(clip) / clip.w;
+				minpos = glm::min(minpos, ndc);
+				maxpos = glm::max(maxpos, ndc);
+			}
+		}
+		if(behind) {
+			range = glm::ivec4(0, 0, tilesX - 1, tilesY - 1);
+		}
+		else {
+			range.x = std::max(0, (int)((minpos.x * 0.5f + 0.5f) * tilesX));
+			range.y = std::max(0, (int)((minpos.y * 0.5f + 0.5f) * tilesY));
+			range.z = std::min(tilesX - 1, (int)((maxpos.x * 0.5f + 0.5f) * tilesX));
+			range.w = std::min(tilesY - 1, (int)((maxpos.y * 0.5f + 0.5f) * tilesY));
+		}
+
+		for(int y=range.y; y<=range.w; y++) {
+			for(int x=range.x; x<=range.z; x++) {
+				tileData[(y * tilesX + x) * 2 + 1]++;
+			}
+		}
+		total += std::max(0, range.z - range.x + 1) * std::max(0, range.w - range.y + 1);
+	}
+
+	// each tile's list starts after the headers and the lists before it
+	unsigned int first = tilecount * 2;
+	for(int t=0; t<tilecount; t++) {
+		tileData[t * 2] = first;
+		first += tileData[t * 2 + 1];
+		tileData[t * 2 + 1] = 0;
+	}
+	tileData.resize(tilecount * 2 + total);
+	for(int l=0; l<lights.size(); l++) {
+		glm::ivec4& range = lightTiles[l];
+		for(int y=range.y; y<=range.w; y++) {
+			for(int x=range.x; x<=range.z; x++) {
+				int t = y * tilesX + x;
+				tileData[tileData[t * 2] + tileData[t * 2 + 1]++] = l;
+			}
+		}
+	}
+
+	// position and radius, then color, of each light
+	std::vector<float> lightdata(lights.size() * 8);
+	for(int l=0; l<lights.size(); l++) {
+		float* data = &lightdata[l * 8];
+		memcpy(data, glm::value_ptr(lights[l].position), 3 * sizeof(float));
+		data[3] = lights[l].radius;
+		memcpy(data + 4, glm::value_ptr(lights[l].color), 3 * sizeof(float));
+		data[7] = 0.0f;
+	}
+
+	glBindBuffer(GL_TEXTURE_BUFFER, lightBuffer);
+	glBufferData(GL_TEXTURE_BUFFER, lightdata.size() * sizeof(float), lightdata.data(), GL_STREAM_DRAW);
+	glBindBuffer(GL_TEXTURE_BUFFER, tileBuffer);
+	glBufferData(GL_TEXTURE_BUFFER, tileData.size() * sizeof(unsigned int), tileData.data(), GL_STREAM_DRAW);
+	glBindBuffer(GL_TEXTURE_BUFFER, 0);
 }
 //---------------------------------------------------------------------------
 
-void __fastcall TOpenGLWindow::AddText3D(glm::vec3 pos, float height, GLTextPos xpos, GLTextPos ypos, const char* str, glm::vec3 color, bool point)
+void __fastcall TOpenGLWindow::GetStateCalls(int& issued, int& skipped)
 {
-	/// Display text in the world using default font
-	/// pos is world coordinates
-	/// height is character size
-	/// horiz_align, vert_align are position of text relative to pos
-	/// Can be LEFT, CENTER or RIGHT / ABOVE, CENTER or BELOW
-	/// str is the text string - ASCII only
-	/// color is the text color
-	/// point if true draws a point at pos
+	/// Number of state changes made and skipped as redundant in the last frame
 
-	defaultFont->AddText3D(pos, height, xpos, ypos, str, color, point);
+	GLRenderStats stats = GetRenderStats();
+	issued = stats.stateIssued;
+	skipped = stats.stateSkipped;
 }
 //---------------------------------------------------------------------------
 
-void __fastcall TOpenGLWindow::AddTriangleVC(glm::vec3& p1, glm::vec3& p2, glm::vec3& p3, glm::vec3& c1, glm::vec3& c2, glm::vec3& c3)
+GLRenderStats __fastcall TOpenGLWindow::GetRenderStats()
 {
-	/// Add triangle colored by color of vertices
-	/// The normal of the vertices is the normal of the triangle (flat shaded)
-	/// p1, p2, p3: position of three vertices
-	/// c1, c2, c3: color of three vertices
-
-	GLColorTriangle& tri = colorList.emplace_back();
-
-	memcpy(tri.vert[0].pos, glm::value_ptr(p1), 3 * sizeof(float));
-	memcpy(tri.vert[1].pos, glm::value_ptr(p2), 3 * sizeof(float));
-	memcpy(tri.vert[2].pos, glm::value_ptr(p3), 3 * sizeof(float));
+	/// Counts and timings of the last frame drawn
 
-	memcpy(tri.vert[0].color, glm::value_ptr(c1), 3 * sizeof(float));
-	memcpy(tri.vert[1].color, glm::value_ptr(c2), 3 * sizeof(float));
-	memcpy(tri.vert[2].color, glm::value_ptr(c3), 3 * sizeof(float));
+	std::lock_guard<std::recursive_mutex> lock(sceneMutex);
+	return renderStats;
+}
+//---------------------------------------------------------------------------
 
-	glm::vec3 norm = glm::triangleNormal(p1, p2, p3);
+void __fastcall TOpenGLWindow::Render()
+{
+	/// Draw the triangles and text to the window and handle window events
+	/// With a render thread running the frame is drawn there and this only handles events
 
-	memcpy(tri.vert[0].norm, glm::value_ptr(norm), 3 * sizeof(float));
-	memcpy(tri.vert[1].norm, glm::value_ptr(norm), 3 * sizeof(float));
-	memcpy(tri.vert[2].norm, glm::value_ptr(norm), 3 * sizeof(float));
+	if(Defer([=]() { redrawNeeded = true; })) {
+		glfwPollEvents();
+		return;
+	}
 
-	dataChanged = true;
+	RenderFrame();
+    glfwPollEvents();
 }
 //---------------------------------------------------------------------------
 
-void __fastcall TOpenGLWindow::AddTriangleVNC(glm::vec3& p1, glm::vec3& p2, glm::vec3& p3, glm::vec3& n1, glm::vec3& n2, glm::vec3& n3, glm::vec3& c1, glm::vec3& c2, glm::vec3& c3)
+void __fastcall TOpenGLWindow::RenderFrame()
 {
-	/// Add triangle colored by color of vertices
-	/// p1, p2, p3: position of three vertices
-	/// n1, n2, n3: normal at each vertex
-	/// c1, c2, c3: color of three vertices
+	/// Draw the triangles and text to the window
+	/// State changes go through glState so unchanged state is not set again
 
-	GLColorTriangle& tri = colorList.emplace_back();
+	// windows sharing a scene are drawn one after another on this thread
+	MakeCurrent();
+	frameTimer.BeginFrame();
+	if(dynamicResolution) UpdateRenderScale();
 
-	memcpy(tri.vert[0].pos, glm::value_ptr(p1), 3 * sizeof(float));
-	memcpy(tri.vert[1].pos, glm::value_ptr(p2), 3 * sizeof(float));
-	memcpy(tri.vert[2].pos, glm::value_ptr(p3), 3 * sizeof(float));
+	// chunks are tested for occlusion again after a change, frames drawn only to
+	// read the results of earlier tests start no new ones
+	bool edited = scene->dataChanged || drawnRevision != scene->revision;
+	bool retest = redrawNeeded || sceneChanged || edited;
+	redrawNeeded = false;
+	drawnRevision = scene->revision;
 
-	memcpy(tri.vert[0].color, glm::value_ptr(c1), 3 * sizeof(float));
-	memcpy(tri.vert[1].color, glm::value_ptr(c2), 3 * sizeof(float));
-	memcpy(tri.vert[2].color, glm::value_ptr(c3), 3 * sizeof(float));
+	glState.Enable(GL_CULL_FACE, backFaceCull);
+	if(backFaceCull) glState.CullFace(GL_BACK);
+	glState.Enable(GL_BLEND, false);
+	glState.Enable(GL_DEPTH_TEST, true);
 
-	memcpy(tri.vert[0].norm, glm::value_ptr(n1), 3 * sizeof(float));
-	memcpy(tri.vert[1].norm, glm::value_ptr(n2), 3 * sizeof(float));
-	memcpy(tri.vert[2].norm, glm::value_ptr(n3), 3 * sizeof(float));
+	// setup perspective view from camera position
+	int width, height;
+	WindowSize(width, height);
+	glViewport(0, 0, width, height);
+	if(width != viewWidth || height != viewHeight) {
+		viewWidth = width;
+		viewHeight = height;
+		sceneChanged = true;
+	}
+	if(binnedLights != scene->lightRevision) sceneChanged = true;
+	if(sceneChanged) {
+		UpdateScene();
+		BinLights();
+		sceneChanged = false;
+	}
 
-	dataChanged = true;
+	// queue uploads, largest on screen first, and send what fits in the budget
+	// the first window sharing the scene to draw sends them for all
+	if(scene->dataChanged) {
+		scene->uploadScheduler.Queue(UploadPriority(scene->colorMin, scene->colorMax), [this]() {
+			CreateColorArrays();
+			scene->dataChanged = scene->colorBuffer.Pending() || scene->colorBuffer.Count() < scene->colorList.size();
+		});
+	}
+	bool batched = scene->textureBatch != nullptr;
+	for(GLTexture& tex : scene->textureList) {
+		if(tex.NeedsUpload(!batched)) {
+			GLTexture* ptex = &tex;
+			scene->uploadScheduler.Queue(UploadPriority(tex.boundsMin, tex.boundsMax), [this, ptex, batched]() {
+				ptex->Update(scene->uploadThread, &scene->uploadScheduler, !batched);
+			});
+		}
+	}
+	if(batched) {
+		scene->uploadScheduler.Queue(FLT_MAX, [this]() {
+			scene->textureBatch->Update(scene->textureList, scene->uploadThread, &scene->uploadScheduler);
+		});
+	}
+	bool uploading = scene->uploadScheduler.Queued();
+	scene->uploadScheduler.Drain();
+
+	if(scene->windows > 1) {
+		// other contexts wait on the GPU, not here, for uploads before drawing from them
+		if(uploading) {
+			if(scene->uploadFence != nullptr) glDeleteSync(scene->uploadFence);
+			scene->uploadFence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+			glFlush();
+		}
+		if(scene->uploadFence != nullptr) glWaitSync(scene->uploadFence, 0, GL_TIMEOUT_IGNORED);
+	}
+
+	// follow buffers replaced by uploads here or in another window
+	SyncViews();
+
+	// offscreen frames are drawn to a framebuffer of the image size
+	// bound after the uploads as copying texture layers binds framebuffers
+	// if it cannot be made the frame is drawn to the hidden window and GetImage fails
+	bool targetfailed = false;
+	if(offscreen) {
+		if(renderTarget == nullptr) renderTarget = new GLRenderTarget();
+		if(renderTarget->Resize(width, height, imageSamples)) {
+			renderTarget->Bind();
+		}
+		else {
+			glBindFramebuffer(GL_FRAMEBUFFER, 0);
+			targetfailed = true;
+		}
+	}
+
+	// with dynamic resolution or FXAA the 3D pass is drawn to a window sized framebuffer
+	// and copied to the window after by a screen pass
+	// scaled frames use the lower left of it, so changing the scale never reallocates it
+	// FXAA frames are single sample, the pass does the antialiasing
+	// if the framebuffer cannot be made the frame is drawn to the window at full size
+	bool postpass = false;
+	int scaledWidth = width;
+	int scaledHeight = height;
+	if((dynamicResolution || fxaa) && !offscreen) {
+		if(sceneTarget == nullptr) sceneTarget = new GLRenderTarget();
+		postpass = sceneTarget->Resize(width, height, fxaa ? 0 : imageSamples);
+		if(postpass) {
+			if(dynamicResolution) {
+				scaledWidth = std::max(1, (int)(width * renderScale + 0.5f));
+				scaledHeight = std::max(1, (int)(height * renderScale + 0.5f));
+			}
+			sceneTarget->Bind();
+			glViewport(0, 0, scaledWidth, scaledHeight);
+		}
+		else {
+			targetfailed = true;
+		}
+	}
+
+	// uploads and edits bind objects directly
+	glState.InvalidateBindings();
+
+	// clear screen
+	glClearColor (0.1, 0.1, 0.2, 0.0);
+	glClearDepth(1.0f);
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+	// find chunks of triangles inside the view and not hidden in an earlier frame
+	GLRenderStats stats;
+	for(GLTexture& tex : scene->textureList) {
+		if(tex.LoadFailed()) stats.texturesFailed++;
+	}
+	std::chrono::steady_clock::time_point cullstart = std::chrono::steady_clock::now();
+	GLFrustum* frustum = frustumCull ? &sceneFrustum : nullptr;
+
+	// with GPU culling the cull shader writes the draw commands, occlusion culling
+	// reads query results here so keeps the CPU path
+	GLCullCompute* compute = nullptr;
+	if(gpuCulling && !occlusionCull) {
+		if(cullCompute == nullptr) cullCompute = new GLCullCompute();
+		compute = cullCompute;
+		compute->Begin(glState, frustum);
+	}
+
+	colorView.chunks.Update(scene->colorList);
+	colorView.indirect = compute != nullptr;
+	if(colorView.indirect) colorView.chunks.CullIndirect(*compute, colorView.array.Ready() ? scene->colorBuffer.Count() : 0, stats);
+	else colorView.chunks.Cull(frustum, stats, occlusionCull);
+	if(batched) {
+		// only the texture array is drawn with one call
+		GLCullCompute* batchcompute = scene->textureBatch->UseArray(scene->textureList.size()) ? compute : nullptr;
+		scene->textureBatch->Cull(batchView, frustum, stats, occlusionCull, batchcompute);
+	}
+	else {
+		for(int t=0; t<scene->textureList.size(); t++) {
+			scene->textureList[t].Cull(textureViews[t], frustum, stats, occlusionCull, compute);
+		}
+	}
+	if(compute != nullptr) compute->End();
+	if(occlusionCull && OcclusionChanged()) retest = true;
+	std::chrono::duration<double, std::milli> culltime = std::chrono::steady_clock::now() - cullstart;
+	stats.cullTime = culltime.count();
+	if(stats.trianglesTotal > 0) stats.occludedPercent = 100.0 * stats.trianglesOccluded / stats.trianglesTotal;
+
+	// visible ranges of color triangles
+	colorView.drawFirst.clear();
+	colorView.drawCount.clear();
+	if(scene->colorBuffer.Count() > 0 && colorView.array.Ready() && !colorView.indirect) {
+		colorView.chunks.Clip(0, scene->colorBuffer.Count(), colorView.drawFirst, colorView.drawCount);
+	}
+
+	// tile light lists read by the color and texture shaders
+	if(scene->pointLights.size() > 0) {
+		glState.BindTexture(lightUnit, lightTexture, GL_TEXTURE_BUFFER);
+		glState.BindTexture(tileUnit, tileTexture, GL_TEXTURE_BUFFER);
+	}
+
+	if(depthPrepass) {
+		// lay down depth first so the main pass shades each pixel once
+		glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+		DrawTriangles(batched, scene->depthShader);
+		glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+
+		glDepthFunc(GL_EQUAL);
+		glDepthMask(GL_FALSE);
+		DrawTriangles(batched, 0);
+		glDepthFunc(GL_LESS);
+		glDepthMask(GL_TRUE);
+	}
+	else {
+		DrawTriangles(batched, 0);
+	}
+
+	if(occlusionCull && retest) {
+		// test chunk boxes against the depth buffer, results are read in a later frame
+		if(boxQuery == nullptr) boxQuery = new GLBoxQuery();
+		boxQuery->Begin(glState, cameraPos, cameraNear * 2.0f);
+		colorView.chunks.Query(*boxQuery);
+		if(batched) {
+			batchView.chunks.Query(*boxQuery);
+		}
+		else {
+			for(GLBufferView& view : textureViews) {
+				view.chunks.Query(*boxQuery);
+			}
+		}
+		boxQuery->End();
+		glState.Enable(GL_CULL_FACE, backFaceCull);
+	}
+
+	// draw text, 3D text is part of the 3D pass and 2D text is drawn to the window after
+	windowText->Render3D(viewWidth, viewHeight, scenePVM, depthText, streamBuffer, glState);
+	if(postpass) {
+		// drawn as a triangle since a multisampled window cannot be blitted to
+		sceneTarget->Resolve();
+		glViewport(0, 0, width, height);
+		GLScreenPass*& pass = fxaa ? fxaaPass : upscalePass;
+		if(pass == nullptr) pass = new GLScreenPass(fxaa ? fxaaFragmentSource : upscaleFragmentSource);
+		pass->Draw(glState, sceneTarget->Texture(), width, height, scaledWidth, scaledHeight);
+	}
+	windowText->Render2D(viewWidth, viewHeight, streamBuffer, glState);
+
+	// multisampled offscreen frames are resolved so they can be read
+	if(offscreen) renderTarget->Resolve();
+
+	// start reading the frame back, finished reads from earlier frames are handed over
+	if(captureCallback != nullptr && !CaptureRead()) targetfailed = true;
+	frameCapture.Poll(this);
+
+	// fence data written to stream buffer this frame
+	streamBuffer.EndFrame();
+	glState.EndFrame();
+	stats.stateIssued = glState.Issued();
+	stats.stateSkipped = glState.Skipped();
+	stats.renderScale = postpass && dynamicResolution ? renderScale : 1.0f;
+	stats.targetFailed = targetfailed;
+	{
+		std::lock_guard<std::recursive_mutex> lock(sceneMutex);
+		renderStats = stats;
+	}
+	frameTimer.EndFrame();
+
+	// display result, offscreen frames are read with GetImage
+	// offscreen frames are flushed instead, as the fences of this frame, polled
+	// without waiting for stream regions, texture loads and captures, are only sure
+	// to signal once their commands have been sent to the GPU
+	if(!offscreen) glfwSwapBuffers(window);
+	else glFlush();
+	if(framePacing == GLFramePacing::TARGET) PaceFrame();
+	frameTimer.Presented();
 }
 //---------------------------------------------------------------------------
 
-void __fastcall TOpenGLWindow::AddTriangleVT(glm::vec3& p1, glm::vec3& p2, glm::vec3& p3, glm::vec2& t1, glm::vec2& t2, glm::vec2& t3, int texid)
+void __fastcall TOpenGLWindow::DrawTriangles(bool batched, unsigned int depthshader)
 {
-	/// Add triangle colored by texture
-	/// The normal of the vertices is the normal of the triangle (flat shaded)
-	/// p1, p2, p3: position of three vertices
-	/// t1, t2, t3: texture coordinates of three vertices
-	/// texid: index of texture returned by AddTexture
+	/// Draw the visible color and texture triangles
+	/// If depthshader is set all triangles are drawn with it and no textures are bound
+
+	if(colorView.indirect) {
+		// draw color triangles with the commands written by the cull shader
+		if(scene->colorBuffer.Count() > 0 && colorView.array.Ready()) {
+			glState.UseProgram(depthshader != 0 ? depthshader : scene->colorShader);
+			colorView.array.Bind(glState);
+			colorView.chunks.DrawIndirect();
+		}
+	}
+	else if(colorView.drawFirst.size() > 0) {
+		// draw color triangles
+		glState.UseProgram(depthshader != 0 ? depthshader : scene->colorShader);
+		colorView.array.Bind(glState);
+		glMultiDrawArrays(GL_TRIANGLES, colorView.drawFirst.data(), colorView.drawCount.data(), colorView.drawFirst.size());
+	}
 
-	GLTexture& tex = textureList[texid];
-	tex.AddTriangleVT(p1, p2, p3, t1, t2, t3);
+	if(batched) {
+		// draw texture triangles from shared buffer
+		scene->textureBatch->Render(batchView, scene->textureList, glState, depthshader);
+	}
+	else if(scene->textureList.size() > 0) {
+		// draw texture triangles
+		glState.UseProgram(depthshader != 0 ? depthshader : scene->textureShader);
+
+		for(int t=0; t<scene->textureList.size(); t++) {
+			scene->textureList[t].Render(textureViews[t], glState, depthshader == 0);
+		}
+	}
 }
 //---------------------------------------------------------------------------
 
-void __fastcall TOpenGLWindow::AddTriangleVNT(glm::vec3& p1, glm::vec3& p2, glm::vec3& p3, glm::vec3& n1, glm::vec3& n2, glm::vec3& n3, glm::vec2& t1, glm::vec2& t2, glm::vec2& t3, int texid)
+void __fastcall TOpenGLWindow::SyncViews()
 {
-	/// Add triangle colored by texture
-	/// p1, p2, p3: position of three vertices
-	/// n1, n2, n3: normal at each vertex
-	/// t1, t2, t3: texture coordinates of three vertices
-	/// texid: index of texture returned by AddTexture
+	/// Match this window's vertex arrays and chunks to the buffers of the scene
+	/// Buffers may have been replaced, and textures added or removed, through another
+	/// window sharing the scene
+	/// Called with the context current as vertex arrays are not shared
 
-	GLTexture& tex = textureList[texid];
-	tex.AddTriangleVNT(p1, p2, p3, n1, n2, n3, t1, t2, t3);
+	colorView.Sync(scene->colorBuffer, scene->colorLayout);
+
+	while(textureViews.size() > scene->textureList.size()) {
+		textureViews.pop_back();
+	}
+	while(textureViews.size() < scene->textureList.size()) {
+		GLBufferView& view = textureViews.emplace_back(sizeof(GLTextureVertex));
+		view.array.Attribute(0, 3, 0);                   // position
+		view.array.Attribute(1, 3, 3 * sizeof(float));   // norm
+		view.array.Attribute(2, 3, 6 * sizeof(float));   // color
+		view.array.Attribute(3, 2, 9 * sizeof(float));   // texture coord
+	}
+	for(int t=0; t<textureViews.size(); t++) {
+		scene->textureList[t].SyncView(textureViews[t]);
+	}
+
+	if(scene->textureBatch != nullptr) scene->textureBatch->SyncView(batchView);
 }
 //---------------------------------------------------------------------------
 
-void __fastcall TOpenGLWindow::GetMousePos(double& x, double& y)
+bool __fastcall TOpenGLWindow::OcclusionPending()
 {
-	/// Returns current cursor position
+	/// True if an occlusion query of any view has not been read yet
 
-	if(window == nullptr) return;
-	glfwGetCursorPos(window, &x, &y);
+	if(colorView.chunks.QueryPending() || batchView.chunks.QueryPending()) return true;
+	for(GLBufferView& view : textureViews) {
+		if(view.chunks.QueryPending()) return true;
+	}
+	return false;
 }
 //---------------------------------------------------------------------------
 
-void __fastcall TOpenGLWindow::SetLightDir(glm::vec3& dir)
+bool __fastcall TOpenGLWindow::OcclusionChanged()
 {
-	/// Set the light direction
-	/// Stored as negative of given direction
-	/// Because surface normal in same direction as light should be fully lit
+	/// True if the query results read by the last cull hid or showed a chunk
 
-	lightDir = -glm::normalize(dir);
+	if(colorView.chunks.ResultsChanged() || batchView.chunks.ResultsChanged()) return true;
+	for(GLBufferView& view : textureViews) {
+		if(view.chunks.ResultsChanged()) return true;
+	}
+	return false;
 }
 //---------------------------------------------------------------------------
 
-void __fastcall TOpenGLWindow::SetAmbientColor(TAlphaColor color)
+void __fastcall TOpenGLWindow::DynamicResolution(bool enable, double milliseconds, float minscale)
 {
-	float red = (float)((color >> 16) & 0xFF) / 255.0f;
-	float green = (float)((color >> 8) & 0xFF) / 255.0f;
-	float blue = (float)(color & 0xFF) / 255.0f;
-	ambientColor = glm::vec3(red, green, blue);
+	/// Draw the 3D pass at a fraction of the window size that adapts each frame so
+	/// the GPU time of a frame stays near milliseconds, then scale it up to the window
+	/// The fraction stays between minscale and 1, 2D text is always drawn at full size
+	/// Offscreen windows always draw at the image size
+
+	if(Defer([=]() { DynamicResolution(enable, milliseconds, minscale); })) return;
+
+	dynamicResolution = enable;
+	targetFrameTime = milliseconds > 0.0 ? milliseconds : 14.0;
+	minRenderScale = std::min(std::max(minscale, 0.1f), 1.0f);
+	renderScale = 1.0f;
+	redrawNeeded = true;
 }
 //---------------------------------------------------------------------------
 
-void __fastcall TOpenGLWindow::SetLightColor(TAlphaColor color)
+void __fastcall TOpenGLWindow::FXAA(bool enable)
 {
-	float red = (float)((color >> 16) & 0xFF) / 255.0f;
-	float green = (float)((color >> 8) & 0xFF) / 255.0f;
-	float blue = (float)(color & 0xFF) / 255.0f;
-	lightColor = glm::vec3(red, green, blue);
+	/// Antialias with a post process pass instead of multisampling
+	/// The 3D pass is drawn to a single sample framebuffer and FXAA blends the pixels on
+	/// edges as it is copied to the window, 2D text is drawn after and not blurred
+	/// Create the window with 0 samples so the window itself is not multisampled
+	/// Offscreen windows always draw with their own samples
+
+	if(Defer([=]() { FXAA(enable); })) return;
+
+	fxaa = enable;
+	redrawNeeded = true;
 }
 //---------------------------------------------------------------------------
 
-void __fastcall TOpenGLWindow::KeyCallback(int key, int scancode, int action, int mods)
+void __fastcall TOpenGLWindow::UpdateRenderScale()
 {
-	/// Called by key press in GLFW window
-	/// Passed to handler if set
+	/// Move the render scale toward the target frame time from the latest GPU time
+	/// GPU time is taken to follow the pixel count, the square of the scale
+	/// Times arrive a few frames late, so each step is limited, falling faster than
+	/// it rises, and times near the target are left alone so the scale does not hunt
 
-	if(OnKeyEvent != nullptr) OnKeyEvent(this, key, scancode, action, mods);
+	double gputime;
+	if(!frameTimer.LatestGPU(gputime) || gputime <= 0.0) return;
+
+	double ratio = targetFrameTime / gputime;
+	if(ratio > 0.95 && ratio < 1.15) return;
+
+	float step = std::min(std::max((float)std::sqrt(ratio), 0.8f), 1.05f);
+	renderScale = std::min(std::max(renderScale * step, minRenderScale), 1.0f);
 }
 //---------------------------------------------------------------------------
 
-void __fastcall TOpenGLWindow::ResizeCallback(int width, int height)
+void __fastcall TOpenGLWindow::SetFramePacing(GLFramePacing pacing, double fps)
 {
-	/// Called by resize of GLFW window
-	/// Passed to handler if set
-	/// Repaint window if no handler
+	/// Choose how frames are paced
+	/// VSYNC: wait for vertical blank, the default
+	/// ADAPTIVE: wait for vertical blank unless the frame is late, then swap at once
+	/// to avoid halving the frame rate, plain vsync if not supported
+	/// UNCAPPED: swap at once, may tear
+	/// TARGET: swap at once and limit the frame rate to fps
+
+	if(Defer([=]() { SetFramePacing(pacing, fps); })) return;
+	if(window == nullptr) return;
+	MakeCurrent();
 
-	if(OnResizeEvent != nullptr) OnResizeEvent(this, width, height);
+	framePacing = pacing;
+	if(pacing == GLFramePacing::VSYNC) {
+		glfwSwapInterval(1);
+	}
+	else if(pacing == GLFramePacing::ADAPTIVE) {
+		bool tear = glfwExtensionSupported("WGL_EXT_swap_control_tear") || glfwExtensionSupported("GLX_EXT_swap_control_tear");
+		glfwSwapInterval(tear ? -1 : 1);
+	}
+	else {
+		glfwSwapInterval(0);
+	}
+
+	if(pacing == GLFramePacing::TARGET && fps > 0.0) {
+		frameInterval = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(1.0 / fps));
+		frameDue = std::chrono::steady_clock::now();
+	}
+	else {
+		framePacing = pacing == GLFramePacing::TARGET ? GLFramePacing::UNCAPPED : pacing;
+	}
+	redrawNeeded = true;
 }
 //---------------------------------------------------------------------------
 
-void __fastcall TOpenGLWindow::MouseButtonCallback(int button, int action, int mods)
+void __fastcall TOpenGLWindow::PaceFrame()
 {
-	/// Called by mouse click in GLFW window
-	/// Passed to handler if set
-	/// button: GLFW_MOUSE_BUTTON_LEFT, GLFW_MOUSE_BUTTON_RIGHT or GLFW_MOUSE_BUTTON_MIDDLE
-	/// action: GLFW_PRESS or GLFW_RELEASE
-	/// mods: GLFW_MOD_SHIFT, GLFW_MOD_CONTROL, GLFW_MOD_ALT, GLFW_MOD_SUPER, GLFW_MOD_CAPS_LOCK or GLFW_MOD_NUM_LOCK
+	/// Wait until the next frame is due for TARGET pacing
+	/// Sleeps while the frame is more than spinTime away, as sleeps may overrun,
+	/// then yields until it is due
+	/// A late frame starts the schedule again instead of rushing to catch up
 
-	if(OnMouseButtonEvent != nullptr) OnMouseButtonEvent(this, button, action, mods);
+	const std::chrono::milliseconds spinTime(2);
+
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	frameDue += frameInterval;
+	if(frameDue < now) frameDue = now;
+
+	while(now < frameDue) {
+		if(frameDue - now > spinTime) std::this_thread::sleep_for(frameDue - now - spinTime);
+		else std::this_thread::yield();
+		now = std::chrono::steady_clock::now();
+	}
 }
 //---------------------------------------------------------------------------
 
-void __fastcall TOpenGLWindow::MousePositionCallback(double x, double y)
+bool __fastcall TOpenGLWindow::RedrawNeeded()
 {
-	/// Called by mouse move in GLFW window
-	/// Passed to handler if set
+	/// True if the scene, camera, lighting, text or window size changed since the last frame
+	/// or data is still being uploaded
+	/// Only meaningful on the thread that draws, the render thread if one is running
 
-	if(OnMousePositionEvent != nullptr) OnMousePositionEvent(this, x, y);
+	if(window == nullptr) return false;
+	if(redrawNeeded || sceneChanged || scene->dataChanged) return true;
+	if(occlusionCull && OcclusionPending()) return true;   // results to read
+	if(drawnRevision != scene->revision) return true;   // edited through another window
+
+	int width, height;
+	WindowSize(width, height);
+	if(width != viewWidth || height != viewHeight) return true;
+
+	bool batched = scene->textureBatch != nullptr;
+	for(GLTexture& tex : scene->textureList) {
+		if(tex.NeedsUpload(!batched)) return true;
+	}
+	if(batched && scene->textureBatch->NeedsUpdate(scene->textureList)) return true;
+
+	return false;
 }
 //---------------------------------------------------------------------------
 
-void __fastcall TOpenGLWindow::MouseScrollCallback(double xoffset, double yoffset)
+bool __fastcall TOpenGLWindow::RenderIfNeeded(double timeout)
 {
-	/// Called by mouse wheel scroll in GLFW window
-	/// Passed to handler if set
+	/// Render only if something changed since the last frame
+	/// If nothing changed and timeout > 0, wait up to timeout seconds for input
+	/// events, whose handlers may change the scene, before checking again
+	/// Returns true if a frame was drawn
+	/// With a render thread running frames are drawn there and this only handles events
+
+	if(window == nullptr) return false;
+
+	if(threaded) {
+		if(timeout > 0.0) glfwWaitEventsTimeout(timeout);
+		else glfwPollEvents();
+		return false;
+	}
 
-	if(OnMouseScrollEvent != nullptr) OnMouseScrollEvent(this, yoffset);
+	if(!RedrawNeeded()) {
+		if(timeout > 0.0) glfwWaitEventsTimeout(timeout);
+		else glfwPollEvents();
+		if(!RedrawNeeded()) {
+			// reads still in progress are handed over without drawing
+			if(frameCapture.Pending()) {
+				MakeCurrent();
+				frameCapture.Poll(this);
+			}
+			return false;
+		}
+	}
+
+	RenderFrame();
+	glfwPollEvents();
+	return true;
 }
 //---------------------------------------------------------------------------
 
-GLPickResult __fastcall TOpenGLWindow::PickElement(double x, double y)
+void __fastcall TOpenGLWindow::Redraw()
 {
-	/// Gets closest element at screenx, screeny
+	/// Draw the next frame even if nothing changed
 
-	glm::vec3 raydir = CreateRay(x, y);
-	glm::vec3 raystart = cameraPos;
+	if(Defer([=]() { Redraw(); })) return;
 
-	float mindist = cameraFar;
-	int mintex = -2; // no triangle
-	int mintri = -1;
-	for(int t=0; t<textureList.size(); t++) {
-		int tri = textureList[t].PickTriangle(raystart, raydir, mindist);
-		if(tri >= 0) {
-			mintex = t; // texture triangle
-			mintri = tri;
-		}
-	}
+	redrawNeeded = true;
+}
+//---------------------------------------------------------------------------
 
-	for(int c=0; c<colorList.size(); c++) {
-		if(RayTriangle(raystart, raydir, colorList[c].vert[0].pos, colorList[c].vert[1].pos, colorList[c].vert[2].pos, mindist)) {
-			mintex = -1; // color triangle
-			mintri = c;
-		}
+void __fastcall TOpenGLWindow::BackFaceCull(bool docull)
+{
+	if(Defer([=]() { BackFaceCull(docull); })) return;
 
-    }
+	backFaceCull = docull;
+	redrawNeeded = true;
+}
+//---------------------------------------------------------------------------
 
-	GLPickResult result;
-	result.dist = mindist;
+void __fastcall TOpenGLWindow::FrustumCull(bool docull)
+{
+	/// Skip chunks of triangles outside the view
 
-	int point = defaultFont->PickPoint(raystart, raydir, mindist);
-	if(point >= 0) {
-		result.type = GLPickType::POINT;
-		result.group = 0;
-		result.index = point;
-		result.color = defaultFont->GetPointColor(point);
-	}
-	else if(mintex == -1) {
-		result.type = GLPickType::COLOR;
-		result.group = 0;
-		result.index = mintri;
-		result.color = GetColorTriangleColor(mintri);
-	}
-	else if(mintex >= 0) {
-		result.type = GLPickType::TRIANGLE;
-		result.group = mintex;
-		result.index = mintri;
-		result.color = textureList[mintex].GetTriangleColor(mintri);
-	}
+	if(Defer([=]() { FrustumCull(docull); })) return;
 
-	return result;
+	frustumCull = docull;
+	redrawNeeded = true;
 }
 //---------------------------------------------------------------------------
 
-void __fastcall TOpenGLWindow::SetElementColor(GLPickResult& pick, glm::vec3 newcolor)
+void __fastcall TOpenGLWindow::OcclusionCull(bool docull)
 {
-	if(pick.type == GLPickType::NONE) return;
-	else if(pick.type == GLPickType::POINT) {
-		defaultFont->SetPointColor(pick.index, newcolor);
-	}
-	else if(pick.type == GLPickType::COLOR) {
-		SetColorTriangleColor(pick.index, newcolor);
-	}
-	else if(pick.type == GLPickType::TRIANGLE) {
-		textureList[pick.group].SetTriangleColor(pick.index, newcolor);
-	}
+	/// Skip chunks of triangles hidden by other triangles in an earlier frame
+
+	if(Defer([=]() { OcclusionCull(docull); })) return;
 
+	occlusionCull = docull;
+	redrawNeeded = true;
 }
 //---------------------------------------------------------------------------
 
-void __fastcall TOpenGLWindow::SetColorTriangleColor(int trinum, glm::vec3& color)
+void __fastcall TOpenGLWindow::DepthPrepass(bool enable)
 {
-	if(trinum < 0 || trinum >= colorList.size()) return;
+	/// Draw triangles to the depth buffer only, then draw them again with GL_EQUAL
+	/// depth test so the texture and lighting shaders run once for each pixel
+	/// Helps scenes limited by fill rate with many overlapping triangles
 
-	glBindVertexArray(colorVAO);
-	glBindBuffer(GL_ARRAY_BUFFER, colorVBO);
+	if(Defer([=]() { DepthPrepass(enable); })) return;
 
-	GLColorTriangle& tri = colorList[trinum];
-	memcpy(tri.vert[0].color, glm::value_ptr(color), sizeof(glm::vec3));
-	memcpy(tri.vert[1].color, glm::value_ptr(color), sizeof(glm::vec3));
-	memcpy(tri.vert[2].color, glm::value_ptr(color), sizeof(glm::vec3));
-	glBufferSubData(GL_ARRAY_BUFFER, trinum * sizeof(GLColorTriangle), sizeof(GLColorTriangle), &tri);
+	depthPrepass = enable;
+	redrawNeeded = true;
 }
 //---------------------------------------------------------------------------
 
-glm::vec3 __fastcall TOpenGLWindow::GetColorTriangleColor(int trinum)
+void __fastcall TOpenGLWindow::DepthText(bool dt)
 {
-	if(trinum < 0 || trinum >= colorList.size()) return glm::vec3(0.0f, 0.0f, 0.0f);
+	/// Use depth buffer for 3D text
 
-	glm::vec3 color;
-	GLColorTriangle& tri = colorList[trinum];
-	memcpy(glm::value_ptr(color), tri.vert[0].color, sizeof(glm::vec3));
+	if(Defer([=]() { DepthText(dt); })) return;
 
-    return color;
+	depthText = dt;
+	redrawNeeded = true;
 }
 //---------------------------------------------------------------------------
 
-glm::vec3 __fastcall TOpenGLWindow::CreateRay(double x, double y)
+void __fastcall TOpenGLWindow::WindowSize(int& width, int& height)
 {
-	/// Create ray from screen position
+	/// Size of the window to draw
+	/// GLFW window functions must be called on the main thread so the render
+	/// thread uses the size last sent by ResizeCallback
+	/// Offscreen windows draw at the image size
+
+	if(offscreen) {
+		width = imageWidth;
+		height = imageHeight;
+	}
+	else if(threaded) {
+		width = windowWidth;
+		height = windowHeight;
+	}
+	else {
+		glfwGetWindowSize(window, &width, &height);
+	}
+}
+//---------------------------------------------------------------------------
 
-	int width, height;
-	glfwGetWindowSize(window, &width, &height);
+void __fastcall TOpenGLWindow::MakeCurrent()
+{
+	/// Make the context of this window current on the calling thread
+	/// Windows sharing a scene are drawn on one thread so each makes its context
+	/// current before drawing or making GL objects
+	/// On the render thread the context is always current
 
-	glm::mat4 projection = glm::perspective(cameraFOV, (float)width / (float)height, cameraNear, cameraFar);
-	glm::mat4 lookat = glm::lookAt(cameraPos, cameraLookat, cameraUp);
-	glm::vec4 viewport = glm::vec4(0, 0, width, height);
+	if(window != nullptr && glfwGetCurrentContext() != window) glfwMakeContextCurrent(window);
+}
+//---------------------------------------------------------------------------
 
-	// get world coordinate of far z
-	glm::vec3 wincoord = glm::vec3(x, height - y, 1.0f);
-	glm::vec3 worldcoord = glm::unProject(wincoord, lookat, projection, viewport);
+void __fastcall TOpenGLWindow::SetImageSize(int width, int height)
+{
+	/// Set the size of the frames drawn by an offscreen window
 
-	// ray from camera to far point
-	glm::vec3 dir = worldcoord - cameraPos;
-	dir = glm::normalize(dir);
+	if(Defer([=]() { SetImageSize(width, height); })) return;
+	if(!offscreen || width <= 0 || height <= 0) return;
 
-	return dir;
+	imageWidth = width;
+	imageHeight = height;
+	redrawNeeded = true;
 }
 //---------------------------------------------------------------------------
 
-void __fastcall TOpenGLWindow::AddModel(const char* filename)
+bool __fastcall TOpenGLWindow::GetImage(TBitmap* bitmap)
 {
-	//tinyobj::attrib_t attributes;
-	//  struct attrib_t {
-	//    std::vector<real_t> vertices;  			// 'v'(xyz)
-	//    std::vector<real_t> vertex_weights;  		// 'v'(w) For backward compatibility, we store vertex weight in separate array.
-	//    std::vector<real_t> normals;         		// 'vn'
-	//    std::vector<real_t> texcoords;       		// 'vt'(uv)
-	//    std::vector<real_t> texcoord_ws;  		// 'vt'(w) For backward compatibility, we store texture coordinate 'w' in separate
-	//    std::vector<real_t> colors;       		// extension: vertex colors
-	//    std::vector<skin_weight_t> skin_weights;	//`skin_weight_t::vertex_id` == `vid`
-	//		  struct skin_weight_t {
-	//		      int vertex_id;  					// Corresponding vertex index in `attrib_t::vertices`.
-	//		      std::vector<joint_and_weight_t> weightValues;
-	//std::vector<tinyobj::shape_t> shapes;
-	//	struct shape_t {
-	//    std::string name;
-	//
-	//	  mesh_t mesh;
-	//	      struct mesh_t {
-	//		      std::vector<index_t> indices;
-	//				  struct index_t {
-	//					  int vertex_index;
-	//					  int normal_index;
-	//					  int texcoord_index;
-	//			  std::vector<unsigned char> num_face_vertices;         // The number of vertices per face. 3 = triangle, 4 = quad,
-	//			  std::vector<int> material_ids;  						// per-face material ID
-	//			  std::vector<unsigned int> smoothing_group_ids;  		// per-face smoothing group ID(0 = off. positive value = group id)
-	//			  std::vector<tag_t> tags;                        		// SubD tag
-	//
-	//    lines_t lines;
-	//		  struct lines_t {
-	//		      std::vector<index_t> indices;        // indices for vertices(poly lines)
-	//		      std::vector<int> num_line_vertices;  // The number of vertices per line.
-	//
-	//    points_t points;
-	//	      struct points_t {
-	//			  std::vector<index_t> indices;  // indices for points
-	//std::vector<tinyobj::material_t> materials;
-	//   struct material_t {
-	//		std::string name;
-	//
-	//		real_t ambient[3];
-	//		real_t diffuse[3];
-	//		real_t specular[3];
-	//		real_t transmittance[3];
-	//		real_t emission[3];
-	//		real_t shininess;
-	//		real_t ior;       		     // index of refraction
-	//		real_t dissolve;  			 // 1 == opaque; 0 == fully transparent
-	//		real_t roughness;            // [0, 1] default 0
-	//		real_t metallic;             // [0, 1] default 0
-	//		real_t sheen;                // [0, 1] default 0
-	//		real_t clearcoat_thickness;  // [0, 1] default 0
-	//		real_t clearcoat_roughness;  // [0, 1] default 0
-	//		real_t anisotropy;           // aniso. [0, 1] default 0
-	//		real_t anisotropy_rotation;  // anisor. [0, 1] default 0
-	//		int illum;                   // illumination model
-	//			0 Color on and Ambient off
-	//			1 Color on and Ambient on
-	//			2 Highlight on
-	//			3 Reflection on and Ray trace on
-	//			4 Transparency: Glass on, Reflection: Ray trace on
-	//			5 Reflection: Fresnel on and Ray trace on
-	//			6 Transparency: Refraction on, Reflection: Fresnel off and Ray trace on
-	//			7 Transparency: Refraction on, Reflection: Fresnel on and Ray trace on
-	//			8 Reflection on and Ray trace off
-	//			9 Transparency: Glass on, Reflection: Ray trace off
-	//			10 Casts shadows onto invisible surfaces
-	//
-	//		std::string ambient_texname;             // map_Ka
-	//		std::string diffuse_texname;             // map_Kd
-	//		std::string specular_texname;            // map_Ks
-	//		std::string specular_highlight_texname;  // map_Ns
-	//		std::string bump_texname;                // map_bump, map_Bump, bump
-	//		std::string displacement_texname;        // disp
-	//		std::string alpha_texname;               // map_d
-	//		std::string reflection_texname;          // refl
-	//		std::string roughness_texname; 			 // map_Pr
-	//		std::string metallic_texname;   		 // map_Pm
-	//		std::string sheen_texname;      		 // map_Ps
-	//		std::string emissive_texname;   		 // map_Ke
-	//		std::string normal_texname;     		 // norm. For normal mapping.
-	//
-	//		texture_option_t ambient_texopt;
-	//		texture_option_t diffuse_texopt;
-	//		texture_option_t specular_texopt;
-	//		texture_option_t specular_highlight_texopt;
-	//		texture_option_t bump_texopt;
-	//		texture_option_t displacement_texopt;
-	//		texture_option_t alpha_texopt;
-	//		texture_option_t reflection_texopt;
-	//		texture_option_t roughness_texopt;
-	//		texture_option_t metallic_texopt;
-	//		texture_option_t sheen_texopt;
-	//		texture_option_t emissive_texopt;
-	//		texture_option_t normal_texopt;
-	//
-	//			struct texture_option_t {
-	//			  texture_type_t type;      // -type (default TEXTURE_TYPE_NONE)
-	//			  real_t sharpness;         // -boost (default 1.0?)
-	//			  real_t brightness;        // base_value in -mm option (default 0)
-	//			  real_t contrast;          // gain_value in -mm option (default 1)
-	//			  real_t origin_offset[3];  // -o u [v [w]] (default 0 0 0)
-	//			  real_t scale[3];          // -s u [v [w]] (default 1 1 1)
-	//			  real_t turbulence[3];     // -t u [v [w]] (default 0 0 0)
-	//			  int texture_resolution;   // -texres resolution (No default value in the spec.We'll use -1)
-	//			  bool clamp;               // -clamp (default false)
-	//			  char imfchan;  			// -imfchan (the default for bump is 'l' and for decal is 'm')
-	//			  bool blendu;   			// -blendu (default on)
-	//			  bool blendv;  			// -blendv (default on)
-	//			  real_t bump_multiplier;   // -bm (for bump maps only, default 1.0)
-	//			  std::string colorspace;   // Explicitly specify color space of stored texel value. Usually `sRGB` or `linear` (default empty).
+	/// Copy the last frame of an offscreen window into bitmap
+	/// Waits for the frame to finish drawing
+	/// Not available while a render thread runs
+	/// Returns false if nothing has been drawn
 
-	tinyobj::attrib_t attributes;
-	std::vector<tinyobj::shape_t> shapes;
-	std::vector<tinyobj::material_t> materials;
-	std::string warning;
-	std::string error;
+	if(!offscreen || renderTarget == nullptr || bitmap == nullptr) return false;
+	if(threaded) return false;
+	if(renderTarget->Framebuffer() == 0) return false;   // could not be made
+	MakeCurrent();
 
-	AnsiString dir = ExtractFileDir(filename);
-	if (!tinyobj::LoadObj( &attributes, &shapes, &materials, &warning, &error, filename, dir.c_str())) {
-		std::string message = "Load obj error: " + warning + error;
-		ShowMessage(message.c_str());
-		return;
-	}
+	int width = renderTarget->Width();
+	int height = renderTarget->Height();
+	bitmap->SetSize(width, height);
 
-	// add diffuse map from materials as texture
-    // assume material files are in same directory as obj file
-	int firstmat = textureList.size();
-	for(tinyobj::material_t& material : materials) {
-		String matfile = dir + "\\" + material.diffuse_texname.c_str();
-		AddTexture(matfile.c_str(), true);
+	TBitmapData data;
+	if(!bitmap->Map(TMapAccess::Write, data)) return false;
+
+	GLenum format = data.PixelFormat == TPixelFormat::RGBA ? GL_RGBA : GL_BGRA;
+	std::vector<unsigned char> pixels((size_t)width * height * 4);
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, renderTarget->Framebuffer());
+	glReadPixels(0, 0, width, height, format, GL_UNSIGNED_BYTE, pixels.data());
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+
+	// GL rows start at the bottom
+	int rowbytes = width * 4;
+	for(int row=0; row<height; row++) {
+		memcpy((unsigned char*)data.Data + (size_t)row * data.Pitch, pixels.data() + (size_t)(height - 1 - row) * rowbytes, rowbytes);
 	}
 
-	for(tinyobj::shape_t& shape : shapes) {
-		int vertcount = shape.mesh.indices.size() / 3;
-		for(int v=0; v<vertcount; v++) {
+	bitmap->Unmap(data);
+	return true;
+}
+//---------------------------------------------------------------------------
 
-			tinyobj::index_t i0 = shape.mesh.indices[3 * v + 0];
-			tinyobj::index_t i1 = shape.mesh.indices[3 * v + 1];
-			tinyobj::index_t i2 = shape.mesh.indices[3 * v + 2];
-			glm::vec3 v1 = glm::vec3(attributes.vertices[3 * i0.vertex_index + 0], attributes.vertices[3 * i0.vertex_index + 1], attributes.vertices[3 * i0.vertex_index + 2]);
-			glm::vec3 v2 = glm::vec3(attributes.vertices[3 * i1.vertex_index + 0], attributes.vertices[3 * i1.vertex_index + 1], attributes.vertices[3 * i1.vertex_index + 2]);
-			glm::vec3 v3 = glm::vec3(attributes.vertices[3 * i2.vertex_index + 0], attributes.vertices[3 * i2.vertex_index + 1], attributes.vertices[3 * i2.vertex_index + 2]);
-			glm::vec3 n1 = glm::vec3(attributes.normals[3 * i0.normal_index + 0], attributes.normals[3 * i0.normal_index + 1], attributes.normals[3 * i0.normal_index + 2]);
-			glm::vec3 n2 = glm::vec3(attributes.normals[3 * i1.normal_index + 0], attributes.normals[3 * i1.normal_index + 1], attributes.normals[3 * i1.normal_index + 2]);
-			glm::vec3 n3 = glm::vec3(attributes.normals[3 * i2.normal_index + 0], attributes.normals[3 * i2.normal_index + 1], attributes.normals[3 * i2.normal_index + 2]);
-			glm::vec2 t1 = glm::vec2(attributes.texcoords[2 * i0.texcoord_index + 0], attributes.texcoords[2 * i0.texcoord_index + 1]);
-			glm::vec2 t2 = glm::vec2(attributes.texcoords[2 * i1.texcoord_index + 0], attributes.texcoords[2 * i1.texcoord_index + 1]);
-			glm::vec2 t3 = glm::vec2(attributes.texcoords[2 * i2.texcoord_index + 0], attributes.texcoords[2 * i2.texcoord_index + 1]);
-			int matid = shape.mesh.material_ids[v] + firstmat;
-			AddTriangleVNT(v1, v2, v3, n1, n2, n3, t1, t2, t3, matid);
-		}
+void __fastcall TOpenGLWindow::CaptureFrame(TGLCaptureEvent callback, bool continuous)
+{
+	/// Read the next frame drawn without waiting for the GPU
+	/// callback is called a frame or two later, on the thread that draws, with the
+	/// frame as 4 byte BGRA pixels, rows starting at the bottom
+	/// The pixels are only valid during the callback
+	/// If continuous every frame drawn is read until CaptureFrame(nullptr), for
+	/// recording, and costs little more than the copy made by the callback
+
+	if(Defer([=]() { CaptureFrame(callback, continuous); })) return;
+
+	captureCallback = callback;
+	captureContinuous = continuous && callback != nullptr;
+	if(callback != nullptr) redrawNeeded = true;
+}
+//---------------------------------------------------------------------------
+
+bool __fastcall TOpenGLWindow::CaptureRead()
+{
+	/// Start reading the frame just drawn for captureCallback
+	/// Window frames are copied to a single sample framebuffer first, as a multisampled
+	/// back buffer cannot be read directly, offscreen frames are already resolved
+	/// Returns false if the framebuffer to copy to could not be made, the read is
+	/// left pending for a later frame
+
+	unsigned int framebuffer;
+	if(offscreen && renderTarget->Framebuffer() > 0) {
+		framebuffer = renderTarget->Framebuffer();
+	}
+	else {
+		if(captureTarget == nullptr) captureTarget = new GLRenderTarget();
+		if(!captureTarget->Resize(viewWidth, viewHeight, 0)) return false;
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+		glBindFramebuffer(GL_DRAW_FRAMEBUFFER, captureTarget->Framebuffer());
+		glBlitFramebuffer(0, 0, viewWidth, viewHeight, 0, 0, viewWidth, viewHeight, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		framebuffer = captureTarget->Framebuffer();
 	}
 
+	frameCapture.Read(framebuffer, viewWidth, viewHeight, captureCallback, this);
+	if(!captureContinuous) captureCallback = nullptr;
+	return true;
 }
 //---------------------------------------------------------------------------
-//---------------------------------------------------------------------------
 
-void __fastcall GLTexture::LoadTextureFromFile(const std::wstring& file, bool flip)
+void __fastcall TOpenGLWindow::RenderThread(bool enable)
 {
-	/// Loads texture from file
+	/// Move the GL context to a render thread, or back to the calling thread
+	/// While it runs, methods that change the scene queue commands that the render thread
+	/// runs at the start of each frame, so the caller never waits for the driver or vsync
+	/// Render and RenderIfNeeded only handle window events, which must stay on this thread
+	/// Picking and color queries see the scene as of the last commands run
+	/// Must be called on the thread that created the window
+	/// Windows sharing a scene stay on that thread and ignore this
 
-	filename = file;
-	TBitmap* textureBMP = new TBitmap();
-	try {
-		textureBMP->LoadFromFile(filename.c_str());
-		LoadTextureFromBitmap(textureBMP, flip);
-	} catch (EFOpenError& e) {
-		String message = "Failed to load ";
-		message = message + filename.c_str();
-		ShowMessage(message.c_str());
+	if(window == nullptr) return;
+
+	if(enable && !threaded) {
+		if(scene->windows > 1) return;
+		glfwGetWindowSize(window, &windowWidth, &windowHeight);
+		queuedTextures = scene->textureList.size();
+		stopRender = false;
+
+		glfwMakeContextCurrent(NULL);
+		renderThread = std::thread(&TOpenGLWindow::RenderLoop, this);
+		threaded = true;
 	}
+	else if(!enable && threaded) {
+		// queued commands are run before the thread stops
+		stopRender = true;
+		{
+			std::lock_guard<std::mutex> lock(wakeMutex);
+		}
+		wake.notify_one();
+		renderThread.join();
+		threaded = false;
 
-	delete textureBMP;
+		glfwMakeContextCurrent(window);
+	}
 }
 //---------------------------------------------------------------------------
 
-void __fastcall GLTexture::LoadTextureFromResource(const wchar_t* bmpresource, bool flip)
+void __fastcall TOpenGLWindow::Post(std::function<void()> command)
 {
-	/// Loads texture from program resource
+	/// Queue a command for the render thread and wake it if it is waiting
+	/// Only waits if the queue is full, until the render thread has taken some commands
 
-	TBitmap* bmp = new TBitmap();
-	TResourceStream *bmp_stream = new TResourceStream((int)HInstance, bmpresource, (System::WideChar*)RT_RCDATA);
-	__try {
-		__try {
-			bmp->LoadFromStream(bmp_stream);
-		}
-		__finally {
-		}
-	}
-	__finally {
-		bmp_stream->DisposeOf();
+	while(!commands.Push(command)) {
+		std::this_thread::yield();
 	}
 
-	LoadTextureFromBitmap(bmp, flip);
-	delete bmp;
+	if(renderIdle) {
+		{
+			std::lock_guard<std::mutex> lock(wakeMutex);
+		}
+		wake.notify_one();
+	}
 }
 //---------------------------------------------------------------------------
 
-void __fastcall GLTexture::LoadTextureFromBitmap(TBitmap* textureBMP, bool flip)
+void __fastcall TOpenGLWindow::RenderLoop()
 {
-	/// Loads bitmap file into texture
-	/// Uses TBitmap to read file
-    /// if flip, bitmap is flipped vertically
+	/// Render thread
+	/// Runs queued commands at the start of each frame, then draws if anything changed
+	/// Waits for commands when there is nothing to draw
 
-	textureID = 0;
-	VAO = 0;
-	VBO = 0;
+	glfwMakeContextCurrent(window);
 
-	TBitmapData data;
+	std::function<void()> command;
+	while(true) {
+		// commands queued before stop was set are run first
+		bool stopping = stopRender;
+		{
+			std::lock_guard<std::recursive_mutex> lock(sceneMutex);
+			while(commands.Pop(command)) {
+				command();
+				command = nullptr;   // release captured data
+			}
+		}
+		if(stopping) break;
+
+		if(RedrawNeeded()) {
+			RenderFrame();
+		}
+		else {
+			// captures still being read are checked for every millisecond
+			bool capturing = frameCapture.Pending();
+			if(capturing) frameCapture.Poll(this);
+
+			std::unique_lock<std::mutex> lock(wakeMutex);
+			renderIdle = true;
+			wake.wait_for(lock, std::chrono::milliseconds(capturing ? 1 : 100), [this]() { return stopRender || !commands.Empty(); });
+			renderIdle = false;
+		}
+	}
+
+	glfwMakeContextCurrent(NULL);
+}
+//---------------------------------------------------------------------------
+
+void __fastcall TOpenGLWindow::SetCamera(glm::vec3& pos, glm::vec3& lookat, glm::vec3& up)
+{
+	/// Set camera position, lookat point and up vector
+
+	if(Defer([=]() mutable { SetCamera(pos, lookat, up); })) return;
+
+	cameraPos = pos;
+	cameraLookat = lookat;
+	cameraUp = up;
+	sceneChanged = true;
+}
+//---------------------------------------------------------------------------
+
+void __fastcall TOpenGLWindow::AddText2D(float x, float y, float height, GLTextPos horiz_align, GLTextPos vert_align, const char* str, glm::vec3 color)
+{
+	/// Display text on screen using default font
+	/// x, y are screen position (0 to 1)
+	/// height is character size
+	/// horiz_align, vert_align are position of text relative to x,y
+	/// Can be LEFT, CENTER or RIGHT / ABOVE, CENTER or BELOW
+	/// str is the text string - ASCII only
+	/// color is the text color
+
+    if(str == nullptr || strlen(str) == 0) return;
+	std::string text = str;
+	if(Defer([=]() { AddText2D(x, y, height, horiz_align, vert_align, text.c_str(), color); })) return;
+
+	windowText->AddText2D(x, y, height, horiz_align, vert_align, str, color);
+	redrawNeeded = true;
+}
+//---------------------------------------------------------------------------
+
+void __fastcall TOpenGLWindow::AddText3D(glm::vec3 pos, float height, GLTextPos xpos, GLTextPos ypos, const char* str, glm::vec3 color, bool point)
+{
+	/// Display text in the world using default font
+	/// pos is world coordinates
+	/// height is character size
+	/// horiz_align, vert_align are position of text relative to pos
+	/// Can be LEFT, CENTER or RIGHT / ABOVE, CENTER or BELOW
+	/// str is the text string - ASCII only
+	/// color is the text color
+	/// point if true draws a point at pos
+
+	if(str == nullptr) return;
+	std::string text = str;
+	if(Defer([=]() { AddText3D(pos, height, xpos, ypos, text.c_str(), color, point); })) return;
+
+	windowText->AddText3D(pos, height, xpos, ypos, str, color, point);
+	redrawNeeded = true;
+}
+//---------------------------------------------------------------------------
+
+void __fastcall TOpenGLWindow::AddTriangleVC(glm::vec3& p1, glm::vec3& p2, glm::vec3& p3, glm::vec3& c1, glm::vec3& c2, glm::vec3& c3)
+{
+	/// Add triangle colored by color of vertices
+	/// The normal of the vertices is the normal of the triangle (flat shaded)
+	/// p1, p2, p3: position of three vertices
+	/// c1, c2, c3: color of three vertices
+
+	if(Defer([=]() mutable { AddTriangleVC(p1, p2, p3, c1, c2, c3); })) return;
+
+	GLColorTriangle& tri = scene->colorList.emplace_back();
+
+	memcpy(tri.vert[0].pos, glm::value_ptr(p1), 3 * sizeof(float));
+	memcpy(tri.vert[1].pos, glm::value_ptr(p2), 3 * sizeof(float));
+	memcpy(tri.vert[2].pos, glm::value_ptr(p3), 3 * sizeof(float));
+
+	memcpy(tri.vert[0].color, glm::value_ptr(c1), 3 * sizeof(float));
+	memcpy(tri.vert[1].color, glm::value_ptr(c2), 3 * sizeof(float));
+	memcpy(tri.vert[2].color, glm::value_ptr(c3), 3 * sizeof(float));
+
+	glm::vec3 norm = glm::triangleNormal(p1, p2, p3);
+
+	memcpy(tri.vert[0].norm, glm::value_ptr(norm), 3 * sizeof(float));
+	memcpy(tri.vert[1].norm, glm::value_ptr(norm), 3 * sizeof(float));
+	memcpy(tri.vert[2].norm, glm::value_ptr(norm), 3 * sizeof(float));
+
+	scene->colorMin = glm::min(scene->colorMin, glm::min(p1, glm::min(p2, p3)));
+	scene->colorMax = glm::max(scene->colorMax, glm::max(p1, glm::max(p2, p3)));
+
+	if(scene->colorRemap.size() > 0) {
+		scene->colorRemap.push_back(scene->colorList.size() - 1);
+		scene->colorUnmap.push_back(scene->colorList.size() - 1);
+	}
+
+	scene->dataChanged = true;
+	SceneEdited();
+}
+//---------------------------------------------------------------------------
+
+void __fastcall TOpenGLWindow::AddTriangleVNC(glm::vec3& p1, glm::vec3& p2, glm::vec3& p3, glm::vec3& n1, glm::vec3& n2, glm::vec3& n3, glm::vec3& c1, glm::vec3& c2, glm::vec3& c3)
+{
+	/// Add triangle colored by color of vertices
+	/// p1, p2, p3: position of three vertices
+	/// n1, n2, n3: normal at each vertex
+	/// c1, c2, c3: color of three vertices
+
+	if(Defer([=]() mutable { AddTriangleVNC(p1, p2, p3, n1, n2, n3, c1, c2, c3); })) return;
+
+	GLColorTriangle& tri = scene->colorList.emplace_back();
+
+	memcpy(tri.vert[0].pos, glm::value_ptr(p1), 3 * sizeof(float));
+	memcpy(tri.vert[1].pos, glm::value_ptr(p2), 3 * sizeof(float));
+	memcpy(tri.vert[2].pos, glm::value_ptr(p3), 3 * sizeof(float));
+
+	memcpy(tri.vert[0].color, glm::value_ptr(c1), 3 * sizeof(float));
+	memcpy(tri.vert[1].color, glm::value_ptr(c2), 3 * sizeof(float));
+	memcpy(tri.vert[2].color, glm::value_ptr(c3), 3 * sizeof(float));
+
+	memcpy(tri.vert[0].norm, glm::value_ptr(n1), 3 * sizeof(float));
+	memcpy(tri.vert[1].norm, glm::value_ptr(n2), 3 * sizeof(float));
+	memcpy(tri.vert[2].norm, glm::value_ptr(n3), 3 * sizeof(float));
+
+	scene->colorMin = glm::min(scene->colorMin, glm::min(p1, glm::min(p2, p3)));
+	scene->colorMax = glm::max(scene->colorMax, glm::max(p1, glm::max(p2, p3)));
+
+	if(scene->colorRemap.size() > 0) {
+		scene->colorRemap.push_back(scene->colorList.size() - 1);
+		scene->colorUnmap.push_back(scene->colorList.size() - 1);
+	}
+
+	scene->dataChanged = true;
+	SceneEdited();
+}
+//---------------------------------------------------------------------------
+
+void __fastcall TOpenGLWindow::AddTriangleVT(glm::vec3& p1, glm::vec3& p2, glm::vec3& p3, glm::vec2& t1, glm::vec2& t2, glm::vec2& t3, int texid)
+{
+	/// Add triangle colored by texture
+	/// The normal of the vertices is the normal of the triangle (flat shaded)
+	/// p1, p2, p3: position of three vertices
+	/// t1, t2, t3: texture coordinates of three vertices
+	/// texid: index of texture returned by AddTexture
+
+	if(Defer([=]() mutable { AddTriangleVT(p1, p2, p3, t1, t2, t3, texid); })) return;
+
+	GLTexture& tex = scene->textureList[texid];
+	tex.AddTriangleVT(p1, p2, p3, t1, t2, t3);
+	if(scene->textureBatch != nullptr) scene->textureBatch->Append(scene->textureList, texid);
+	SceneEdited();
+}
+//---------------------------------------------------------------------------
+
+void __fastcall TOpenGLWindow::AddTriangleVNT(glm::vec3& p1, glm::vec3& p2, glm::vec3& p3, glm::vec3& n1, glm::vec3& n2, glm::vec3& n3, glm::vec2& t1, glm::vec2& t2, glm::vec2& t3, int texid)
+{
+	/// Add triangle colored by texture
+	/// p1, p2, p3: position of three vertices
+	/// n1, n2, n3: normal at each vertex
+	/// t1, t2, t3: texture coordinates of three vertices
+	/// texid: index of texture returned by AddTexture
+
+	if(Defer([=]() mutable { AddTriangleVNT(p1, p2, p3, n1, n2, n3, t1, t2, t3, texid); })) return;
+
+	GLTexture& tex = scene->textureList[texid];
+	tex.AddTriangleVNT(p1, p2, p3, n1, n2, n3, t1, t2, t3);
+	if(scene->textureBatch != nullptr) scene->textureBatch->Append(scene->textureList, texid);
+	SceneEdited();
+}
+//---------------------------------------------------------------------------
+
+void __fastcall TOpenGLWindow::GetMousePos(double& x, double& y)
+{
+	/// Returns current cursor position
+
+	if(window == nullptr) return;
+	glfwGetCursorPos(window, &x, &y);
+}
+//---------------------------------------------------------------------------
+
+void __fastcall TOpenGLWindow::SetLightDir(glm::vec3& dir)
+{
+	/// Set the light direction
+	/// Stored as negative of given direction
+	/// Because surface normal in same direction as light should be fully lit
+
+	if(Defer([=]() mutable { SetLightDir(dir); })) return;
+
+	lightDir = -glm::normalize(dir);
+	sceneChanged = true;
+}
+//---------------------------------------------------------------------------
+
+void __fastcall TOpenGLWindow::SetAmbientColor(TAlphaColor color)
+{
+	if(Defer([=]() { SetAmbientColor(color); })) return;
+	float red = (float)((color >> 16) & 0xFF) / 255.0f;
+	float green = (float)((color >> 8) & 0xFF) / 255.0f;
+	float blue = (float)(color & 0xFF) / 255.0f;
+	ambientColor = glm::vec3(red, green, blue);
+	sceneChanged = true;
+}
+//---------------------------------------------------------------------------
+
+void __fastcall TOpenGLWindow::SetLightColor(TAlphaColor color)
+{
+	if(Defer([=]() { SetLightColor(color); })) return;
+	float red = (float)((color >> 16) & 0xFF) / 255.0f;
+	float green = (float)((color >> 8) & 0xFF) / 255.0f;
+	float blue = (float)(color & 0xFF) / 255.0f;
+	lightColor = glm::vec3(red, green, blue);
+	sceneChanged = true;
+}
+//---------------------------------------------------------------------------
+
+void __fastcall TOpenGLWindow::AddPointLight(glm::vec3& pos, glm::vec3& color, float radius)
+{
+	/// Add a light shining in all directions from pos, fading to nothing at radius
+	/// Lights are numbered from 0 in the order added and belong to the scene, so are
+	/// seen by all windows sharing it
+	/// Each pixel only adds the lights whose screen tiles it is in, so many small
+	/// lights cost little more than a few
+
+	if(Defer([=]() mutable { AddPointLight(pos, color, radius); })) return;
+	if(radius <= 0.0f) return;
+
+	scene->pointLights.push_back(GLPointLight{ pos, color, radius });
+	scene->lightRevision++;
+	SceneEdited();
+}
+//---------------------------------------------------------------------------
+
+void __fastcall TOpenGLWindow::SetPointLight(int light, glm::vec3& pos, glm::vec3& color, float radius)
+{
+	/// Move or change a point light
+
+	if(Defer([=]() mutable { SetPointLight(light, pos, color, radius); })) return;
+	if(light < 0 || light >= scene->pointLights.size() || radius <= 0.0f) return;
+
+	scene->pointLights[light] = GLPointLight{ pos, color, radius };
+	scene->lightRevision++;
+	SceneEdited();
+}
+//---------------------------------------------------------------------------
+
+void __fastcall TOpenGLWindow::ClearPointLights()
+{
+	/// Delete all point lights
+
+	if(Defer([=]() { ClearPointLights(); })) return;
+
+	scene->pointLights.clear();
+	scene->lightRevision++;
+	SceneEdited();
+}
+//---------------------------------------------------------------------------
+
+void __fastcall TOpenGLWindow::KeyCallback(int key, int scancode, int action, int mods)
+{
+	/// Called by key press in GLFW window
+	/// Passed to handler if set
+
+	if(OnKeyEvent != nullptr) OnKeyEvent(this, key, scancode, action, mods);
+}
+//---------------------------------------------------------------------------
+
+void __fastcall TOpenGLWindow::ResizeCallback(int width, int height)
+{
+	/// Called by resize of GLFW window
+	/// Passed to handler if set
+	/// Repaint window if no handler
+
+	if(threaded) {
+		// window size read here as GLFW window functions must be called on the main thread
+		int winwidth, winheight;
+		glfwGetWindowSize(window, &winwidth, &winheight);
+		Defer([=]() { windowWidth = winwidth; windowHeight = winheight; redrawNeeded = true; });
+	}
+	else {
+		redrawNeeded = true;
+	}
+	if(OnResizeEvent != nullptr) OnResizeEvent(this, width, height);
+}
+//---------------------------------------------------------------------------
+
+void __fastcall TOpenGLWindow::RefreshCallback()
+{
+	/// Called when the GLFW window was uncovered or needs repainting
+	/// Drawn at the next RenderIfNeeded
+
+	Redraw();
+}
+//---------------------------------------------------------------------------
+
+void __fastcall TOpenGLWindow::MouseButtonCallback(int button, int action, int mods)
+{
+	/// Called by mouse click in GLFW window
+	/// Passed to handler if set
+	/// button: GLFW_MOUSE_BUTTON_LEFT, GLFW_MOUSE_BUTTON_RIGHT or GLFW_MOUSE_BUTTON_MIDDLE
+	/// action: GLFW_PRESS or GLFW_RELEASE
+	/// mods: GLFW_MOD_SHIFT, GLFW_MOD_CONTROL, GLFW_MOD_ALT, GLFW_MOD_SUPER, GLFW_MOD_CAPS_LOCK or GLFW_MOD_NUM_LOCK
+
+	if(OnMouseButtonEvent != nullptr) OnMouseButtonEvent(this, button, action, mods);
+}
+//---------------------------------------------------------------------------
+
+void __fastcall TOpenGLWindow::MousePositionCallback(double x, double y)
+{
+	/// Called by mouse move in GLFW window
+	/// Passed to handler if set
+
+	if(OnMousePositionEvent != nullptr) OnMousePositionEvent(this, x, y);
+}
+//---------------------------------------------------------------------------
+
+void __fastcall TOpenGLWindow::MouseScrollCallback(double xoffset, double yoffset)
+{
+	/// Called by mouse wheel scroll in GLFW window
+	/// Passed to handler if set
+
+	if(OnMouseScrollEvent != nullptr) OnMouseScrollEvent(this, yoffset);
+}
+//---------------------------------------------------------------------------
+
+GLPickResult __fastcall TOpenGLWindow::PickElement(double x, double y)
+{
+	/// Gets closest element at screenx, screeny
+
+	std::lock_guard<std::recursive_mutex> lock(sceneMutex);
+	glm::vec3 raydir = CreateRay(x, y);
+	glm::vec3 raystart = cameraPos;
+
+	float mindist = cameraFar;
+	int mintex = -2; // no triangle
+	int mintri = -1;
+	for(int t=0; t<scene->textureList.size(); t++) {
+		int tri = scene->textureList[t].PickTriangle(raystart, raydir, mindist);
+		if(tri >= 0) {
+			mintex = t; // texture triangle
+			mintri = tri;
+		}
+	}
+
+	for(int c=0; c<scene->colorList.size(); c++) {
+		if(RayTriangle(raystart, raydir, scene->colorList[c].vert[0].pos, scene->colorList[c].vert[1].pos, scene->colorList[c].vert[2].pos, mindist)) {
+			mintex = -1; // color triangle
+			mintri = c;
+		}
+
+    }
+
+	// sorted triangles are returned with index used when added
+	if(mintex == -1 && scene->colorUnmap.size() > 0) mintri = scene->colorUnmap[mintri];
+
+	GLPickResult result;
+	result.dist = mindist;
+
+	int point = windowText->PickPoint(raystart, raydir, mindist);
+	if(point >= 0) {
+		result.type = GLPickType::POINT;
+		result.group = 0;
+		result.index = point;
+		result.color = windowText->GetPointColor(point);
+	}
+	else if(mintex == -1) {
+		result.type = GLPickType::COLOR;
+		result.group = 0;
+		result.index = mintri;
+		result.color = GetColorTriangleColor(mintri);
+	}
+	else if(mintex >= 0) {
+		result.type = GLPickType::TRIANGLE;
+		result.group = mintex;
+		result.index = mintri;
+		result.color = scene->textureList[mintex].GetTriangleColor(mintri);
+	}
+
+	return result;
+}
+//---------------------------------------------------------------------------
+
+void __fastcall TOpenGLWindow::SetElementColor(GLPickResult& pick, glm::vec3 newcolor)
+{
+	if(Defer([=]() mutable { SetElementColor(pick, newcolor); })) return;
+	if(pick.type == GLPickType::NONE) return;
+	else if(pick.type == GLPickType::POINT) {
+		windowText->SetPointColor(pick.index, newcolor);
+	}
+	else if(pick.type == GLPickType::COLOR) {
+		SetColorTriangleColor(pick.index, newcolor);
+	}
+	else if(pick.type == GLPickType::TRIANGLE) {
+		scene->textureList[pick.group].SetTriangleColor(pick.index, newcolor);
+		if(scene->textureBatch != nullptr) scene->textureBatch->UpdateTriangle(scene->textureList, pick.group, pick.index);
+	}
+	SceneEdited();
+}
+//---------------------------------------------------------------------------
+
+void __fastcall TOpenGLWindow::SetElementColors(std::vector<GLPickResult>& picks, glm::vec3 newcolor)
+{
+	/// Set the color of many elements
+	/// Edits are combined into a few buffer uploads at the next render
+
+	if(Defer([=]() mutable { SetElementColors(picks, newcolor); })) return;
+
+	for(GLPickResult& pick : picks) {
+		SetElementColor(pick, newcolor);
+	}
+}
+//---------------------------------------------------------------------------
+
+void __fastcall TOpenGLWindow::SetColorTriangleColor(int trinum, glm::vec3& color)
+{
+	if(Defer([=]() mutable { SetColorTriangleColor(trinum, color); })) return;
+	if(trinum < 0 || trinum >= scene->colorList.size()) return;
+	if(scene->colorRemap.size() > 0) trinum = scene->colorRemap[trinum];
+
+	GLColorTriangle& tri = scene->colorList[trinum];
+	memcpy(tri.vert[0].color, glm::value_ptr(color), sizeof(glm::vec3));
+	memcpy(tri.vert[1].color, glm::value_ptr(color), sizeof(glm::vec3));
+	memcpy(tri.vert[2].color, glm::value_ptr(color), sizeof(glm::vec3));
+
+	// uploaded with other edits at start of next render
+	scene->colorBuffer.MarkDirty(trinum, 1);
+	scene->dataChanged = true;
+	SceneEdited();
+}
+//---------------------------------------------------------------------------
+
+glm::vec3 __fastcall TOpenGLWindow::GetColorTriangleColor(int trinum)
+{
+	std::lock_guard<std::recursive_mutex> lock(sceneMutex);
+	if(trinum < 0 || trinum >= scene->colorList.size()) return glm::vec3(0.0f, 0.0f, 0.0f);
+	if(scene->colorRemap.size() > 0) trinum = scene->colorRemap[trinum];
+
+	glm::vec3 color;
+	GLColorTriangle& tri = scene->colorList[trinum];
+	memcpy(glm::value_ptr(color), tri.vert[0].color, sizeof(glm::vec3));
+
+    return color;
+}
+//---------------------------------------------------------------------------
+
+glm::vec3 __fastcall TOpenGLWindow::CreateRay(double x, double y)
+{
+	/// Create ray from screen position
+
+	std::lock_guard<std::recursive_mutex> lock(sceneMutex);
+	int width, height;
+	WindowSize(width, height);
+
+	glm::mat4 projection = glm::perspective(cameraFOV, (float)width / (float)height, cameraNear, cameraFar);
+	glm::mat4 lookat = glm::lookAt(cameraPos, cameraLookat, cameraUp);
+	glm::vec4 viewport = glm::vec4(0, 0, width, height);
+
+	// get world coordinate of far z
+	glm::vec3 wincoord = glm::vec3(x, height - y, 1.0f);
+	glm::vec3 worldcoord = glm::unProject(wincoord, lookat, projection, viewport);
+
+	// ray from camera to far point
+	glm::vec3 dir = worldcoord - cameraPos;
+	dir = glm::normalize(dir);
+
+	return dir;
+}
+//---------------------------------------------------------------------------
+
+void __fastcall TOpenGLWindow::AddModel(const char* filename)
+{
+	//tinyobj::attrib_t attributes;
+	//  struct attrib_t {
+	//    std::vector<real_t> vertices;  			// 'v'(xyz)
+	//    std::vector<real_t> vertex_weights;  		// 'v'(w) For backward compatibility, we store vertex weight in separate array.
+	//    std::vector<real_t> normals;         		// 'vn'
+	//    std::vector<real_t> texcoords;       		// 'vt'(uv)
+	//    std::vector<real_t> texcoord_ws;  		// 'vt'(w) For backward compatibility, we store texture coordinate 'w' in separate
+	//    std::vector<real_t> colors;       		// extension: vertex colors
+	//    std::vector<skin_weight_t> skin_weights;	//`skin_weight_t::vertex_id` == `vid`
+	//		  struct skin_weight_t {
+	//		      int vertex_id;  					// Corresponding vertex index in `attrib_t::vertices`.
+	//		      std::vector<joint_and_weight_t> weightValues;
+	//std::vector<tinyobj::shape_t> shapes;
+	//	struct shape_t {
+	//    std::string name;
+	//
+	//	  mesh_t mesh;
+	//	      struct mesh_t {
+	//		      std::vector<index_t> indices;
+	//				  struct index_t {
+	//					  int vertex_index;
+	//					  int normal_index;
+	//					  int texcoord_index;
+	//			  std::vector<unsigned char> num_face_vertices;         // The number of vertices per face. 3 = triangle, 4 = quad,
+	//			  std::vector<int> material_ids;  						// per-face material ID
+	//			  std::vector<unsigned int> smoothing_group_ids;  		// per-face smoothing group ID(0 = off. positive value = group id)
+	//			  std::vector<tag_t> tags;                        		// SubD tag
+	//
+	//    lines_t lines;
+	//		  struct lines_t {
+	//		      std::vector<index_t> indices;        // indices for vertices(poly lines)
+	//		      std::vector<int> num_line_vertices;  // The number of vertices per line.
+	//
+	//    points_t points;
+	//	      struct points_t {
+	//			  std::vector<index_t> indices;  // indices for points
+	//std::vector<tinyobj::material_t> materials;
+	//   struct material_t {
+	//		std::string name;
+	//
+	//		real_t ambient[3];
+	//		real_t diffuse[3];
+	//		real_t specular[3];
+	//		real_t transmittance[3];
+	//		real_t emission[3];
+	//		real_t shininess;
+	//		real_t ior;       		     // index of refraction
+	//		real_t dissolve;  			 // 1 == opaque; 0 == fully transparent
+	//		real_t roughness;            // [0, 1] default 0
+	//		real_t metallic;             // [0, 1] default 0
+	//		real_t sheen;                // [0, 1] default 0
+	//		real_t clearcoat_thickness;  // [0, 1] default 0
+	//		real_t clearcoat_roughness;  // [0, 1] default 0
+	//		real_t anisotropy;           // aniso. [0, 1] default 0
+	//		real_t anisotropy_rotation;  // anisor. [0, 1] default 0
+	//		int illum;                   // illumination model
+	//			0 Color on and Ambient off
+	//			1 Color on and Ambient on
+	//			2 Highlight on
+	//			3 Reflection on and Ray trace on
+	//			4 Transparency: Glass on, Reflection: Ray trace on
+	//			5 Reflection: Fresnel on and Ray trace on
+	//			6 Transparency: Refraction on, Reflection: Fresnel off and Ray trace on
+	//			7 Transparency: Refraction on, Reflection: Fresnel on and Ray trace on
+	//			8 Reflection on and Ray trace off
+	//			9 Transparency: Glass on, Reflection: Ray trace off
+	//			10 Casts shadows onto invisible surfaces
+	//
+	//		std::string ambient_texname;             // map_Ka
+	//		std::string diffuse_texname;             // map_Kd
+	//		std::string specular_texname;            // map_Ks
+	//		std::string specular_highlight_texname;  // map_Ns
+	//		std::string bump_texname;                // map_bump, map_Bump, bump
+	//		std::string displacement_texname;        // disp
+	//		std::string alpha_texname;               // map_d
+	//		std::string reflection_texname;          // refl
+	//		std::string roughness_texname; 			 // map_Pr
+	//		std::string metallic_texname;   		 // map_Pm
+	//		std::string sheen_texname;      		 // map_Ps
+	//		std::string emissive_texname;   		 // map_Ke
+	//		std::string normal_texname;     		 // norm. For normal mapping.
+	//
+	//		texture_option_t ambient_texopt;
+	//		texture_option_t diffuse_texopt;
+	//		texture_option_t specular_texopt;
+	//		texture_option_t specular_highlight_texopt;
+	//		texture_option_t bump_texopt;
+	//		texture_option_t displacement_texopt;
+	//		texture_option_t alpha_texopt;
+	//		texture_option_t reflection_texopt;
+	//		texture_option_t roughness_texopt;
+	//		texture_option_t metallic_texopt;
+	//		texture_option_t sheen_texopt;
+	//		texture_option_t emissive_texopt;
+	//		texture_option_t normal_texopt;
+	//
+	//			struct texture_option_t {
+	//			  texture_type_t type;      // -type (default TEXTURE_TYPE_NONE)
+	//			  real_t sharpness;         // -boost (default 1.0?)
+	//			  real_t brightness;        // base_value in -mm option (default 0)
+	//			  real_t contrast;          // gain_value in -mm option (default 1)
+	//			  real_t origin_offset[3];  // -o u [v [w]] (default 0 0 0)
+	//			  real_t scale[3];          // -s u [v [w]] (default 1 1 1)
+	//			  real_t turbulence[3];     // -t u [v [w]] (default 0 0 0)
+	//			  int texture_resolution;   // -texres resolution (No default value in the spec.We'll use -1)
+	//			  bool clamp;               // -clamp (default false)
+	//			  char imfchan;  			// -imfchan (the default for bump is 'l' and for decal is 'm')
+	//			  bool blendu;   			// -blendu (default on)
+	//			  bool blendv;  			// -blendv (default on)
+	//			  real_t bump_multiplier;   // -bm (for bump maps only, default 1.0)
+	//			  std::string colorspace;   // Explicitly specify color space of stored texel value. Usually `sRGB` or `linear` (default empty).
+
+	tinyobj::attrib_t attributes;
+	std::vector<tinyobj::shape_t> shapes;
+	std::vector<tinyobj::material_t> materials;
+	std::string warning;
+	std::string error;
+
+	AnsiString dir = ExtractFileDir(filename);
+	if (!tinyobj::LoadObj( &attributes, &shapes, &materials, &warning, &error, filename, dir.c_str())) {
+		std::string message = "Load obj error: " + warning + error;
+		ShowMessage(message.c_str());
+		return;
+	}
+
+	// add diffuse map from materials as texture
+    // assume material files are in same directory as obj file
+	int firstmat = TextureCount();
+	for(tinyobj::material_t& material : materials) {
+		String matfile = dir + "\\" + material.diffuse_texname.c_str();
+		AddTexture(matfile.c_str(), true);
+	}
+
+	for(tinyobj::shape_t& shape : shapes) {
+		int vertcount = shape.mesh.indices.size() / 3;
+		for(int v=0; v<vertcount; v++) {
+
+			tinyobj::index_t i0 = shape.mesh.indices[3 * v + 0];
+			tinyobj::index_t i1 = shape.mesh.indices[3 * v + 1];
+			tinyobj::index_t i2 = shape.mesh.indices[3 * v + 2];
+			glm::vec3 v1 = glm::vec3(attributes.vertices[3 * i0.vertex_index + 0], attributes.vertices[3 * i0.vertex_index + 1], attributes.vertices[3 * i0.vertex_index + 2]);
+			glm::vec3 v2 = glm::vec3(attributes.vertices[3 * i1.vertex_index + 0], attributes.vertices[3 * i1.vertex_index + 1], attributes.vertices[3 * i1.vertex_index + 2]);
+			glm::vec3 v3 = glm::vec3(attributes.vertices[3 * i2.vertex_index + 0], attributes.vertices[3 * i2.vertex_index + 1], attributes.vertices[3 * i2.vertex_index + 2]);
+			glm::vec3 n1 = glm::vec3(attributes.normals[3 * i0.normal_index + 0], attributes.normals[3 * i0.normal_index + 1], attributes.normals[3 * i0.normal_index + 2]);
+			glm::vec3 n2 = glm::vec3(attributes.normals[3 * i1.normal_index + 0], attributes.normals[3 * i1.normal_index + 1], attributes.normals[3 * i1.normal_index + 2]);
+			glm::vec3 n3 = glm::vec3(attributes.normals[3 * i2.normal_index + 0], attributes.normals[3 * i2.normal_index + 1], attributes.normals[3 * i2.normal_index + 2]);
+			glm::vec2 t1 = glm::vec2(attributes.texcoords[2 * i0.texcoord_index + 0], attributes.texcoords[2 * i0.texcoord_index + 1]);
+			glm::vec2 t2 = glm::vec2(attributes.texcoords[2 * i1.texcoord_index + 0], attributes.texcoords[2 * i1.texcoord_index + 1]);
+			glm::vec2 t3 = glm::vec2(attributes.texcoords[2 * i2.texcoord_index + 0], attributes.texcoords[2 * i2.texcoord_index + 1]);
+			int matid = shape.mesh.material_ids[v] + firstmat;
+			AddTriangleVNT(v1, v2, v3, n1, n2, n3, t1, t2, t3, matid);
+		}
+	}
+
+}
+//---------------------------------------------------------------------------
+//---------------------------------------------------------------------------
+
+static bool ConvertPixels(unsigned char* dest, const unsigned char* src, int numpix, TPixelFormat bmpformat, GLenum& glformat)
+{
+	/// Copy bitmap pixels to dest in OpenGL channel order
+	/// Returns false if the pixel format is not supported
+
+	if(bmpformat == TPixelFormat::RGB) {
+		glformat = GL_RGB;
+		memcpy(dest, src, numpix * 3);
+	}
+	else if(bmpformat == TPixelFormat::RGBA) {
+		glformat = GL_RGBA;
+		memcpy(dest, src, numpix * 4);
+	}
+	else if(bmpformat == TPixelFormat::BGR) {
+		glformat = GL_RGB;
+		for(int p=0; p<numpix; p++) {
+			dest[p*3] = src[p*3+2];
+			dest[p*3+1] = src[p*3+1];
+			dest[p*3+2] = src[p*3];
+		}
+	}
+	else if(bmpformat == TPixelFormat::BGRA) {
+		glformat = GL_RGBA;
+		for(int p=0; p<numpix; p++) {
+			dest[p*4] = src[p*4+2];
+			dest[p*4+1] = src[p*4+1];
+			dest[p*4+2] = src[p*4];
+			dest[p*4+3] = src[p*4+3];
+		}
+	}
+	else {
+		return false;
+	}
+
+	return true;
+}
+//---------------------------------------------------------------------------
+
+void __fastcall GLTexture::LoadTextureAsync(const std::wstring& file, bool flip, GLUploadThread* worker)
+{
+	/// Loads texture from file without stalling the render thread
+	/// The texture shows a grey placeholder until the image is ready
+	/// The file is decoded and copied into a mapped pixel unpack buffer on worker,
+	/// then Update uploads from the buffer and a fence tracks completion
+	/// worker is a GLUploadThread without a context
+	/// A file that cannot be decoded keeps the placeholder and sets LoadFailed, no
+	/// message is shown as this runs inside the frame, maybe on the render thread
+
+	filename = file;
+	loadFailed = false;
+
+	// placeholder so the texture can be used at once
+	const unsigned char grey[4] = { 128, 128, 128, 255 };
+	glGenTextures(1, &textureID);
+	glBindTexture(GL_TEXTURE_2D, textureID);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, grey);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	transfer = std::make_shared<GLPixelTransfer>();
+	transfer->state = GLTransferState::DECODING;
+	transfer->bitmap = nullptr;
+	transfer->PBO = 0;
+	transfer->mapped = nullptr;
+	transfer->fence = 0;
+	transfer->worker = worker;
+	transfer->converted = false;
+	transfer->failed = false;
+	transfer->row = 0;
+
+	// decode and keep bitmap mapped for the copy
+	// any failure, including a corrupt or unsupported image, leaves the placeholder
+	GLPixelTransfer* t = transfer.get();
+	transfer->job = worker->Post([t, file, flip]() {
+		TBitmap* bmp = new TBitmap();
+		try {
+			bmp->LoadFromFile(file.c_str());
+			if(flip) bmp->FlipVertical();
+			if(bmp->Width * bmp->Height == 0 || !bmp->Map(TMapAccess::Read, t->data)) {
+				delete bmp;
+				t->failed = true;
+				return;
+			}
+		} catch (Exception& e) {
+			delete bmp;
+			t->failed = true;
+			return;
+		} catch (...) {
+			delete bmp;
+			t->failed = true;
+			return;
+		}
+		t->bitmap = bmp;
+	});
+}
+//---------------------------------------------------------------------------
+
+void __fastcall GLTexture::UpdateTransfer(GLUploadScheduler* scheduler)
+{
+	/// Advance a texture started by LoadTextureAsync
+	/// Called each frame on the render thread, never blocks
+
+	GLPixelTransfer& t = *transfer;
+
+	if(t.job) {
+		if(!GLUploadThread::IsComplete(*t.job)) return;
+		t.job.reset();
+	}
+
+	if(t.state == GLTransferState::DECODING) {
+		// image decoded, map a buffer for the worker to copy into
+		if(t.failed || t.bitmap == nullptr) {
+			loadFailed = true;
+			transfer.reset();
+			return;
+		}
+
+		t.width = t.bitmap->Width;
+		t.height = t.bitmap->Height;
+		int size = t.width * t.height * t.data.BytesPerPixel;
+
+		glGenBuffers(1, &t.PBO);
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, t.PBO);
+		glBufferData(GL_PIXEL_UNPACK_BUFFER, size, NULL, GL_STREAM_DRAW);
+		t.mapped = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+		GLPixelTransfer* pt = &t;
+		t.state = GLTransferState::COPYING;
+		t.job = t.worker->Post([pt]() {
+			pt->converted = pt->mapped != nullptr &&
+				ConvertPixels((unsigned char*)pt->mapped, (unsigned char*)pt->data.Data, pt->width * pt->height, pt->data.PixelFormat, pt->format);
+			pt->bitmap->Unmap(pt->data);
+			delete pt->bitmap;
+			pt->bitmap = nullptr;
+		});
+	}
+	else if(t.state == GLTransferState::COPYING) {
+		// pixels are in the buffer, sent to the texture as many rows a frame as the
+		// budget allows
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, t.PBO);
+		if(t.mapped != nullptr) {
+			glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+			t.mapped = nullptr;
+		}
+
+		if(!t.converted) {
+			loadFailed = true;
+			if(t.bitmap != nullptr) {
+				// copy job threw before releasing the image
+				t.bitmap->Unmap(t.data);
+				delete t.bitmap;
+				t.bitmap = nullptr;
+			}
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+			glDeleteBuffers(1, &t.PBO);
+			transfer.reset();
+			return;
+		}
+
+		int rowbytes = t.width * 4;
+		long long remaining = (long long)(t.height - t.row) * rowbytes;
+		if(scheduler != nullptr) remaining = scheduler->Take(remaining, rowbytes);
+		int rows = remaining / rowbytes;
+		if(rows == 0) {
+			// budget spent
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+			return;
+		}
+
+		// rows at their offset in the bound unpack buffer, the image is made at the first
+		glBindTexture(GL_TEXTURE_2D, textureID);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+		if(t.row == 0) glTexImage2D(GL_TEXTURE_2D, 0, t.format, t.width, t.height, 0, t.format, GL_UNSIGNED_BYTE, NULL);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, t.row, t.width, rows, t.format, GL_UNSIGNED_BYTE, (void*)((size_t)t.row * rowbytes));
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+		t.row += rows;
+		if(t.row >= t.height) glGenerateMipmap(GL_TEXTURE_2D);
+		glBindTexture(GL_TEXTURE_2D, 0);
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		if(t.row < t.height) return;
+
+		t.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		t.state = GLTransferState::UPLOADING;
+	}
+	else if(t.state == GLTransferState::UPLOADING) {
+		// buffer can be deleted once the GPU has read it
+		GLenum result = glClientWaitSync(t.fence, 0, 0);
+		if(result != GL_ALREADY_SIGNALED && result != GL_CONDITION_SATISFIED) return;
+
+		glDeleteSync(t.fence);
+		glDeleteBuffers(1, &t.PBO);
+		transfer.reset();
+	}
+}
+//---------------------------------------------------------------------------
+
+void __fastcall GLTexture::CancelTransfer()
+{
+	/// Stop a texture load started by LoadTextureAsync
+	/// Waits for the worker if it is using the bitmap or mapped buffer
+
+	GLPixelTransfer& t = *transfer;
+	if(t.job) GLUploadThread::Wait(*t.job);
+
+	if(t.bitmap != nullptr) {
+		t.bitmap->Unmap(t.data);
+		delete t.bitmap;
+	}
+	if(t.PBO > 0) {
+		if(t.mapped != nullptr) {
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, t.PBO);
+			glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		}
+		glDeleteBuffers(1, &t.PBO);
+	}
+	if(t.fence != 0) glDeleteSync(t.fence);
+
+	transfer.reset();
+}
+//---------------------------------------------------------------------------
+
+void __fastcall GLTexture::LoadTextureFromFile(const std::wstring& file, bool flip, GLUploadThread* loader, bool defer)
+{
+	/// Loads texture from file
+
+	filename = file;
+	TBitmap* textureBMP = new TBitmap();
+	try {
+		textureBMP->LoadFromFile(filename.c_str());
+		LoadTextureFromBitmap(textureBMP, flip, loader, defer);
+	} catch (EFOpenError& e) {
+		String message = "Failed to load ";
+		message = message + filename.c_str();
+		ShowMessage(message.c_str());
+	}
+
+	delete textureBMP;
+}
+//---------------------------------------------------------------------------
+
+void __fastcall GLTexture::LoadTextureFromResource(const wchar_t* bmpresource, bool flip)
+{
+	/// Loads texture from program resource
+
+	TBitmap* bmp = new TBitmap();
+	TResourceStream *bmp_stream = new TResourceStream((int)HInstance, bmpresource, (System::WideChar*)RT_RCDATA);
+	__try {
+		__try {
+			bmp->LoadFromStream(bmp_stream);
+		}
+		__finally {
+		}
+	}
+	__finally {
+		bmp_stream->DisposeOf();
+	}
+
+	LoadTextureFromBitmap(bmp, flip);
+	delete bmp;
+}
+//---------------------------------------------------------------------------
+
+void __fastcall GLTexture::LoadTextureFromBitmap(TBitmap* textureBMP, bool flip, GLUploadThread* loader, bool defer)
+{
+	/// Loads bitmap file into texture
+	/// Uses TBitmap to read file
+    /// if flip, bitmap is flipped vertically
+	/// if loader is set the pixels are uploaded on the loader thread
+	/// if defer the pixels are kept and uploaded by Update within the frame budget
+
+	textureID = 0;
+
+	TBitmapData data;
 	if(!textureBMP->Map(TMapAccess::Read, data)) {
 		ShowMessage("Failed to access texture !!!");
 		return;
 	}
 
-	int numpix = textureBMP->Width * textureBMP->Height;
-	if(numpix == 0) {
-		ShowMessage("Failed to load texture !!!");
-		textureBMP->Unmap(data);
-		return;
+	int numpix = textureBMP->Width * textureBMP->Height;
+	if(numpix == 0) {
+		ShowMessage("Failed to load texture !!!");
+		textureBMP->Unmap(data);
+		return;
+	}
+
+	if(flip) {
+		// texture is flipped
+		textureBMP->FlipVertical();
+	}
+
+	int bpp = data.BytesPerPixel;
+
+	//unsigned int { None, RGB, RGBA, BGR, BGRA, RGBA16, BGR_565, BGRA4, BGR4, BGR5_A1, BGR5, BGR10_A2, RGB10_A2, L, LA, LA4, L16, A, R16F, RG16F, RGBA16F, R32F, RG32F, RGBA32F };
+	Fmx::Types::TPixelFormat bmpformat = data.PixelFormat;
+
+	// GL_ALPHA, GL_ALPHA4, GL_ALPHA8, GL_ALPHA12, GL_ALPHA16, GL_COMPRESSED_ALPHA, GL_COMPRESSED_LUMINANCE, GL_COMPRESSED_LUMINANCE_ALPHA,
+	// GL_COMPRESSED_INTENSITY, GL_COMPRESSED_RGB, GL_COMPRESSED_RGBA, GL_DEPTH_COMPONENT, GL_DEPTH_COMPONENT16, GL_DEPTH_COMPONENT24, GL_DEPTH_COMPONENT32,
+	// GL_LUMINANCE, GL_LUMINANCE4, GL_LUMINANCE8, GL_LUMINANCE12, GL_LUMINANCE16, GL_LUMINANCE_ALPHA, GL_LUMINANCE4_ALPHA4, GL_LUMINANCE6_ALPHA2,
+	// GL_LUMINANCE8_ALPHA8, GL_LUMINANCE12_ALPHA4, GL_LUMINANCE12_ALPHA12, GL_LUMINANCE16_ALPHA16, GL_INTENSITY, GL_INTENSITY4, GL_INTENSITY8,
+	// GL_INTENSITY12, GL_INTENSITY16, GL_R3_G3_B2, GL_RGB, GL_RGB4, GL_RGB5, GL_RGB8, GL_RGB10, GL_RGB12, GL_RGB16, GL_RGBA, GL_RGBA2, GL_RGBA4,
+	//  GL_RGB5_A1, GL_RGBA8, GL_RGB10_A2, GL_RGBA12, GL_RGBA16, GL_SLUMINANCE, GL_SLUMINANCE8, GL_SLUMINANCE_ALPHA, GL_SLUMINANCE8_ALPHA8, GL_SRGB,
+	// GL_SRGB8, GL_SRGB_ALPHA, or GL_SRGB8_ALPHA8.
+	GLenum glformat;
+
+
+	unsigned char* buffer = new unsigned char[numpix * bpp];
+
+	if(!ConvertPixels(buffer, (unsigned char*)data.Data, numpix, bmpformat, glformat)) {
+		ShowMessage("Unknown texture file format !!!");
+		textureID = 0;
+		textureBMP->Unmap(data);
+		delete textureBMP;
+		delete[] buffer;
+		return;
+	}
+
+	glGenTextures(1, &textureID); // Create The Texture
+
+	if(defer && loader == nullptr) {
+		// allocate storage now, rows are sent by UploadRows
+		textureFormat = glformat;
+		textureWidth = textureBMP->Width;
+		textureHeight = textureBMP->Height;
+		pendingPixels.assign(buffer, buffer + numpix * bpp);
+		pendingRow = 0;
+
+		glBindTexture(GL_TEXTURE_2D, textureID);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexImage2D(GL_TEXTURE_2D, 0, glformat, textureWidth, textureHeight, 0, glformat, GL_UNSIGNED_BYTE, NULL);
+		glBindTexture(GL_TEXTURE_2D, 0);
+
+		textureBMP->Unmap(data);
+		delete[] buffer;
+		return;
+	}
+
+	if(loader != nullptr) {
+		// upload on loader thread, texture is not drawn until the job completes
+		// name is shared between the contexts so can be created here
+		int width = textureBMP->Width;
+		int height = textureBMP->Height;
+		GLuint id = textureID;
+		std::shared_ptr<std::vector<unsigned char>> pixels = std::make_shared<std::vector<unsigned char>>(buffer, buffer + numpix * bpp);
+		textureJob = loader->Post([id, glformat, width, height, pixels]() {
+			glBindTexture(GL_TEXTURE_2D, id);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+			glTexImage2D(GL_TEXTURE_2D, 0, glformat, width, height, 0, glformat, GL_UNSIGNED_BYTE, pixels->data());
+			glGenerateMipmap(GL_TEXTURE_2D);
+			glBindTexture(GL_TEXTURE_2D, 0);
+		});
+
+		textureBMP->Unmap(data);
+		delete[] buffer;
+		return;
+	}
+
+	// Typical Texture Generation Using Data From The Bitmap
+	glBindTexture(GL_TEXTURE_2D, textureID);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexImage2D(GL_TEXTURE_2D, 0, glformat, textureBMP->Width, textureBMP->Height, 0, glformat, GL_UNSIGNED_BYTE, buffer);
+    glGenerateMipmap(GL_TEXTURE_2D);
+
+	GLenum error = glGetError();
+	if(error != GL_NO_ERROR) {
+		ShowMessage("Error creating texture !!!");
+		textureID = 0;
+	}
+
+	textureBMP->Unmap(data);
+	delete[] buffer;
+}
+//---------------------------------------------------------------------------
+
+GLTexture::GLTexture()
+	: vertexBuffer(sizeof(GLTextureTriangle), GL_DYNAMIC_DRAW)
+{
+	/// Constructor
+	/// Vertex arrays for the triangles are kept by each window in a GLBufferView
+	changed = true;
+	loadFailed = false;
+	layout = UniqueId();
+    textureID = 0;
+	textureFormat = 0;
+	textureWidth = 0;
+	textureHeight = 0;
+	pendingRow = 0;
+	boundsMin = glm::vec3(FLT_MAX);
+	boundsMax = glm::vec3(-FLT_MAX);
+}
+//---------------------------------------------------------------------------
+
+GLTexture::~GLTexture()
+{
+	/// Destructor deletes texture
+	vertexBuffer.Release();
+	if(transfer) CancelTransfer();
+	if(textureJob) {
+		GLUploadThread::Wait(*textureJob);
+		textureJob.reset();
+	}
+	glDeleteTextures(1, &textureID);
+}
+//---------------------------------------------------------------------------
+
+void __fastcall GLTexture::FinishUploads()
+{
+	/// Wait for uploads on the loader thread
+	/// The results are taken at the next render
+
+	vertexBuffer.Finish();
+	if(textureJob) GLUploadThread::Wait(*textureJob);
+}
+//---------------------------------------------------------------------------
+
+void __fastcall GLTexture::ClearTriangles()
+{
+	/// Delete added triangles
+	/// Buffer is kept and refilled when new triangles are added
+
+	triangleList.clear();
+	remap.clear();
+	unmap.clear();
+	boundsMin = glm::vec3(FLT_MAX);
+	boundsMax = glm::vec3(-FLT_MAX);
+	vertexBuffer.Invalidate();
+	layout = UniqueId();
+	changed = true;
+}
+//---------------------------------------------------------------------------
+
+void __fastcall GLTexture::SetTriangleColor(int trinum, glm::vec3& color)
+{
+	if(trinum < 0 || trinum >= triangleList.size()) return;
+	if(remap.size() > 0) trinum = remap[trinum];
+
+	GLTextureTriangle& tri = triangleList[trinum];
+	memcpy(tri.vert[0].color, glm::value_ptr(color), sizeof(glm::vec3));
+	memcpy(tri.vert[1].color, glm::value_ptr(color), sizeof(glm::vec3));
+	memcpy(tri.vert[2].color, glm::value_ptr(color), sizeof(glm::vec3));
+
+	// uploaded with other edits at next render
+	vertexBuffer.MarkDirty(trinum, 1);
+	changed = true;
+}
+//---------------------------------------------------------------------------
+
+glm::vec3 __fastcall GLTexture::GetTriangleColor(int trinum)
+{
+	if(trinum < 0 || trinum >= triangleList.size()) return glm::vec3(0.0f, 0.0f, 0.0f);
+	if(remap.size() > 0) trinum = remap[trinum];
+
+	glm::vec3 color;
+	GLTextureTriangle& tri = triangleList[trinum];
+	memcpy(glm::value_ptr(color), tri.vert[0].color, sizeof(glm::vec3));
+
+    return color;
+}
+//---------------------------------------------------------------------------
+
+void __fastcall GLTexture::CreateArrays(GLUploadThread* loader, GLUploadScheduler* scheduler)
+{
+	/// Upload textured triangles to the vertex buffer
+	/// Only triangles added since the last upload are copied to the buffer
+	/// Windows attach their vertex arrays again if the buffer was reallocated
+
+	// triangle buffer is GL_DYNAMIC_DRAW to allow changes to color for highlighting
+	vertexBuffer.Upload(triangleList.data(), triangleList.size(), loader, scheduler);
+}
+//---------------------------------------------------------------------------
+
+void __fastcall GLTexture::Update(GLUploadThread* loader, GLUploadScheduler* scheduler, bool geometry)
+{
+	/// Upload new triangles, color edits and texture rows
+	/// If loader is set large uploads are done on the loader thread
+	/// If scheduler is set only the data that fits in the frame budget is sent
+	/// If not geometry the triangles are left for a GLTextureBatch to draw
+
+	if(changed && geometry) {
+		CreateArrays(loader, scheduler);
+		changed = vertexBuffer.Pending() || vertexBuffer.Count() < triangleList.size();
+	}
+
+	// texture uploading on loader thread
+	if(textureJob) {
+		if(GLUploadThread::IsComplete(*textureJob)) textureJob.reset();
+	}
+
+	// texture rows waiting for budget
+	if(pendingPixels.size() > 0) {
+		UploadRows(scheduler);
+	}
+
+	// texture decoding on worker thread or uploading from pixel buffer
+	if(transfer) {
+		UpdateTransfer(scheduler);
+	}
+}
+//---------------------------------------------------------------------------
+
+void __fastcall GLTexture::UploadRows(GLUploadScheduler* scheduler)
+{
+	/// Upload as many texture rows as the budget allows
+	/// Mipmaps are generated when the last row has been sent
+
+	int rowbytes = pendingPixels.size() / textureHeight;
+	long long remaining = (long long)(textureHeight - pendingRow) * rowbytes;
+	if(scheduler != nullptr) remaining = scheduler->Take(remaining, rowbytes);
+
+	int rows = remaining / rowbytes;
+	if(rows == 0) return;   // budget spent
+
+	glBindTexture(GL_TEXTURE_2D, textureID);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, pendingRow, textureWidth, rows, textureFormat, GL_UNSIGNED_BYTE, pendingPixels.data() + (size_t)pendingRow * rowbytes);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	pendingRow += rows;
+
+	if(pendingRow >= textureHeight) {
+		glGenerateMipmap(GL_TEXTURE_2D);
+		std::vector<unsigned char>().swap(pendingPixels);
+		pendingRow = 0;
+	}
+	glBindTexture(GL_TEXTURE_2D, 0);
+}
+//---------------------------------------------------------------------------
+
+void __fastcall GLTexture::Cull(GLBufferView& view, GLFrustum* frustum, GLRenderStats& stats, bool occlusion, GLCullCompute* compute)
+{
+	/// Find the chunks of triangles inside frustum, all chunks if nullptr
+	/// If occlusion chunks hidden at their last query are skipped
+	/// If compute is set the chunks are culled on the GPU, against the frustum given to it
+	/// view holds the chunks of the window drawing, after SyncView
+
+	view.chunks.Update(triangleList);
+	view.indirect = compute != nullptr;
+	if(view.indirect) view.chunks.CullIndirect(*compute, view.array.Ready() ? vertexBuffer.Count() : 0, stats);
+	else view.chunks.Cull(frustum, stats, occlusion);
+}
+//---------------------------------------------------------------------------
+
+void __fastcall GLTexture::Render(GLBufferView& view, GLStateCache& state, bool bindtexture)
+{
+	/// Draw triangles uploaded so far in the chunks of view found by the last Cull
+	/// Nothing is drawn until the texture has been uploaded
+	/// If not bindtexture the texture is left unbound, as for a depth only pass
+
+	if(!Drawable()) return;
+
+	if(vertexBuffer.Count() > 0 && view.array.Ready()) {
+		if(view.indirect) {
+			if(bindtexture) state.BindTexture(0, textureID);
+			view.array.Bind(state);
+			view.chunks.DrawIndirect();
+			return;
+		}
+
+		view.drawFirst.clear();
+		view.drawCount.clear();
+		view.chunks.Clip(0, vertexBuffer.Count(), view.drawFirst, view.drawCount);
+		if(view.drawFirst.size() == 0) return;
+
+		if(bindtexture) state.BindTexture(0, textureID);
+		view.array.Bind(state);
+		glMultiDrawArrays(GL_TRIANGLES, view.drawFirst.data(), view.drawCount.data(), view.drawFirst.size());
+	}
+}
+//---------------------------------------------------------------------------
+
+void __fastcall GLTexture::AddTriangleVT(glm::vec3& p1, glm::vec3& p2, glm::vec3& p3, glm::vec2& t1, glm::vec2& t2, glm::vec2& t3)
+{
+	/// Add triangle colored by texture
+	/// The normal of the vertices is the normal of the triangle (flat shaded)
+	/// p1, p2, p3: position of three vertices
+	/// t1, t2, t3: texture coordinates of three vertices
+	/// texid: index of texture returned by AddTexture
+
+	GLTextureTriangle& tri = triangleList.emplace_back();
+
+	memcpy(tri.vert[0].pos, glm::value_ptr(p1), 3 * sizeof(float));
+	memcpy(tri.vert[1].pos, glm::value_ptr(p2), 3 * sizeof(float));
+	memcpy(tri.vert[2].pos, glm::value_ptr(p3), 3 * sizeof(float));
+
+	glm::vec3 norm = glm::triangleNormal(p1, p2, p3);
+	memcpy(tri.vert[0].norm, glm::value_ptr(norm), 3 * sizeof(float));
+	memcpy(tri.vert[1].norm, glm::value_ptr(norm), 3 * sizeof(float));
+	memcpy(tri.vert[2].norm, glm::value_ptr(norm), 3 * sizeof(float));
+
+	glm::vec3 color(0.0f, 0.0f, 0.0f);
+	memcpy(tri.vert[0].color, glm::value_ptr(color), 3 * sizeof(float));
+	memcpy(tri.vert[1].color, glm::value_ptr(color), 3 * sizeof(float));
+	memcpy(tri.vert[2].color, glm::value_ptr(color), 3 * sizeof(float));
+
+	memcpy(tri.vert[0].tex, glm::value_ptr(t1), 2 * sizeof(float));
+	memcpy(tri.vert[1].tex, glm::value_ptr(t2), 2 * sizeof(float));
+	memcpy(tri.vert[2].tex, glm::value_ptr(t3), 2 * sizeof(float));
+
+	boundsMin = glm::min(boundsMin, glm::min(p1, glm::min(p2, p3)));
+	boundsMax = glm::max(boundsMax, glm::max(p1, glm::max(p2, p3)));
+
+	if(remap.size() > 0) {
+		remap.push_back(triangleList.size() - 1);
+		unmap.push_back(triangleList.size() - 1);
+	}
+
+	changed = true;
+}
+//---------------------------------------------------------------------------
+
+void __fastcall GLTexture::AddTriangleVNT(glm::vec3& p1, glm::vec3& p2, glm::vec3& p3, glm::vec3& n1, glm::vec3& n2, glm::vec3& n3, glm::vec2& t1, glm::vec2& t2, glm::vec2& t3)
+{
+	/// Add triangle colored by texture
+	/// p1, p2, p3: position of three vertices
+	/// n1, n2, n3: normal at each vertex
+	/// t1, t2, t3: texture coordinates of three vertices
+	/// texid: index of texture returned by AddTexture
+
+	GLTextureTriangle& tri = triangleList.emplace_back();
+
+	memcpy(tri.vert[0].pos, glm::value_ptr(p1), 3 * sizeof(float));
+	memcpy(tri.vert[1].pos, glm::value_ptr(p2), 3 * sizeof(float));
+	memcpy(tri.vert[2].pos, glm::value_ptr(p3), 3 * sizeof(float));
+
+	memcpy(tri.vert[0].norm, glm::value_ptr(n1), 3 * sizeof(float));
+	memcpy(tri.vert[1].norm, glm::value_ptr(n2), 3 * sizeof(float));
+	memcpy(tri.vert[2].norm, glm::value_ptr(n3), 3 * sizeof(float));
+
+	glm::vec3 color(0.0f, 0.0f, 0.0f);
+	memcpy(tri.vert[0].color, glm::value_ptr(color), 3 * sizeof(float));
+	memcpy(tri.vert[1].color, glm::value_ptr(color), 3 * sizeof(float));
+	memcpy(tri.vert[2].color, glm::value_ptr(color), 3 * sizeof(float));
+
+	memcpy(tri.vert[0].tex, glm::value_ptr(t1), 2 * sizeof(float));
+	memcpy(tri.vert[1].tex, glm::value_ptr(t2), 2 * sizeof(float));
+	memcpy(tri.vert[2].tex, glm::value_ptr(t3), 2 * sizeof(float));
+
+	boundsMin = glm::min(boundsMin, glm::min(p1, glm::min(p2, p3)));
+	boundsMax = glm::max(boundsMax, glm::max(p1, glm::max(p2, p3)));
+
+	if(remap.size() > 0) {
+		remap.push_back(triangleList.size() - 1);
+		unmap.push_back(triangleList.size() - 1);
+	}
+
+	changed = true;
+}
+//---------------------------------------------------------------------------
+
+int __fastcall GLTexture::PickTriangle(glm::vec3& raystart, glm::vec3& raydir, float& mindist)
+{
+	int tri = -1;
+	for(int i=0; i<triangleList.size(); i++) {
+		if(RayTriangle(raystart, raydir, triangleList[i].vert[0].pos, triangleList[i].vert[1].pos, triangleList[i].vert[2].pos, mindist)) {
+			tri = i;
+		}
+	}
+
+	// sorted triangles are returned with index used when added
+	if(tri >= 0 && unmap.size() > 0) tri = unmap[tri];
+	return tri;
+}
+//---------------------------------------------------------------------------
+
+void __fastcall GLTexture::SortTriangles()
+{
+	/// Reorder triangles by Morton code of their centroid
+	/// Indices returned by PickTriangle are not changed by sorting
+
+	MortonSort(triangleList, remap, unmap);
+	vertexBuffer.Invalidate();
+	layout = UniqueId();
+	changed = true;
+}
+
+//---------------------------------------------------------------------------
+//---------------------------------------------------------------------------
+
+static std::string __fastcall getNext(TResourceStream* stream)
+{
+	/// Used by GLFont to read csv font data
+
+	std::string str;
+	char c;
+
+	while(stream->Read(&c, 1) == 1) {
+		if(c == ',' || c == '\n') break;
+		str = str + c;
+	}
+
+	return str;
+}
+//---------------------------------------------------------------------------
+//---------------------------------------------------------------------------
+
+GLFont::GLFont(wchar_t* bmpresource, wchar_t* dataresource)
+{
+	/// Create Font bitmap from image resource and data resource
+    /// Resources created using "Codehead's Bitmap Font Generator"
+	/// Created once for a scene, the text of each window is kept by a GLText
+
+	pointSize = 0.05f;
+
+
+	billboardShader = CreateShader(billboardVertexSource, billboardFragmentSource);
+	pvmLoc = glGetUniformLocation(billboardShader, "pvm");
+	xscaleLoc = glGetUniformLocation(billboardShader, "xscale");
+
+	fontTexture.LoadTextureFromResource(bmpresource, false);
+	pointTexture.LoadTextureFromResource(L"POINT_PNG", false);
+
+	// character spacing
+	TResourceStream *spacing_stream = new TResourceStream((NativeUInt)HInstance, dataresource, (System::WideChar*)RT_RCDATA);
+	__try {
+		__try {
+			// load key-value map
+			bool finished = false;
+			while(!finished) {
+				std::string key = getNext(spacing_stream);
+				if(key.size() == 0) {
+					finished = true;
+				}
+				else {
+					std::string value = getNext(spacing_stream);
+					if(isdigit(value[0])) {
+						int v = std::stoi(value, nullptr);
+						props.emplace(std::make_pair(key, v));
+					}
+				}
+			}
+		}
+		__finally {
+		}
+	}
+	__finally {
+		spacing_stream->DisposeOf();
+	}
+
+	for(int w=0; w<256; w++) {
+		std::string str = "Char " + std::to_string(w) + " Base Width";
+		charWidth[w] = props[str];
+	}
+
+	imageWidth = props["Image Width"];
+	imageHeight = props["Image Height"];
+	cellWidth = props["Cell Width"];
+	cellHeight = props["Cell Height"];
+	startChar = props["Start Char"];
+	fontHeight = props["Font Height"];
+}
+//---------------------------------------------------------------------------
+
+GLFont::~GLFont()
+{
+	/// Destructor deletes the shader, textures are deleted with their GLTexture
+
+	glDeleteProgram(billboardShader);
+}
+//---------------------------------------------------------------------------
+//---------------------------------------------------------------------------
+
+GLText::GLText(GLFont* textfont)
+	: streamArray(sizeof(GLBillboardVertex)), pointBuffer(sizeof(GLBillboardQuad), GL_DYNAMIC_DRAW), pointArray(sizeof(GLBillboardVertex))
+{
+	/// Constructor
+	/// textfont is the font of the scene, which outlives the windows drawing it
+
+	font = textfont;
+	pointsChanged = true;
+	for(GLVertexArray* array : { &streamArray, &pointArray }) {
+		array->Attribute(0, 3, 0);                   // position
+		array->Attribute(1, 3, 3 * sizeof(float));   // center
+		array->Attribute(2, 3, 6 * sizeof(float));   // color
+		array->Attribute(3, 2, 9 * sizeof(float));   // texture coord
+	}
+}
+//---------------------------------------------------------------------------
+
+GLText::~GLText()
+{
+	/// Destructor deletes vertex arrays and the point buffer
+
+	streamArray.Release();
+	pointArray.Release();
+	pointBuffer.Release();
+}
+//---------------------------------------------------------------------------
+
+void __fastcall GLText::AddText2D(float centerx, float centery, float height, GLTextPos horiz_align, GLTextPos vert_align, const char* str, glm::vec3 color)
+{
+	/// Create textured triangles and add to list
+	/// centerx, centery are screen position (0 to 1)
+	/// height is character size
+	/// horiz_align, vert_align are position of text relative to center
+	/// Can be LEFT, CENTER or RIGHT / ABOVE, CENTER or BELOW
+	/// str is the text string - ASCII only
+	/// color is the text color
+
+	glm::vec3 pos(centerx, centery, 0.0);
+
+	// scale converts font pixel width to screen size
+	float scalex = height / (float)font->fontHeight;
+
+	float dx = 0.0f;
+	float dy = 0.0f;
+
+	float strsize = 0;
+	for(int i=0; i<strlen(str); i++) {
+		int c = (int)(str[i]);
+		strsize += font->charWidth[c];
+	}
+	strsize *= scalex;
+
+	if(horiz_align == GLTextPos::LEFT) {
+		dx -= strsize;
+	}
+	if(horiz_align == GLTextPos::CENTER) {
+		dx -= strsize / 2.0f;
+	}
+	if(vert_align == GLTextPos::BELOW) {
+		dy -= height;
+	}
+	if(vert_align == GLTextPos::CENTER) {
+		dy -= height / 2.0f;
+	}
+
+	int char_per_line = font->imageWidth / font->cellWidth;
+	float texh = (float)font->fontHeight / (float)font->imageHeight;
+
+	for(int i=0; i<strlen(str); i++) {
+		int c = (int)(str[i]);
+
+		float charwidth = font->charWidth[c] * scalex;
+
+		glm::vec3 p0(dx, dy, 0.0f);   					 // BL
+		glm::vec3 p1(dx + charwidth, dy, 0.0f);    		 // BR
+		glm::vec3 p2(dx + charwidth, dy + height, 0.0f);   // TR
+		glm::vec3 p3(dx, dy + height, 0.0f); 				 // TL
+
+		int pixleft = font->cellWidth * ((c  - font->startChar) % char_per_line);
+		int pixtop = font->cellHeight * ((c  - font->startChar) / char_per_line);
+		float texleft = (float)pixleft / (float)font->imageWidth;
+		float textop = ((float)pixtop / (float)font->imageHeight);
+		float texw = (float)font->charWidth[c] / (float)font->imageWidth;
+
+		glm::vec2 t0(texleft, textop+texh);      // BL
+		glm::vec2 t1(texleft+texw, textop+texh); // BR
+		glm::vec2 t2(texleft+texw, textop);      // TR
+		glm::vec2 t3(texleft, textop);           // TL
+
+		GLBillboardQuad& quad = quad2DList.emplace_back();
+
+		// triangle 1
+		memcpy(quad.tri1[0].pos, glm::value_ptr(p0), 3 * sizeof(float));
+		memcpy(quad.tri1[1].pos, glm::value_ptr(p1), 3 * sizeof(float));
+		memcpy(quad.tri1[2].pos, glm::value_ptr(p2), 3 * sizeof(float));
+
+		memcpy(quad.tri1[0].center, glm::value_ptr(pos), 3 * sizeof(float));
+		memcpy(quad.tri1[1].center, glm::value_ptr(pos), 3 * sizeof(float));
+		memcpy(quad.tri1[2].center, glm::value_ptr(pos), 3 * sizeof(float));
+
+		memcpy(quad.tri1[0].color, glm::value_ptr(color), 3 * sizeof(float));
+		memcpy(quad.tri1[1].color, glm::value_ptr(color), 3 * sizeof(float));
+		memcpy(quad.tri1[2].color, glm::value_ptr(color), 3 * sizeof(float));
+
+		memcpy(quad.tri1[0].tex, glm::value_ptr(t0), 2 * sizeof(float));
+		memcpy(quad.tri1[1].tex, glm::value_ptr(t1), 2 * sizeof(float));
+		memcpy(quad.tri1[2].tex, glm::value_ptr(t2), 2 * sizeof(float));
+
+		// triangle 2
+		memcpy(quad.tri2[0].pos, glm::value_ptr(p0), 3 * sizeof(float));
+		memcpy(quad.tri2[1].pos, glm::value_ptr(p2), 3 * sizeof(float));
+		memcpy(quad.tri2[2].pos, glm::value_ptr(p3), 3 * sizeof(float));
+
+		memcpy(quad.tri2[0].center, glm::value_ptr(pos), 3 * sizeof(float));
+		memcpy(quad.tri2[1].center, glm::value_ptr(pos), 3 * sizeof(float));
+		memcpy(quad.tri2[2].center, glm::value_ptr(pos), 3 * sizeof(float));
+
+		memcpy(quad.tri2[0].color, glm::value_ptr(color), 3 * sizeof(float));
+		memcpy(quad.tri2[1].color, glm::value_ptr(color), 3 * sizeof(float));
+		memcpy(quad.tri2[2].color, glm::value_ptr(color), 3 * sizeof(float));
+
+		memcpy(quad.tri2[0].tex, glm::value_ptr(t0), 2 * sizeof(float));
+		memcpy(quad.tri2[1].tex, glm::value_ptr(t2), 2 * sizeof(float));
+		memcpy(quad.tri2[2].tex, glm::value_ptr(t3), 2 * sizeof(float));
+
+		dx += charwidth;
+	}
+}
+//---------------------------------------------------------------------------
+
+void __fastcall GLText::AddText3D(glm::vec3 pos, float height, GLTextPos horiz_align, GLTextPos vert_align, const char* str, glm::vec3 color, bool point)
+{
+	/// Create textured triangles and add to list
+	/// pos is world space, height is world scale
+	/// centerx, centery are screen position (0 to 1)
+	/// height is character size
+	/// horiz_align, vert_align are position of text relative to center
+	/// Can be LEFT, CENTER or RIGHT / ABOVE, CENTER or BELOW
+	/// str is the text string - ASCII only
+	/// color is the text color
+
+	// scale converts font bmp pixel to world size
+	float scalex = height / (float)font->fontHeight;
+
+	float strsize = 0;
+	for(int i=0; i<strlen(str); i++) {
+		int c = (int)(str[i]);
+		strsize += font->charWidth[c];
+	}
+	strsize *= scalex;
+
+	float x = 0.0f;
+	float y = 0.0f;
+
+	if(horiz_align == GLTextPos::RIGHT) {
+		if(point) x += 2 * font->pointSize;
+	}
+	if(horiz_align == GLTextPos::LEFT) {
+		x -= strsize;
+		if(point) x -= 2 * font->pointSize;
+	}
+	if(horiz_align == GLTextPos::CENTER) {
+		x -= strsize / 2.0f;
+	}
+	if(vert_align == GLTextPos::ABOVE) {
+		if(horiz_align == GLTextPos::CENTER && point) {
+			y += 2 * font->pointSize;
+		}
+	}
+	if(vert_align == GLTextPos::BELOW) {
+		y -= height;
+		if(horiz_align == GLTextPos::CENTER && point) {
+			y -= 2 * font->pointSize;
+		}
+	}
+	if(vert_align == GLTextPos::CENTER) {
+		y -= height / 2.0f;
+	}
+
+	int char_per_line = font->imageWidth / font->cellWidth;
+	float texh = (float)font->fontHeight / (float)font->imageHeight;
+
+	for(int i=0; i<strlen(str); i++) {
+		int c = (int)(str[i]);
+
+		float charwidth = font->charWidth[c] * scalex;
+
+		glm::vec3 p0(x, y, 0.0f);   					 // BL
+		glm::vec3 p1(x + charwidth, y, 0.0f);    		 // BR
+		glm::vec3 p2(x + charwidth, y + height, 0.0f);   // TR
+		glm::vec3 p3(x, y + height, 0.0f); 				 // TL
+
+		int pixleft = font->cellWidth * ((c  - font->startChar) % char_per_line);
+		int pixtop = font->cellHeight * ((c  - font->startChar) / char_per_line);
+		float texleft = (float)pixleft / (float)font->imageWidth;
+		float textop = ((float)pixtop / (float)font->imageHeight);
+		float texw = (float)font->charWidth[c] / (float)font->imageWidth;
+
+		glm::vec2 t0(texleft, textop+texh);      // BL
+		glm::vec2 t1(texleft+texw, textop+texh); // BR
+		glm::vec2 t2(texleft+texw, textop);      // TR
+		glm::vec2 t3(texleft, textop);           // TL
+
+		GLBillboardQuad& quad = quad3DList.emplace_back();
+
+		// triangle 1
+		memcpy(quad.tri1[0].pos, glm::value_ptr(p0), 3 * sizeof(float));
+		memcpy(quad.tri1[1].pos, glm::value_ptr(p1), 3 * sizeof(float));
+		memcpy(quad.tri1[2].pos, glm::value_ptr(p2), 3 * sizeof(float));
+
+		memcpy(quad.tri1[0].center, glm::value_ptr(pos), 3 * sizeof(float));
+		memcpy(quad.tri1[1].center, glm::value_ptr(pos), 3 * sizeof(float));
+		memcpy(quad.tri1[2].center, glm::value_ptr(pos), 3 * sizeof(float));
+
+		memcpy(quad.tri1[0].color, glm::value_ptr(color), 3 * sizeof(float));
+		memcpy(quad.tri1[1].color, glm::value_ptr(color), 3 * sizeof(float));
+		memcpy(quad.tri1[2].color, glm::value_ptr(color), 3 * sizeof(float));
+
+		memcpy(quad.tri1[0].tex, glm::value_ptr(t0), 2 * sizeof(float));
+		memcpy(quad.tri1[1].tex, glm::value_ptr(t1), 2 * sizeof(float));
+		memcpy(quad.tri1[2].tex, glm::value_ptr(t2), 2 * sizeof(float));
+
+		// triangle 2
+		memcpy(quad.tri2[0].pos, glm::value_ptr(p0), 3 * sizeof(float));
+		memcpy(quad.tri2[1].pos, glm::value_ptr(p2), 3 * sizeof(float));
+		memcpy(quad.tri2[2].pos, glm::value_ptr(p3), 3 * sizeof(float));
+
+		memcpy(quad.tri2[0].center, glm::value_ptr(pos), 3 * sizeof(float));
+		memcpy(quad.tri2[1].center, glm::value_ptr(pos), 3 * sizeof(float));
+		memcpy(quad.tri2[2].center, glm::value_ptr(pos), 3 * sizeof(float));
+
+		memcpy(quad.tri2[0].color, glm::value_ptr(color), 3 * sizeof(float));
+		memcpy(quad.tri2[1].color, glm::value_ptr(color), 3 * sizeof(float));
+		memcpy(quad.tri2[2].color, glm::value_ptr(color), 3 * sizeof(float));
+
+		memcpy(quad.tri2[0].tex, glm::value_ptr(t0), 2 * sizeof(float));
+		memcpy(quad.tri2[1].tex, glm::value_ptr(t2), 2 * sizeof(float));
+		memcpy(quad.tri2[2].tex, glm::value_ptr(t3), 2 * sizeof(float));
+
+		x += charwidth;
+	}
+
+	if(point) {
+
+		glm::vec3 p0(-font->pointSize, -font->pointSize, 0.0f);   // BL
+		glm::vec3 p1(+font->pointSize, -font->pointSize, 0.0f);   // BR
+		glm::vec3 p2(+font->pointSize, +font->pointSize, 0.0f);   // TR
+		glm::vec3 p3(-font->pointSize, +font->pointSize, 0.0f); 	// TL
+
+		glm::vec2 t0(0.0f, 0.0f); // BL
+		glm::vec2 t1(1.0f, 0.0f); // BR
+		glm::vec2 t2(1.0f, 1.0f); // TR
+		glm::vec2 t3(0.0f, 1.0f); // TL
+
+		GLBillboardQuad& quad = pointList.emplace_back();
+
+		// quad - 2 triangles
+		memcpy(quad.tri1[0].pos, glm::value_ptr(p0), 3 * sizeof(float));
+		memcpy(quad.tri1[1].pos, glm::value_ptr(p1), 3 * sizeof(float));
+		memcpy(quad.tri1[2].pos, glm::value_ptr(p2), 3 * sizeof(float));
+
+		memcpy(quad.tri1[0].center, glm::value_ptr(pos), 3 * sizeof(float));
+		memcpy(quad.tri1[1].center, glm::value_ptr(pos), 3 * sizeof(float));
+		memcpy(quad.tri1[2].center, glm::value_ptr(pos), 3 * sizeof(float));
+
+		memcpy(quad.tri1[0].color, glm::value_ptr(color), 3 * sizeof(float));
+		memcpy(quad.tri1[1].color, glm::value_ptr(color), 3 * sizeof(float));
+		memcpy(quad.tri1[2].color, glm::value_ptr(color), 3 * sizeof(float));
+
+		memcpy(quad.tri1[0].tex, glm::value_ptr(t0), 2 * sizeof(float));
+		memcpy(quad.tri1[1].tex, glm::value_ptr(t1), 2 * sizeof(float));
+		memcpy(quad.tri1[2].tex, glm::value_ptr(t2), 2 * sizeof(float));
+
+		memcpy(quad.tri2[0].pos, glm::value_ptr(p0), 3 * sizeof(float));
+		memcpy(quad.tri2[1].pos, glm::value_ptr(p2), 3 * sizeof(float));
+		memcpy(quad.tri2[2].pos, glm::value_ptr(p3), 3 * sizeof(float));
+
+		memcpy(quad.tri2[0].center, glm::value_ptr(pos), 3 * sizeof(float));
+		memcpy(quad.tri2[1].center, glm::value_ptr(pos), 3 * sizeof(float));
+		memcpy(quad.tri2[2].center, glm::value_ptr(pos), 3 * sizeof(float));
+
+		memcpy(quad.tri2[0].color, glm::value_ptr(color), 3 * sizeof(float));
+		memcpy(quad.tri2[1].color, glm::value_ptr(color), 3 * sizeof(float));
+		memcpy(quad.tri2[2].color, glm::value_ptr(color), 3 * sizeof(float));
+
+		memcpy(quad.tri2[0].tex, glm::value_ptr(t0), 2 * sizeof(float));
+		memcpy(quad.tri2[1].tex, glm::value_ptr(t2), 2 * sizeof(float));
+		memcpy(quad.tri2[2].tex, glm::value_ptr(t3), 2 * sizeof(float));
+
+		pointsChanged = true;
+	}
+}
+//---------------------------------------------------------------------------
+
+void __fastcall GLText::CreatePointArrays()
+{
+	/// Upload point triangles to the vertex buffer
+	/// Only new points and changed colors are copied to the buffer
+	/// Text is written to the stream buffer each frame so has no buffer of its own
+
+	// point buffer is GL_DYNAMIC_DRAW to allow changes to color for highlighting
+	bool replaced = pointBuffer.Upload(pointList.data(), pointList.size());
+	if(replaced) pointArray.Attach(pointBuffer.buffer);
+}
+//---------------------------------------------------------------------------
+
+void __fastcall GLText::DrawStream(GLStreamBuffer& stream, std::vector<GLBillboardQuad>& quadlist, GLStateCache& state)
+{
+	/// Write text triangles to the stream buffer and draw them
+	/// The stream buffer object is created on first write so is attached here
+
+	int offset = stream.Write(quadlist.data(), quadlist.size() * sizeof(GLBillboardQuad), sizeof(GLBillboardVertex));
+	if(offset < 0) return;
+
+	if(streamArray.Buffer() != stream.buffer) {
+		streamArray.Attach(stream.buffer);
+		state.InvalidateBindings();
+	}
+	streamArray.Bind(state);
+
+	// offset is aligned to vertex size so can be used as first vertex
+	glDrawArrays(GL_TRIANGLES, offset / sizeof(GLBillboardVertex), quadlist.size() * 6);
+}
+//---------------------------------------------------------------------------
+
+void __fastcall GLText::Render2D(int width, int height, GLStreamBuffer& stream, GLStateCache& state)
+{
+	/// Render 2D text
+	/// width and height are the size of the view drawn to
+	/// Text triangles are written to the stream buffer every frame
+
+	if(quad2DList.size() > 0) {
+
+		state.Enable(GL_CULL_FACE, false);
+		state.Enable(GL_DEPTH_TEST, false);
+
+		state.Enable(GL_BLEND, true);
+		state.BlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+		// orthogonal projection
+		const GLfloat left = 0.0f;
+		const GLfloat right = 1.0f;
+		const GLfloat bottom = 0.0f;
+		const GLfloat top = 1.0f;
+		const GLfloat zNear = -1.0f;
+		const GLfloat zFar = 1.0f;
+
+		const GLfloat p[16] = {
+			(2.0f / (right - left)), 0.0f, 0.0f, 0.0f,
+			0.0f, (2.0f / (top - bottom)), 0.0f, 0.0f,
+			0.0f, 0.0f, (-2.0f / (zFar - zNear)), 0.0f,
+
+			-((right + left) / (right - left)),
+			-((top + bottom) / (top - bottom)),
+			-((zFar + zNear) / (zFar - zNear)),
+			1.0f,
+		};
+
+		state.UseProgram(font->billboardShader);
+
+		// projection matrix
+		glUniformMatrix4fv(font->pvmLoc, 1, GL_FALSE, p);
+
+		// scale factor to correct for distortion from screen size
+		glUniform1f(font->xscaleLoc, (float)height/(float)width);
+
+		state.BindTexture(0, font->fontTexture.textureID);
+
+		DrawStream(stream, quad2DList, state);
+	}
+
+}
+//---------------------------------------------------------------------------
+
+void __fastcall GLText::Render3D(int width, int height, glm::mat4& pvm, bool depthtext, GLStreamBuffer& stream, GLStateCache& state)
+{
+	/// Render 3D text
+	/// width and height are the size of the view drawn to
+	/// Uses projection matrix (pvm) from camera
+	/// Text triangles are written to the stream buffer every frame
+
+	state.Enable(GL_CULL_FACE, false);
+	state.Enable(GL_DEPTH_TEST, depthtext);
+
+	state.Enable(GL_BLEND, true);
+	state.BlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+	if(pointsChanged) {
+		CreatePointArrays();
+		pointsChanged = false;
+		state.InvalidateBindings();
+	}
+
+	if(quad3DList.size() > 0 || pointList.size() > 0) {
+
+		state.UseProgram(font->billboardShader);
+
+		// projection matrix
+		glUniformMatrix4fv(font->pvmLoc, 1, GL_FALSE, glm::value_ptr(pvm));
+
+		// scale factor to correct for distortion from screen size
+		glUniform1f(font->xscaleLoc, (float)height/(float)width);
+	}
+
+	if(quad3DList.size() > 0) {
+
+		// draw text triangles
+		state.BindTexture(0, font->fontTexture.textureID);
+
+		DrawStream(stream, quad3DList, state);
+	}
+
+	if(pointBuffer.Count() > 0 && pointArray.Ready()) {
+
+        // draw dots
+		state.BindTexture(0, font->pointTexture.textureID);
+		pointArray.Bind(state);
+
+		glDrawArrays(GL_TRIANGLES, 0, pointBuffer.Count() * 6);
+	}
+
+}
+//---------------------------------------------------------------------------
+
+static bool RaySphere(glm::vec3& rayorigin, glm::vec3& raydir, glm::vec3& sphere, float radius, float& mindist)
+{
+	/// Find intersection between ray and sphere
+	/// Returns true if intersection found less than mindist away
+
+   float a, b, c;
+   float bb4ac;
+
+   a = raydir.x * raydir.x + raydir.y * raydir.y + raydir.z * raydir.z;
+   b = 2 * (raydir.x * (rayorigin.x - sphere.x) + raydir.y * (rayorigin.y - sphere.y) + raydir.z * (rayorigin.z - sphere.z));
+   c = sphere.x * sphere.x + sphere.y * sphere.y + sphere.z * sphere.z;
+   c += rayorigin.x * rayorigin.x + rayorigin.y * rayorigin.y + rayorigin.z * rayorigin.z;
+   c -= 2 * (sphere.x * rayorigin.x + sphere.y * rayorigin.y + sphere.z * rayorigin.z);
+   c -= radius * radius;
+   bb4ac = b * b - 4 * a * c;
+
+   if (fabs(a) < 1e-20 || bb4ac < 0) {
+	  return false;
+   }
+
+   float mu1 = (-b + sqrt(bb4ac)) / (2 * a);
+   float mu2 = (-b - sqrt(bb4ac)) / (2 * a);
+
+   float dist;
+   if(mu1 < mu2) dist = mu1;
+   else dist = mu2;
+
+   if(dist < mindist) {
+	   mindist = dist;
+	   return true;
+   }
+
+   return false;
+}
+//---------------------------------------------------------------------------
+
+int __fastcall GLText::PickPoint(glm::vec3& raystart, glm::vec3& raydir, float& mindist)
+{
+	/// Finds point intersected by ray and closer than mindist
+
+	int minp = -1;
+	for(int p=0; p<pointList.size(); p++) {
+		GLBillboardQuad& quad = pointList[p];
+		glm::vec3 circle(quad.tri1[0].center[0], quad.tri1[0].center[1], quad.tri1[0].center[2]);
+		if(RaySphere(raystart, raydir, circle, font->pointSize, mindist)) {
+			minp = p;
+		}
+	}
+	return minp;
+}
+//---------------------------------------------------------------------------
+
+void __fastcall GLText::SetPointColor(int point, glm::vec3& color)
+{
+	/// Sets the color of a point
+
+	if(point < 0 || point >= pointList.size()) return;
+
+	GLBillboardQuad& quad = pointList[point];
+	memcpy(quad.tri1[0].color, glm::value_ptr(color), sizeof(glm::vec3));
+	memcpy(quad.tri1[1].color, glm::value_ptr(color), sizeof(glm::vec3));
+	memcpy(quad.tri1[2].color, glm::value_ptr(color), sizeof(glm::vec3));
+	memcpy(quad.tri2[0].color, glm::value_ptr(color), sizeof(glm::vec3));
+	memcpy(quad.tri2[1].color, glm::value_ptr(color), sizeof(glm::vec3));
+	memcpy(quad.tri2[2].color, glm::value_ptr(color), sizeof(glm::vec3));
+
+	// uploaded with other edits at next render
+	pointBuffer.MarkDirty(point, 1);
+	pointsChanged = true;
+}
+//---------------------------------------------------------------------------
+
+glm::vec3 __fastcall GLText::GetPointColor(int point)
+{
+	/// Gets the color of a point
+
+	if(point < 0 || point >= pointList.size()) return glm::vec3(0.0f, 0.0f, 0.0f);
+
+	glm::vec3 color;
+	GLBillboardQuad& quad = pointList[point];
+	memcpy(glm::value_ptr(color), quad.tri1[0].color, sizeof(glm::vec3));
+	return color;
+}
+//---------------------------------------------------------------------------
+//---------------------------------------------------------------------------
+//---------------------------------------------------------------------------
+
+GLVertexBuffer::GLVertexBuffer(int elementsize, GLenum bufferusage)
+{
+	/// Constructor
+	/// elementsize is the size in bytes of one element (usually a triangle)
+	/// bufferusage is passed to glBufferData
+
+	buffer = 0;
+	generation = 0;
+	elementSize = elementsize;
+	usage = bufferusage;
+	capacity = 0;
+	clean = 0;
+	pendingBuffer = 0;
+	pendingCapacity = 0;
+	pendingCount = 0;
+	pendingStale = false;
+}
+//---------------------------------------------------------------------------
+
+GLVertexBuffer::~GLVertexBuffer()
+{
+	/// Destructor deletes buffer
+
+	Release();
+}
+//---------------------------------------------------------------------------
+
+void __fastcall GLVertexBuffer::Release()
+{
+	/// Delete buffer
+	/// Waits for an upload on the loader thread to finish first
+
+	if(pendingJob) {
+		GLUploadThread::Wait(*pendingJob);
+		if(pendingBuffer != buffer) glDeleteBuffers(1, &pendingBuffer);
+		pendingJob.reset();
 	}
 
-	if(flip) {
-		// texture is flipped
-		textureBMP->FlipVertical();
+	if(buffer > 0) {
+		glDeleteBuffers(1, &buffer);
+		buffer = 0;
 	}
+	capacity = 0;
+	clean = 0;
+	dirty.clear();
+}
+//---------------------------------------------------------------------------
 
-	int bpp = data.BytesPerPixel;
+void __fastcall GLVertexBuffer::MarkDirty(int first, int count)
+{
+	/// Record that elements first..first+count-1 have changed
+	/// Changes are uploaded by the next call to Upload
+	/// Elements not uploaded yet are sent when appended so are not recorded
 
-	//unsigned int { None, RGB, RGBA, BGR, BGRA, RGBA16, BGR_565, BGRA4, BGR4, BGR5_A1, BGR5, BGR10_A2, RGB10_A2, L, LA, LA4, L16, A, R16F, RG16F, RGBA16F, R32F, RG32F, RGBA32F };
-	Fmx::Types::TPixelFormat bmpformat = data.PixelFormat;
+	// elements being uploaded by the loader thread have been copied already
+	int uploaded = clean;
+	if(pendingJob) uploaded = pendingCount;
 
-	// GL_ALPHA, GL_ALPHA4, GL_ALPHA8, GL_ALPHA12, GL_ALPHA16, GL_COMPRESSED_ALPHA, GL_COMPRESSED_LUMINANCE, GL_COMPRESSED_LUMINANCE_ALPHA,
-	// GL_COMPRESSED_INTENSITY, GL_COMPRESSED_RGB, GL_COMPRESSED_RGBA, GL_DEPTH_COMPONENT, GL_DEPTH_COMPONENT16, GL_DEPTH_COMPONENT24, GL_DEPTH_COMPONENT32,
-	// GL_LUMINANCE, GL_LUMINANCE4, GL_LUMINANCE8, GL_LUMINANCE12, GL_LUMINANCE16, GL_LUMINANCE_ALPHA, GL_LUMINANCE4_ALPHA4, GL_LUMINANCE6_ALPHA2,
-	// GL_LUMINANCE8_ALPHA8, GL_LUMINANCE12_ALPHA4, GL_LUMINANCE12_ALPHA12, GL_LUMINANCE16_ALPHA16, GL_INTENSITY, GL_INTENSITY4, GL_INTENSITY8,
-	// GL_INTENSITY12, GL_INTENSITY16, GL_R3_G3_B2, GL_RGB, GL_RGB4, GL_RGB5, GL_RGB8, GL_RGB10, GL_RGB12, GL_RGB16, GL_RGBA, GL_RGBA2, GL_RGBA4,
-	//  GL_RGB5_A1, GL_RGBA8, GL_RGB10_A2, GL_RGBA12, GL_RGBA16, GL_SLUMINANCE, GL_SLUMINANCE8, GL_SLUMINANCE_ALPHA, GL_SLUMINANCE8_ALPHA8, GL_SRGB,
-	// GL_SRGB8, GL_SRGB_ALPHA, or GL_SRGB8_ALPHA8.
-	GLenum glformat;
+	if(first >= uploaded || count <= 0) return;
+	dirty.emplace_back(first, std::min(count, uploaded - first));
+}
+//---------------------------------------------------------------------------
 
+void __fastcall GLVertexBuffer::FlushDirty(const void* data)
+{
+	/// Upload recorded changes
+	/// Ranges are sorted and ranges that touch or are separated by a small gap are
+	/// merged so many small edits become a few large uploads
 
-	unsigned char* buffer = new unsigned char[numpix * bpp];
-	memcpy(buffer, data.Data, numpix * bpp);
+	if(dirty.size() == 0) return;
 
-	if(bmpformat == TPixelFormat::RGB) glformat = GL_RGB;
-	else if(bmpformat == TPixelFormat::RGBA) glformat = GL_RGBA;
-	else if(bmpformat == TPixelFormat::BGR) {
-		glformat = GL_RGB;
-		for(int p=0; p<numpix; p++) {
-			unsigned char r = buffer[p*3];
-			buffer[p*3] = buffer[p*3+2];
-			buffer[p*3+2] = r;
+	std::sort(dirty.begin(), dirty.end());
+
+	// re-sending a few unchanged elements is cheaper than another call
+	const int maxgap = std::max(1, 4096 / elementSize);
+	const char* bytes = (const char*)data;
+
+	glBindBuffer(GL_ARRAY_BUFFER, buffer);
+
+	int first = dirty[0].first;
+	int end = first + dirty[0].second;
+	for(int d=1; d<=dirty.size(); d++) {
+		if(d < dirty.size() && dirty[d].first <= end + maxgap) {
+			end = std::max(end, dirty[d].first + dirty[d].second);
+			continue;
+		}
+
+		end = std::min(end, clean);
+		if(end > first) {
+			glBufferSubData(GL_ARRAY_BUFFER, (GLintptr)first * elementSize, (GLsizeiptr)(end - first) * elementSize, bytes + (size_t)first * elementSize);
+		}
+
+		if(d < dirty.size()) {
+			first = dirty[d].first;
+			end = first + dirty[d].second;
 		}
 	}
-	else if(bmpformat == TPixelFormat::BGRA) {
-		glformat = GL_RGBA;
-		for(int p=0; p<numpix; p++) {
-			unsigned char r = buffer[p*4];
-			buffer[p*4] = buffer[p*4+2];
-			buffer[p*4+2] = r;
+
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	dirty.clear();
+}
+//---------------------------------------------------------------------------
+
+void __fastcall GLVertexBuffer::Invalidate()
+{
+	/// Mark all elements as changed so the next Upload sends all of them
+
+	clean = 0;
+	pendingStale = true;
+}
+//---------------------------------------------------------------------------
+
+bool __fastcall GLVertexBuffer::FinishAsync()
+{
+	/// Take the result of an upload done on the loader thread
+	/// Returns without waiting if the upload is not complete
+	/// Returns true if the buffer object was replaced
+
+	if(!pendingJob) return false;
+	if(!GLUploadThread::IsComplete(*pendingJob)) return false;
+	pendingJob.reset();
+
+	bool replaced = false;
+	if(pendingBuffer != buffer) {
+		if(buffer > 0) glDeleteBuffers(1, &buffer);
+		buffer = pendingBuffer;
+		generation = UniqueId();
+		capacity = pendingCapacity;
+		replaced = true;
+	}
+
+	// data was replaced while uploading so send it all again
+	if(pendingStale) clean = 0;
+	else clean = pendingCount;
+
+	return replaced;
+}
+//---------------------------------------------------------------------------
+
+void __fastcall GLVertexBuffer::UploadAsync(const void* data, int count, GLUploadThread* loader)
+{
+	/// Copy appended elements and post a job to the loader thread to upload them
+	/// The buffer is grown on the loader thread if needed
+
+	int newcapacity = capacity;
+	if(count > capacity) newcapacity = std::max(count, std::max(capacity * 2, 256));
+
+	unsigned int newbuffer = buffer;
+	if(newcapacity != capacity || buffer == 0) glGenBuffers(1, &newbuffer);
+
+	// copy of appended data because the caller may change it while uploading
+	const char* bytes = (const char*)data;
+	std::shared_ptr<std::vector<char>> appended = std::make_shared<std::vector<char>>(bytes + (size_t)clean * elementSize, bytes + (size_t)count * elementSize);
+
+	unsigned int oldbuffer = buffer;
+	int oldcount = clean;
+	int elementsize = elementSize;
+	GLenum bufferusage = usage;
+
+	// loader waits for commands already sent to the old buffer by this context
+	GLsync ready = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	glFlush();
+
+	pendingJob = loader->Post([=]() {
+		glWaitSync(ready, 0, GL_TIMEOUT_IGNORED);
+		glDeleteSync(ready);
+
+		if(newbuffer != oldbuffer) {
+			glBindBuffer(GL_COPY_WRITE_BUFFER, newbuffer);
+			glBufferData(GL_COPY_WRITE_BUFFER, (GLsizeiptr)newcapacity * elementsize, NULL, bufferusage);
+			if(oldcount > 0) {
+				glBindBuffer(GL_COPY_READ_BUFFER, oldbuffer);
+				glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, (GLsizeiptr)oldcount * elementsize);
+				glBindBuffer(GL_COPY_READ_BUFFER, 0);
+			}
+		}
+		else {
+			glBindBuffer(GL_COPY_WRITE_BUFFER, newbuffer);
+		}
+		glBufferSubData(GL_COPY_WRITE_BUFFER, (GLintptr)oldcount * elementsize, appended->size(), appended->data());
+		glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+	});
+
+	pendingBuffer = newbuffer;
+	pendingCapacity = newcapacity;
+	pendingCount = count;
+	pendingStale = false;
+}
+//---------------------------------------------------------------------------
+
+bool __fastcall GLVertexBuffer::Upload(const void* data, int count, GLUploadThread* loader, GLUploadScheduler* scheduler)
+{
+	/// Make buffer match the first count elements of data
+	/// Elements already uploaded are only sent again if marked by MarkDirty
+	/// or if Invalidate was called
+	/// When the buffer is too small a larger one is created and the uploaded elements
+	/// are copied on the GPU with glCopyBufferSubData
+	/// If loader is set, large appends are uploaded on the loader thread and
+	/// Count does not include them until they complete
+	/// If scheduler is set, only the appended elements that fit in the frame budget are
+	/// uploaded and Count is less than count until the rest are sent in later frames
+	/// Returns true if the buffer object was replaced so vertex arrays must be updated
+
+	bool replaced = false;
+
+	// old buffer must not change while loader thread copies from it
+	if(pendingJob) {
+		if(!GLUploadThread::IsComplete(*pendingJob)) return false;
+		replaced = FinishAsync();
+	}
+
+	if(count < clean) clean = 0;
+	if(clean == 0) dirty.clear();
+
+	if(count == 0) {
+		replaced = replaced || (buffer > 0);
+		Release();
+		return replaced;
+	}
+
+	// large appends go to the loader thread
+	// edits are kept and uploaded when it completes
+	const int asyncbytes = 1024 * 1024;
+	if(loader != nullptr && (long long)(count - clean) * elementSize >= asyncbytes) {
+		UploadAsync(data, count, loader);
+		return replaced;
+	}
+
+	// grow geometrically, or shrink if a reset left most of the buffer unused
+	if(count > capacity || (clean == 0 && count < capacity / 4)) {
+		int newcapacity = count;
+		if(count > capacity) newcapacity = std::max(count, std::max(capacity * 2, 256));
+
+		unsigned int newbuffer;
+		glGenBuffers(1, &newbuffer);
+		glBindBuffer(GL_COPY_WRITE_BUFFER, newbuffer);
+		glBufferData(GL_COPY_WRITE_BUFFER, (GLsizeiptr)newcapacity * elementSize, NULL, usage);
+
+		if(clean > 0) {
+			glBindBuffer(GL_COPY_READ_BUFFER, buffer);
+			glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, (GLsizeiptr)clean * elementSize);
+			glBindBuffer(GL_COPY_READ_BUFFER, 0);
+		}
+		glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+		if(buffer > 0) glDeleteBuffers(1, &buffer);
+		buffer = newbuffer;
+		generation = UniqueId();
+		capacity = newcapacity;
+		replaced = true;
+	}
+
+	// edited elements in the part already uploaded
+	FlushDirty(data);
+
+	// upload appended elements only
+	int appended = count - clean;
+	if(scheduler != nullptr) appended = scheduler->Take((long long)appended * elementSize, elementSize) / elementSize;
+
+	if(appended > 0) {
+		const char* bytes = (const char*)data;
+		glBindBuffer(GL_ARRAY_BUFFER, buffer);
+		glBufferSubData(GL_ARRAY_BUFFER, (GLintptr)clean * elementSize, (GLsizeiptr)appended * elementSize, bytes + (size_t)clean * elementSize);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		clean += appended;
+	}
+
+	return replaced;
+}
+//---------------------------------------------------------------------------
+//---------------------------------------------------------------------------
+
+GLStreamBuffer::GLStreamBuffer(int size)
+{
+	/// Constructor
+	/// size is the initial size of the ring in bytes
+	/// The buffer is created on first write so a context is not needed yet
+
+	buffer = 0;
+	bufferSize = size;
+	head = 0;
+}
+//---------------------------------------------------------------------------
+
+GLStreamBuffer::~GLStreamBuffer()
+{
+	/// Destructor deletes buffer and fences
+
+	Release();
+}
+//---------------------------------------------------------------------------
+
+void __fastcall GLStreamBuffer::Release()
+{
+	/// Delete buffer and fences
+
+	ReleaseRegions();
+
+	if(buffer > 0) {
+		glDeleteBuffers(1, &buffer);
+		buffer = 0;
+	}
+	head = 0;
+}
+//---------------------------------------------------------------------------
+
+void __fastcall GLStreamBuffer::ReleaseRegions()
+{
+	/// Forget all regions and delete their fences
+	/// The regions of a frame share one fence, so it is deleted once
+
+	GLsync last = 0;
+	for(GLStreamRegion& region : regions) {
+		if(region.fence != 0 && region.fence != last) glDeleteSync(region.fence);
+		last = region.fence;
+	}
+	regions.clear();
+}
+//---------------------------------------------------------------------------
+
+void __fastcall GLStreamBuffer::Orphan()
+{
+	/// Give the buffer new storage so pending draws keep the old storage
+	/// Used when the ring is full of data the GPU has not finished with, or to
+	/// resize it, the buffer keeps its name so vertex arrays stay attached
+
+	ReleaseRegions();
+
+	glBindBuffer(GL_ARRAY_BUFFER, buffer);
+	glBufferData(GL_ARRAY_BUFFER, bufferSize, NULL, GL_STREAM_DRAW);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	head = 0;
+}
+//---------------------------------------------------------------------------
+
+bool __fastcall GLStreamBuffer::IsFree(int start, int end)
+{
+	/// Check that no region in use by the GPU overlaps start..end
+	/// Regions whose fence has signalled are released
+	/// Returns false if the range is still in use by this or a previous frame
+
+	while(regions.size() > 0) {
+		bool overlap = false;
+		for(GLStreamRegion& region : regions) {
+			if(region.start < end && start < region.end) {
+				overlap = true;
+				break;
+			}
 		}
+		if(!overlap) return true;
+
+		// oldest region must complete first - fences signal in order
+		if(!ReleaseOldest()) return false;
+	}
+	return true;
+}
+//---------------------------------------------------------------------------
+
+bool __fastcall GLStreamBuffer::ReleaseOldest()
+{
+	/// Release the oldest frame's regions if its fence has signalled
+	/// Does not wait for the GPU
+	/// Returns false if the regions are still in use or were written this frame
+
+	if(regions.size() == 0) return false;
+
+	GLsync fence = regions.front().fence;
+	if(fence == 0) return false;
+
+	GLenum result = glClientWaitSync(fence, 0, 0);
+	if(result != GL_ALREADY_SIGNALED && result != GL_CONDITION_SATISFIED) return false;
+
+	glDeleteSync(fence);
+	while(regions.size() > 0 && regions.front().fence == fence) {
+		regions.pop_front();
+	}
+	return true;
+}
+//---------------------------------------------------------------------------
+
+int __fastcall GLStreamBuffer::Write(const void* data, int size, int alignment)
+{
+	/// Copy data to the ring buffer without synchronising with the GPU
+	/// alignment is the vertex size so the offset can be used as first vertex
+	/// Falls back to orphaning the buffer if the GPU still uses the space
+	/// Returns the byte offset of the data in the buffer or -1 on error
+
+	if(size <= 0) return -1;
+
+	if(buffer == 0 || size > bufferSize) {
+		// grown in place, a new name could be the one just deleted and vertex
+		// arrays would not see the change
+		if(size > bufferSize) bufferSize = std::max(bufferSize * 2, size * 2);
+		if(buffer == 0) glGenBuffers(1, &buffer);
+		Orphan();
+	}
+
+	int offset = ((head + alignment - 1) / alignment) * alignment;
+	if(offset + size > bufferSize) offset = 0;   // wrap
+
+	if(!IsFree(offset, offset + size)) {
+		Orphan();
+		offset = 0;
+	}
+
+	glBindBuffer(GL_ARRAY_BUFFER, buffer);
+	void* ptr = glMapBufferRange(GL_ARRAY_BUFFER, offset, size, GL_MAP_WRITE_BIT | GL_MAP_UNSYNCHRONIZED_BIT | GL_MAP_INVALIDATE_RANGE_BIT);
+	if(ptr != nullptr) {
+		memcpy(ptr, data, size);
+		glUnmapBuffer(GL_ARRAY_BUFFER);
 	}
 	else {
-		ShowMessage("Unknown texture file format !!!");
-		textureID = 0;
-		textureBMP->Unmap(data);
-		delete textureBMP;
-		delete[] buffer;
-		return;
+		glBufferSubData(GL_ARRAY_BUFFER, offset, size, data);
 	}
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
 
-	glGenTextures(1, &textureID); // Create The Texture
+	// region is fenced at end of frame
+	GLStreamRegion& region = regions.emplace_back();
+	region.start = offset;
+	region.end = offset + size;
+	region.fence = 0;
 
-	// Typical Texture Generation Using Data From The Bitmap
-	glBindTexture(GL_TEXTURE_2D, textureID);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glTexImage2D(GL_TEXTURE_2D, 0, glformat, textureBMP->Width, textureBMP->Height, 0, glformat, GL_UNSIGNED_BYTE, buffer);
-    glGenerateMipmap(GL_TEXTURE_2D);
+	head = offset + size;
+	return offset;
+}
+//---------------------------------------------------------------------------
 
-	GLenum error = glGetError();
-	if(error != GL_NO_ERROR) {
-		ShowMessage("Error creating texture !!!");
-		textureID = 0;
+void __fastcall GLStreamBuffer::EndFrame()
+{
+	/// Insert a fence after the draws that read data written this frame
+
+	// forget regions the GPU has finished with
+	while(ReleaseOldest());
+
+	bool pending = false;
+	for(GLStreamRegion& region : regions) {
+		if(region.fence == 0) pending = true;
+	}
+	if(!pending) return;
+
+	GLsync fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	for(GLStreamRegion& region : regions) {
+		if(region.fence == 0) region.fence = fence;
+	}
+}
+//---------------------------------------------------------------------------
+//---------------------------------------------------------------------------
+
+GLUploadThread::GLUploadThread(GLFWwindow* share)
+{
+	/// Constructor
+	/// Creates a hidden window with a context shared with share
+	/// Must be called on the main thread, as all GLFW window functions
+	/// The window's context is then made current on the loader thread
+	/// If share is nullptr the thread has no context and runs CPU work only
+
+	stop = false;
+	context = nullptr;
+
+	if(share != nullptr) {
+		glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+		context = glfwCreateWindow(1, 1, "Loader", NULL, share);
+		glfwWindowHint(GLFW_VISIBLE, GLFW_TRUE);
+
+		if(context == nullptr) {
+			ShowMessage("Loader context creation failed !!!");
+			return;
+		}
+	}
+
+	thread = std::thread(&GLUploadThread::Run, this);
+}
+//---------------------------------------------------------------------------
+
+GLUploadThread::~GLUploadThread()
+{
+	/// Destructor
+	/// Completes posted jobs then stops the thread and deletes the context
+
+	if(thread.joinable()) {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stop = true;
+		}
+		signal.notify_one();
+		thread.join();
+	}
+
+	if(context != nullptr) {
+		glfwDestroyWindow(context);
+		context = nullptr;
+	}
+}
+//---------------------------------------------------------------------------
+
+void __fastcall GLUploadThread::Run()
+{
+	/// Loader thread
+	/// Runs jobs in the order posted with the shared context current
+	/// Each job is followed by a fence so the renderer knows when the GPU has the data
+
+	if(context != nullptr) glfwMakeContextCurrent(context);
+
+	while(true) {
+		std::shared_ptr<GLUploadJob> job;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			signal.wait(lock, [this]() { return stop || jobs.size() > 0; });
+			if(jobs.size() == 0) break;   // stopped and all jobs done
+			job = jobs.front();
+			jobs.pop_front();
+		}
+
+		// a job that throws is finished all the same, so its fence is still set
+		// and nothing waits for it forever, and the exception does not end the thread
+		try {
+			job->work();
+		} catch (...) {
+		}
+		job->work = nullptr;   // release captured data
+
+		// flush so the fence is seen by the render context
+		if(context != nullptr) {
+			job->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+			glFlush();
+		}
+		job->done = true;
+	}
+
+	if(context != nullptr) glfwMakeContextCurrent(NULL);
+}
+//---------------------------------------------------------------------------
+
+std::shared_ptr<GLUploadJob> __fastcall GLUploadThread::Post(std::function<void()> work)
+{
+	/// Queue work to run on the loader thread
+	/// work must only make GL calls for shared objects - buffers, textures and programs
+	/// Returns the job for use with IsComplete and Wait
+
+	std::shared_ptr<GLUploadJob> job = std::make_shared<GLUploadJob>();
+	job->work = work;
+	job->fence = 0;
+	job->done = false;
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		jobs.push_back(job);
 	}
+	signal.notify_one();
 
-	textureBMP->Unmap(data);
-	delete[] buffer;
+	return job;
 }
 //---------------------------------------------------------------------------
 
-GLTexture::GLTexture()
+bool __fastcall GLUploadThread::IsComplete(GLUploadJob& job)
 {
-	/// Constructor
-	changed = true;
-	VAO = 0;
-	VBO = 0;
-    textureID = 0;
+	/// Check if a job has run and the GPU has finished with it
+	/// Never blocks, called from render thread
+	/// Deletes the fence once it has signalled
+
+	if(!job.done) return false;
+	if(job.fence == 0) return true;
+
+	GLenum result = glClientWaitSync(job.fence, 0, 0);
+	if(result != GL_ALREADY_SIGNALED && result != GL_CONDITION_SATISFIED) return false;
+
+	glDeleteSync(job.fence);
+	job.fence = 0;
+	return true;
 }
 //---------------------------------------------------------------------------
 
-GLTexture::~GLTexture()
+void __fastcall GLUploadThread::Wait(GLUploadJob& job)
 {
-	/// Destructor deletes texture
-	if(VAO > 0) {
-		glDeleteVertexArrays(1, &VAO);
-		VAO = 0;
+	/// Block until a job has run and the GPU has finished with it
+	/// Only used when a buffer or texture is deleted with an upload in progress
+
+	while(!job.done) {
+		std::this_thread::yield();
 	}
-	if(VBO > 0) {
-		glDeleteBuffers(1, &VBO);
-		VBO = 0;
+
+	if(job.fence != 0) {
+		glClientWaitSync(job.fence, GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+		glDeleteSync(job.fence);
+		job.fence = 0;
 	}
-	glDeleteTextures(1, &textureID);
 }
 //---------------------------------------------------------------------------
+//---------------------------------------------------------------------------
 
-void __fastcall GLTexture::SetTriangleColor(int trinum, glm::vec3& color)
+GLUploadScheduler::GLUploadScheduler()
 {
-	if(trinum < 0 || trinum >= triangleList.size()) return;
-
-	glBindVertexArray(VAO);
-	glBindBuffer(GL_ARRAY_BUFFER, VBO);
+	/// Constructor
+	/// No budget by default so all uploads are done in the frame they are needed
 
-	GLTextureTriangle& tri = triangleList[trinum];
-	memcpy(tri.vert[0].color, glm::value_ptr(color), sizeof(glm::vec3));
-	memcpy(tri.vert[1].color, glm::value_ptr(color), sizeof(glm::vec3));
-	memcpy(tri.vert[2].color, glm::value_ptr(color), sizeof(glm::vec3));
-	glBufferSubData(GL_ARRAY_BUFFER, trinum * sizeof(GLTextureTriangle), sizeof(GLTextureTriangle), &tri);
+	budgetBytes = 0;
+	budgetTime = 0.0;
+	remainingBytes = 0;
+	granted = false;
 }
 //---------------------------------------------------------------------------
 
-glm::vec3 __fastcall GLTexture::GetTriangleColor(int trinum)
+void __fastcall GLUploadScheduler::SetBudget(int bytes, double milliseconds)
 {
-	if(trinum < 0 || trinum >= triangleList.size()) return glm::vec3(0.0f, 0.0f, 0.0f);
+	/// Set the per-frame upload budget
+	/// 0 for no limit
 
-	glm::vec3 color;
-	GLTextureTriangle& tri = triangleList[trinum];
-	memcpy(glm::value_ptr(color), tri.vert[0].color, sizeof(glm::vec3));
+	budgetBytes = bytes;
+	budgetTime = milliseconds;
+}
+//---------------------------------------------------------------------------
 
-    return color;
+void __fastcall GLUploadScheduler::Queue(float priority, std::function<void()> upload)
+{
+	/// Add an upload to this frame's queue
+	/// Uploads with a higher priority are run first
+
+	GLUploadRequest& request = requests.emplace_back();
+	request.priority = priority;
+	request.upload = upload;
 }
 //---------------------------------------------------------------------------
 
-void __fastcall GLTexture::CreateArrays()
+void __fastcall GLUploadScheduler::Drain()
 {
-	/// Set up vertex data and buffers and configure vertex attributes
-	/// for textured triangles
+	/// Run the queued uploads in priority order
+	/// Every upload is run so edits are always sent, appended data uses Take
+	/// to find how much of the budget is left
 
-	if(VAO > 0) {
-		glDeleteVertexArrays(1, &VAO);
-		VAO = 0;
-	}
-	if(VBO > 0) {
-		glDeleteBuffers(1, &VBO);
-		VBO = 0;
-	}
+	std::stable_sort(requests.begin(), requests.end(), [](const GLUploadRequest& a, const GLUploadRequest& b) {
+		return a.priority > b.priority;
+	});
 
-	glGenVertexArrays(1, &VAO);
-	glBindVertexArray(VAO);
+	remainingBytes = budgetBytes;
+	granted = false;
+	startTime = std::chrono::steady_clock::now();
 
-	// triangle buffer is GL_DYNAMIC_DRAW to allow changes to color for highlighting
-	glGenBuffers(1, &VBO);
-	glBindBuffer(GL_ARRAY_BUFFER, VBO);
-	glBufferData(GL_ARRAY_BUFFER, triangleList.size() * sizeof(GLTextureTriangle), triangleList.data(), GL_DYNAMIC_DRAW);
+	for(GLUploadRequest& request : requests) {
+		request.upload();
+	}
+	requests.clear();
+}
+//---------------------------------------------------------------------------
 
+long long __fastcall GLUploadScheduler::Take(long long bytes, int granularity)
+{
+	/// Reserve budget for an upload of up to bytes
+	/// Returns the number of bytes that can be sent, a multiple of granularity,
+	/// 0 once the budget is spent
+	/// The first upload given anything in a frame, the one with the highest priority,
+	/// gets at least one granule so uploads move on with a budget smaller than one
+	/// With a time budget one upload is given at most timeChunk bytes, as the time
+	/// a send takes is only known once it is done
+
+	if(bytes <= 0) return 0;
+
+	long long allowed = bytes;
+	if(budgetTime > 0.0) {
+		std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - startTime;
+		allowed = elapsed.count() >= budgetTime ? 0 : std::min(allowed, timeChunk);
+	}
+	if(budgetBytes > 0) {
+		allowed = std::min(allowed, std::max(remainingBytes, 0LL));
+	}
+	if(allowed < bytes) allowed -= allowed % granularity;
 
-	// position
-	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(GLTextureVertex), (void*)0);
-	glEnableVertexAttribArray(0);
+	if(allowed == 0 && !granted) allowed = std::min(bytes, (long long)granularity);
+	if(allowed > 0) granted = true;
+	if(budgetBytes > 0) remainingBytes -= allowed;
 
-	// norm
-	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(GLTextureVertex), (void*)(3 * sizeof(float)));
-	glEnableVertexAttribArray(1);
+	return allowed;
+}
+//---------------------------------------------------------------------------
+//---------------------------------------------------------------------------
 
-	// color
-	glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(GLTextureVertex), (void*)(6 * sizeof(float)));
-	glEnableVertexAttribArray(2);
+GLVertexArray::GLVertexArray(int vertexsize)
+{
+	/// Constructor
+	/// vertexsize is the stride between vertices in bytes
 
-	// texture coord
-	glVertexAttribPointer(3, 2, GL_FLOAT, GL_FALSE, sizeof(GLTextureVertex), (void*)(9 * sizeof(float)));
-	glEnableVertexAttribArray(3);
+	vertexSize = vertexsize;
+	VAO = 0;
+	buffer = 0;
+}
+//---------------------------------------------------------------------------
 
-	glBindVertexArray(0);
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
+GLVertexArray::~GLVertexArray()
+{
+	/// Destructor
+	Release();
 }
 //---------------------------------------------------------------------------
 
-void __fastcall GLTexture::Render()
+void __fastcall GLVertexArray::Attribute(int index, int components, int offset)
 {
-	if(changed) {
-		CreateArrays();
-		changed = false;
-	}
+	/// Describe a float vertex attribute
+	/// Must be called before the first Attach
 
-	if(triangleList.size() > 0) {
-		glActiveTexture(GL_TEXTURE0);
-		glBindTexture(GL_TEXTURE_2D, textureID);
-		glBindVertexArray(VAO);
-		glDrawArrays(GL_TRIANGLES, 0, triangleList.size() * 3);
-	}
+	GLVertexAttribute& attrib = attributes.emplace_back();
+	attrib.index = index;
+	attrib.components = components;
+	attrib.offset = offset;
 }
 //---------------------------------------------------------------------------
 
-void __fastcall GLTexture::AddTriangleVT(glm::vec3& p1, glm::vec3& p2, glm::vec3& p3, glm::vec2& t1, glm::vec2& t2, glm::vec2& t3)
+void __fastcall GLVertexArray::Attach(unsigned int vertexbuffer)
 {
-	/// Add triangle colored by texture
-	/// The normal of the vertices is the normal of the triangle (flat shaded)
-	/// p1, p2, p3: position of three vertices
-	/// t1, t2, t3: texture coordinates of three vertices
-	/// texid: index of texture returned by AddTexture
-
-	GLTextureTriangle& tri = triangleList.emplace_back();
+	/// Use vertexbuffer as the source of the vertex attributes
+	/// The vertex array and attribute format are created on first use and kept
+	/// With vertex attrib binding only the buffer binding point changes,
+	/// otherwise the attribute pointers are set again for the new buffer
 
-	memcpy(tri.vert[0].pos, glm::value_ptr(p1), 3 * sizeof(float));
-	memcpy(tri.vert[1].pos, glm::value_ptr(p2), 3 * sizeof(float));
-	memcpy(tri.vert[2].pos, glm::value_ptr(p3), 3 * sizeof(float));
+	bool separate = GLAD_GL_VERSION_4_3 || GLAD_GL_ARB_vertex_attrib_binding;
 
-	glm::vec3 norm = glm::triangleNormal(p1, p2, p3);
-	memcpy(tri.vert[0].norm, glm::value_ptr(norm), 3 * sizeof(float));
-	memcpy(tri.vert[1].norm, glm::value_ptr(norm), 3 * sizeof(float));
-	memcpy(tri.vert[2].norm, glm::value_ptr(norm), 3 * sizeof(float));
+	if(VAO == 0) {
+		glGenVertexArrays(1, &VAO);
+		glBindVertexArray(VAO);
+		for(GLVertexAttribute& attrib : attributes) {
+			if(separate) {
+				glVertexAttribFormat(attrib.index, attrib.components, GL_FLOAT, GL_FALSE, attrib.offset);
+				glVertexAttribBinding(attrib.index, 0);
+			}
+			glEnableVertexAttribArray(attrib.index);
+		}
+	}
+	else {
+		glBindVertexArray(VAO);
+	}
 
-	glm::vec3 color(0.0f, 0.0f, 0.0f);
-	memcpy(tri.vert[0].color, glm::value_ptr(color), 3 * sizeof(float));
-	memcpy(tri.vert[1].color, glm::value_ptr(color), 3 * sizeof(float));
-	memcpy(tri.vert[2].color, glm::value_ptr(color), 3 * sizeof(float));
+	buffer = vertexbuffer;
 
-	memcpy(tri.vert[0].tex, glm::value_ptr(t1), 2 * sizeof(float));
-	memcpy(tri.vert[1].tex, glm::value_ptr(t2), 2 * sizeof(float));
-	memcpy(tri.vert[2].tex, glm::value_ptr(t3), 2 * sizeof(float));
+	if(separate) {
+		glBindVertexBuffer(0, buffer, 0, vertexSize);
+	}
+	else {
+		glBindBuffer(GL_ARRAY_BUFFER, buffer);
+		for(GLVertexAttribute& attrib : attributes) {
+			glVertexAttribPointer(attrib.index, attrib.components, GL_FLOAT, GL_FALSE, vertexSize, (void*)(intptr_t)attrib.offset);
+		}
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+	}
 
-	changed = true;
+	glBindVertexArray(0);
 }
 //---------------------------------------------------------------------------
 
-void __fastcall GLTexture::AddTriangleVNT(glm::vec3& p1, glm::vec3& p2, glm::vec3& p3, glm::vec3& n1, glm::vec3& n2, glm::vec3& n3, glm::vec2& t1, glm::vec2& t2, glm::vec2& t3)
+void __fastcall GLVertexArray::Release()
 {
-	/// Add triangle colored by texture
-	/// p1, p2, p3: position of three vertices
-	/// n1, n2, n3: normal at each vertex
-	/// t1, t2, t3: texture coordinates of three vertices
-	/// texid: index of texture returned by AddTexture
+	/// Delete vertex array
+	/// The attribute format is kept so Attach creates it again
 
-	GLTextureTriangle& tri = triangleList.emplace_back();
+	if(VAO > 0) glDeleteVertexArrays(1, &VAO);
+	VAO = 0;
+	buffer = 0;
+}
+//---------------------------------------------------------------------------
+//---------------------------------------------------------------------------
 
-	memcpy(tri.vert[0].pos, glm::value_ptr(p1), 3 * sizeof(float));
-	memcpy(tri.vert[1].pos, glm::value_ptr(p2), 3 * sizeof(float));
-	memcpy(tri.vert[2].pos, glm::value_ptr(p3), 3 * sizeof(float));
+GLStateCache::GLStateCache()
+{
+	/// Constructor
+	/// All state starts unknown so the first call of each kind is issued
 
-	memcpy(tri.vert[0].norm, glm::value_ptr(n1), 3 * sizeof(float));
-	memcpy(tri.vert[1].norm, glm::value_ptr(n2), 3 * sizeof(float));
-	memcpy(tri.vert[2].norm, glm::value_ptr(n3), 3 * sizeof(float));
+	issued = 0;
+	skipped = 0;
+	lastIssued = 0;
+	lastSkipped = 0;
+	Invalidate();
+}
+//---------------------------------------------------------------------------
 
-	glm::vec3 color(0.0f, 0.0f, 0.0f);
-	memcpy(tri.vert[0].color, glm::value_ptr(color), 3 * sizeof(float));
-	memcpy(tri.vert[1].color, glm::value_ptr(color), 3 * sizeof(float));
-	memcpy(tri.vert[2].color, glm::value_ptr(color), 3 * sizeof(float));
+void __fastcall GLStateCache::Enable(GLenum cap, bool enable)
+{
+	/// glEnable or glDisable if cap is not already in that state
 
-	memcpy(tri.vert[0].tex, glm::value_ptr(t1), 2 * sizeof(float));
-	memcpy(tri.vert[1].tex, glm::value_ptr(t2), 2 * sizeof(float));
-	memcpy(tri.vert[2].tex, glm::value_ptr(t3), 2 * sizeof(float));
+	std::map<GLenum, bool>::iterator it = caps.find(cap);
+	if(it != caps.end() && it->second == enable) {
+		skipped++;
+		return;
+	}
 
-	changed = true;
+	if(enable) glEnable(cap);
+	else glDisable(cap);
+	caps[cap] = enable;
+	issued++;
 }
 //---------------------------------------------------------------------------
 
-int __fastcall GLTexture::PickTriangle(glm::vec3& raystart, glm::vec3& raydir, float& mindist)
+void __fastcall GLStateCache::CullFace(GLenum mode)
 {
-	int tri = -1;
-	for(int i=0; i<triangleList.size(); i++) {
-		if(RayTriangle(raystart, raydir, triangleList[i].vert[0].pos, triangleList[i].vert[1].pos, triangleList[i].vert[2].pos, mindist)) {
-			tri = i;
-		}
+	if(cullMode == mode) {
+		skipped++;
+		return;
 	}
-	return tri;
-}
 
-//---------------------------------------------------------------------------
+	glCullFace(mode);
+	cullMode = mode;
+	issued++;
+}
 //---------------------------------------------------------------------------
 
-static std::string __fastcall getNext(TResourceStream* stream)
+void __fastcall GLStateCache::BlendFunc(GLenum src, GLenum dst)
 {
-	/// Used by GLFont to read csv font data
-
-	std::string str;
-	char c;
-
-	while(stream->Read(&c, 1) == 1) {
-		if(c == ',' || c == '\n') break;
-		str = str + c;
+	if(blendSrc == src && blendDst == dst) {
+		skipped++;
+		return;
 	}
 
-	return str;
+	glBlendFunc(src, dst);
+	blendSrc = src;
+	blendDst = dst;
+	issued++;
 }
 //---------------------------------------------------------------------------
-//---------------------------------------------------------------------------
 
-GLFont::GLFont(wchar_t* bmpresource, wchar_t* dataresource)
+void __fastcall GLStateCache::UseProgram(unsigned int shader)
 {
-	/// Create Font bitmap from image resource and data resource
-    /// Resources created using "Codehead's Bitmap Font Generator"
-
-	text2DChanged = true;
-	text3DChanged = true;
-	VAO2D = 0;
-	VAO3D = 0;
-	VAOP = 0;
-	VBOP = 0;
-	pointSize = 0.05f;
+	if(program == shader) {
+		skipped++;
+		return;
+	}
 
+	glUseProgram(shader);
+	program = shader;
+	issued++;
+}
+//---------------------------------------------------------------------------
 
-	billboardShader = CreateShader(billboardVertexSource, billboardFragmentSource);
+void __fastcall GLStateCache::BindVertexArray(unsigned int vao)
+{
+	if(vertexArray == vao) {
+		skipped++;
+		return;
+	}
 
-	fontTexture.LoadTextureFromResource(bmpresource, false);
-	pointTexture.LoadTextureFromResource(L"POINT_PNG", false);
+	glBindVertexArray(vao);
+	vertexArray = vao;
+	issued++;
+}
+//---------------------------------------------------------------------------
 
-	// character spacing
-	TResourceStream *spacing_stream = new TResourceStream((NativeUInt)HInstance, dataresource, (System::WideChar*)RT_RCDATA);
-	__try {
-		__try {
-			// load key-value map
-			bool finished = false;
-			while(!finished) {
-				std::string key = getNext(spacing_stream);
-				if(key.size() == 0) {
-					finished = true;
-				}
-				else {
-					std::string value = getNext(spacing_stream);
-					if(isdigit(value[0])) {
-						int v = std::stoi(value, nullptr);
-						props.emplace(std::make_pair(key, v));
-					}
-				}
-			}
-		}
-		__finally {
-		}
-	}
-	__finally {
-		spacing_stream->DisposeOf();
+void __fastcall GLStateCache::BindTexture(int unit, unsigned int texture, GLenum target)
+{
+	/// Bind a 2D texture, texture array or texture buffer to a texture unit
+	/// The active unit is only changed if the binding changes
+
+	unsigned int* bound = textures;
+	if(target == GL_TEXTURE_2D_ARRAY) bound = textureArrays;
+	else if(target == GL_TEXTURE_BUFFER) bound = textureBuffers;
+	if(bound[unit] == texture) {
+		skipped++;
+		return;
 	}
 
-	for(int w=0; w<256; w++) {
-		std::string str = "Char " + std::to_string(w) + " Base Width";
-		charWidth[w] = props[str];
+	if(activeUnit != unit) {
+		glActiveTexture(GL_TEXTURE0 + unit);
+		activeUnit = unit;
+		issued++;
 	}
+	glBindTexture(target, texture);
+	bound[unit] = texture;
+	issued++;
+}
+//---------------------------------------------------------------------------
 
-	imageWidth = props["Image Width"];
-	imageHeight = props["Image Height"];
-	cellWidth = props["Cell Width"];
-	cellHeight = props["Cell Height"];
-	startChar = props["Start Char"];
-	fontHeight = props["Font Height"];
+void __fastcall GLStateCache::Invalidate()
+{
+	/// Forget all state, the next call of each kind is issued
+	/// Use after GL state has been changed without the cache
+
+	caps.clear();
+	cullMode = 0;
+	blendSrc = 0;
+	blendDst = 0;
+	program = unknownState;
+	InvalidateBindings();
 }
 //---------------------------------------------------------------------------
 
-GLFont::~GLFont()
+void __fastcall GLStateCache::InvalidateBindings()
 {
-	if(VAO2D != 0) glDeleteBuffers(1, &VAO2D);
-	if(VAO3D != 0) glDeleteBuffers(1, &VAO3D);
-	if(VBOP != 0) glDeleteBuffers(1, &VBOP);
-	if(VAOP != 0) glDeleteBuffers(1, &VAOP);
+	/// Forget vertex array and texture bindings
+	/// Uploads bind and unbind these directly, and deleted objects are unbound
+
+	vertexArray = unknownState;
+	activeUnit = -1;
+	for(unsigned int& texture : textures) texture = unknownState;
+	for(unsigned int& texture : textureArrays) texture = unknownState;
+	for(unsigned int& texture : textureBuffers) texture = unknownState;
 }
 //---------------------------------------------------------------------------
 
-void __fastcall GLFont::AddText2D(float centerx, float centery, float height, GLTextPos horiz_align, GLTextPos vert_align, const char* str, glm::vec3 color)
+void __fastcall GLStateCache::EndFrame()
 {
-	/// Create textured triangles and add to list
-	/// centerx, centery are screen position (0 to 1)
-	/// height is character size
-	/// horiz_align, vert_align are position of text relative to center
-	/// Can be LEFT, CENTER or RIGHT / ABOVE, CENTER or BELOW
-	/// str is the text string - ASCII only
-	/// color is the text color
+	/// Keep the counts for the frame just drawn and start counting again
 
-	glm::vec3 pos(centerx, centery, 0.0);
+	lastIssued = issued;
+	lastSkipped = skipped;
+	issued = 0;
+	skipped = 0;
+}
+//---------------------------------------------------------------------------
+//---------------------------------------------------------------------------
 
-	// scale converts font pixel width to screen size
-	float scalex = height / (float)fontHeight;
+GLTextureBatch::GLTextureBatch(bool texturearray, int layersize, unsigned int textureshader)
+	: vertexBuffer(sizeof(GLBatchTriangle), GL_DYNAMIC_DRAW)
+{
+	/// Constructor
+	/// If texturearray all triangles are drawn with one call from a texture array
+	/// otherwise triangles are drawn with one multi-draw call for each texture
+	/// layersize is the width and height every texture is resized to in the array
+	/// textureshader is the scene shader for textured triangles, batch vertices start
+	/// with a texture vertex so it draws them without the array
+
+	useArray = texturearray;
+	layerSize = layersize;
+	layerCount = 0;
+	layerCapacity = 0;
+	arrayTexture = 0;
+	runCount = 0;
+	layout = UniqueId();
+	changed = true;
+	uploadNeeded = false;
+	readFBO = 0;
+	drawFBO = 0;
 
-	float dx = 0.0f;
-	float dy = 0.0f;
+	arrayShader = CreateShader(batchVertexSource, batchFragmentSource);
+	textureShader = textureshader;
 
-	float strsize = 0;
-	for(int i=0; i<strlen(str); i++) {
-		int c = (int)(str[i]);
-		strsize += charWidth[c];
-	}
-	strsize *= scalex;
+	glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS, &maxLayers);
+}
+//---------------------------------------------------------------------------
 
-	if(horiz_align == GLTextPos::LEFT) {
-		dx -= strsize;
-	}
-	if(horiz_align == GLTextPos::CENTER) {
-		dx -= strsize / 2.0f;
-	}
-	if(vert_align == GLTextPos::BELOW) {
-		dy -= height;
-	}
-	if(vert_align == GLTextPos::CENTER) {
-		dy -= height / 2.0f;
-	}
+GLTextureBatch::~GLTextureBatch()
+{
+	/// Destructor
+	vertexBuffer.Release();
+	if(arrayTexture > 0) glDeleteTextures(1, &arrayTexture);
+	glDeleteProgram(arrayShader);
+}
+//---------------------------------------------------------------------------
+
+void __fastcall GLTextureBatch::Invalidate()
+{
+	/// Textures added or removed, or triangles removed or reordered
+	/// The vertex buffer is rebuilt at the next update
+
+	changed = true;
+}
+//---------------------------------------------------------------------------
 
-	int char_per_line = imageWidth / cellWidth;
-	float texh = (float)fontHeight / (float)imageHeight;
+void __fastcall GLTextureBatch::Append(std::deque<GLTexture>& textures, int texid)
+{
+	/// Copy the triangle just added to textures[texid] to the end of the batch
+	/// Only the new triangle is uploaded at the next update
+	/// Triangles of a texture are kept in runs, a run is started when the previous
+	/// triangle belonged to another texture
 
-	for(int i=0; i<strlen(str); i++) {
-		int c = (int)(str[i]);
+	if(changed) return;   // copied when rebuilt
+	if(texid < 0 || texid >= groupRuns.size()) return;
 
-		float charwidth = charWidth[c] * scalex;
+	int index = triangleList.size();
+	CopyTriangle(textures[texid].Triangles().back(), triangleList.emplace_back(), texid);
 
-		glm::vec3 p0(dx, dy, 0.0f);   					 // BL
-		glm::vec3 p1(dx + charwidth, dy, 0.0f);    		 // BR
-		glm::vec3 p2(dx + charwidth, dy + height, 0.0f);   // TR
-		glm::vec3 p3(dx, dy + height, 0.0f); 				 // TL
+	std::vector<std::pair<int, int>>& runs = groupRuns[texid];
+	if(runs.size() > 0 && runs.back().first + runs.back().second == index) {
+		runs.back().second++;
+	}
+	else {
+		runs.emplace_back(index, 1);
+		runCount++;
+	}
+	uploadNeeded = true;
 
-		int pixleft = cellWidth * ((c  - startChar) % char_per_line);
-		int pixtop = cellHeight * ((c  - startChar) / char_per_line);
-		float texleft = (float)pixleft / (float)imageWidth;
-		float textop = ((float)pixtop / (float)imageHeight);
-		float texw = (float)charWidth[c] / (float)imageWidth;
+	// each run is a separate range when drawn by texture, so interleaved
+	// adds are grouped again once the runs outgrow the triangles
+	if(!UseArray(textures.size()) && runCount > triangleList.size() / 16 + groupRuns.size()) {
+		changed = true;
+	}
+}
+//---------------------------------------------------------------------------
 
-		glm::vec2 t0(texleft, textop+texh);      // BL
-		glm::vec2 t1(texleft+texw, textop+texh); // BR
-		glm::vec2 t2(texleft+texw, textop);      // TR
-		glm::vec2 t3(texleft, textop);           // TL
+bool __fastcall GLTextureBatch::NeedsUpdate(std::deque<GLTexture>& textures)
+{
+	/// True if the next Update has triangles to rebuild or upload, or layers to copy
 
-		GLBillboardQuad& quad = quad2DList.emplace_back();
+	if(changed || uploadNeeded) return true;
+	return LayersPending(textures);
+}
+//---------------------------------------------------------------------------
 
-		// triangle 1
-		memcpy(quad.tri1[0].pos, glm::value_ptr(p0), 3 * sizeof(float));
-		memcpy(quad.tri1[1].pos, glm::value_ptr(p1), 3 * sizeof(float));
-		memcpy(quad.tri1[2].pos, glm::value_ptr(p2), 3 * sizeof(float));
+bool __fastcall GLTextureBatch::LayersPending(std::deque<GLTexture>& textures)
+{
+	/// True if the texture array must be created or has layers to copy
 
-		memcpy(quad.tri1[0].center, glm::value_ptr(pos), 3 * sizeof(float));
-		memcpy(quad.tri1[1].center, glm::value_ptr(pos), 3 * sizeof(float));
-		memcpy(quad.tri1[2].center, glm::value_ptr(pos), 3 * sizeof(float));
+	if(!UseArray(textures.size())) return false;
+	if(layerCount != textures.size()) return true;
 
-		memcpy(quad.tri1[0].color, glm::value_ptr(color), 3 * sizeof(float));
-		memcpy(quad.tri1[1].color, glm::value_ptr(color), 3 * sizeof(float));
-		memcpy(quad.tri1[2].color, glm::value_ptr(color), 3 * sizeof(float));
+	for(int layer=0; layer<layerCount; layer++) {
+		if(!layerValid[layer] && textures[layer].Ready()) return true;
+	}
+	return false;
+}
+//---------------------------------------------------------------------------
 
-		memcpy(quad.tri1[0].tex, glm::value_ptr(t0), 2 * sizeof(float));
-		memcpy(quad.tri1[1].tex, glm::value_ptr(t1), 2 * sizeof(float));
-		memcpy(quad.tri1[2].tex, glm::value_ptr(t2), 2 * sizeof(float));
+void __fastcall GLTextureBatch::UpdateTriangle(std::deque<GLTexture>& textures, int texid, int trinum)
+{
+	/// Copy an edited triangle of textures[texid] into the batch
 
-		// triangle 2
-		memcpy(quad.tri2[0].pos, glm::value_ptr(p0), 3 * sizeof(float));
-		memcpy(quad.tri2[1].pos, glm::value_ptr(p2), 3 * sizeof(float));
-		memcpy(quad.tri2[2].pos, glm::value_ptr(p3), 3 * sizeof(float));
+	if(changed) return;   // copied when rebuilt
+	if(texid < 0 || texid >= groupRuns.size()) return;
 
-		memcpy(quad.tri2[0].center, glm::value_ptr(pos), 3 * sizeof(float));
-		memcpy(quad.tri2[1].center, glm::value_ptr(pos), 3 * sizeof(float));
-		memcpy(quad.tri2[2].center, glm::value_ptr(pos), 3 * sizeof(float));
+	GLTexture& tex = textures[texid];
+	if(trinum < 0 || trinum >= tex.Triangles().size()) return;
 
-		memcpy(quad.tri2[0].color, glm::value_ptr(color), 3 * sizeof(float));
-		memcpy(quad.tri2[1].color, glm::value_ptr(color), 3 * sizeof(float));
-		memcpy(quad.tri2[2].color, glm::value_ptr(color), 3 * sizeof(float));
+	// runs hold the triangles of the texture in storage order
+	int stored = tex.StorageIndex(trinum);
+	int index = -1;
+	int skip = stored;
+	for(std::pair<int, int>& run : groupRuns[texid]) {
+		if(skip < run.second) {
+			index = run.first + skip;
+			break;
+		}
+		skip -= run.second;
+	}
+	if(index < 0) return;
 
-		memcpy(quad.tri2[0].tex, glm::value_ptr(t0), 2 * sizeof(float));
-		memcpy(quad.tri2[1].tex, glm::value_ptr(t2), 2 * sizeof(float));
-		memcpy(quad.tri2[2].tex, glm::value_ptr(t3), 2 * sizeof(float));
+	CopyTriangle(tex.Triangles()[stored], triangleList[index], texid);
 
-		dx += charwidth;
-	}
+	vertexBuffer.MarkDirty(index, 1);
+	uploadNeeded = true;
+}
+//---------------------------------------------------------------------------
 
-	text2DChanged = true;
+void __fastcall GLTextureBatch::CopyTriangle(GLTextureTriangle& src, GLBatchTriangle& dest, int layer)
+{
+	// texture vertex is the start of the batch vertex
+	for(int v=0; v<3; v++) {
+		memcpy(&dest.vert[v], &src.vert[v], sizeof(GLTextureVertex));
+		dest.vert[v].layer = (float)layer;
+	}
 }
 //---------------------------------------------------------------------------
 
-void __fastcall GLFont::AddText3D(glm::vec3 pos, float height, GLTextPos horiz_align, GLTextPos vert_align, const char* str, glm::vec3 color, bool point)
+void __fastcall GLTextureBatch::Update(std::deque<GLTexture>& textures, GLUploadThread* loader, GLUploadScheduler* scheduler)
 {
-	/// Create textured triangles and add to list
-	/// pos is world space, height is world scale
-	/// centerx, centery are screen position (0 to 1)
-	/// height is character size
-	/// horiz_align, vert_align are position of text relative to center
-	/// Can be LEFT, CENTER or RIGHT / ABOVE, CENTER or BELOW
-	/// str is the text string - ASCII only
-	/// color is the text color
+	/// Copy textures that have finished loading into their layers
+	/// and upload the combined triangles
+	/// Any window sharing the scene may run this, so the framebuffers used for
+	/// copying, which are not shared between contexts, only exist while copying
+
+	if(LayersPending(textures)) {
+		glGenFramebuffers(1, &readFBO);
+		glGenFramebuffers(1, &drawFBO);
+
+		// mipmaps are made again after the loaded layers are moved
+		bool copied = false;
+		if(layerCount != textures.size()) {
+			ResizeArray(textures.size());
+			copied = true;
+		}
 
-	// scale converts font bmp pixel to world size
-	float scalex = height / (float)fontHeight;
+		for(int layer=0; layer<layerCount; layer++) {
+			if(!layerValid[layer] && textures[layer].Ready()) {
+				CopyLayer(textures[layer], layer);
+				layerValid[layer] = true;
+				copied = true;
+			}
+		}
+		if(copied) {
+			glBindTexture(GL_TEXTURE_2D_ARRAY, arrayTexture);
+			glGenerateMipmap(GL_TEXTURE_2D_ARRAY);
+			glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+		}
 
-	float strsize = 0;
-	for(int i=0; i<strlen(str); i++) {
-		int c = (int)(str[i]);
-		strsize += charWidth[c];
+		glDeleteFramebuffers(1, &readFBO);
+		glDeleteFramebuffers(1, &drawFBO);
+		readFBO = drawFBO = 0;
 	}
-	strsize *= scalex;
 
-	float x = 0.0f;
-	float y = 0.0f;
+	if(changed) {
+		// rebuild from the triangles of each texture, one run each
+		triangleList.clear();
+		groupRuns.resize(textures.size());
+		for(int layer=0; layer<textures.size(); layer++) {
+			std::vector<GLTextureTriangle>& source = textures[layer].Triangles();
+			groupRuns[layer].assign(1, std::make_pair((int)triangleList.size(), (int)source.size()));
+			for(GLTextureTriangle& tri : source) {
+				CopyTriangle(tri, triangleList.emplace_back(), layer);
+			}
+		}
+		runCount = textures.size();
 
-	if(horiz_align == GLTextPos::RIGHT) {
-		if(point) x += 2 * pointSize;
-	}
-	if(horiz_align == GLTextPos::LEFT) {
-		x -= strsize;
-		if(point) x -= 2 * pointSize;
+		vertexBuffer.Invalidate();
+		layout = UniqueId();
+		changed = false;
+		uploadNeeded = true;
 	}
-	if(horiz_align == GLTextPos::CENTER) {
-		x -= strsize / 2.0f;
+
+	if(uploadNeeded) {
+		vertexBuffer.Upload(triangleList.data(), triangleList.size(), loader, scheduler);
+		uploadNeeded = vertexBuffer.Pending() || vertexBuffer.Count() < triangleList.size();
 	}
-	if(vert_align == GLTextPos::ABOVE) {
-		if(horiz_align == GLTextPos::CENTER && point) {
-			y += 2 * pointSize;
-		}
+}
+//---------------------------------------------------------------------------
+
+void __fastcall GLTextureBatch::ResizeArray(int layers)
+{
+	/// Give the texture array a layer for each texture
+	/// The array is allocated at twice the size it needs, when it grows the loaded
+	/// layers are moved to the new array so their textures are not copied again
+	/// New layers are grey until their texture is copied in
+	/// If textures were removed all layers are copied again
+
+	int first = layerCount;
+	if(layers < layerCount) {
+		layerValid.clear();
+		first = 0;
 	}
-	if(vert_align == GLTextPos::BELOW) {
-		y -= height;
-		if(horiz_align == GLTextPos::CENTER && point) {
-			y -= 2 * pointSize;
+	layerValid.resize(layers, false);
+	layerCount = layers;
+
+	if(layers > layerCapacity) {
+		int capacity = std::min(std::max(layers, layerCapacity * 2), maxLayers);
+
+		unsigned int grown;
+		glGenTextures(1, &grown);
+		glBindTexture(GL_TEXTURE_2D_ARRAY, grown);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGBA8, layerSize, layerSize, capacity, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+		glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+		// loaded layers, the others are cleared below
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, readFBO);
+		glBindFramebuffer(GL_DRAW_FRAMEBUFFER, drawFBO);
+		for(int layer=0; layer<first; layer++) {
+			glFramebufferTextureLayer(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, arrayTexture, 0, layer);
+			glFramebufferTextureLayer(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, grown, 0, layer);
+			glBlitFramebuffer(0, 0, layerSize, layerSize, 0, 0, layerSize, layerSize, GL_COLOR_BUFFER_BIT, GL_NEAREST);
 		}
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+		if(arrayTexture > 0) glDeleteTextures(1, &arrayTexture);
+		arrayTexture = grown;
+		layerCapacity = capacity;
 	}
-	if(vert_align == GLTextPos::CENTER) {
-		y -= height / 2.0f;
+
+	const float grey[4] = { 0.5f, 0.5f, 0.5f, 1.0f };
+	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, drawFBO);
+	for(int layer=first; layer<layers; layer++) {
+		glFramebufferTextureLayer(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, arrayTexture, 0, layer);
+		glClearBufferfv(GL_COLOR, 0, grey);
 	}
+	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+}
+//---------------------------------------------------------------------------
 
-	int char_per_line = imageWidth / cellWidth;
-	float texh = (float)fontHeight / (float)imageHeight;
+void __fastcall GLTextureBatch::CopyLayer(GLTexture& tex, int layer)
+{
+	/// Copy and resize a texture into a layer with a framebuffer blit
 
-	for(int i=0; i<strlen(str); i++) {
-		int c = (int)(str[i]);
+	if(tex.textureID == 0) return;   // failed to load, stays grey
 
-		float charwidth = charWidth[c] * scalex;
+	int width, height;
+	glBindTexture(GL_TEXTURE_2D, tex.textureID);
+	glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_WIDTH, &width);
+	glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_HEIGHT, &height);
+	glBindTexture(GL_TEXTURE_2D, 0);
 
-		glm::vec3 p0(x, y, 0.0f);   					 // BL
-		glm::vec3 p1(x + charwidth, y, 0.0f);    		 // BR
-		glm::vec3 p2(x + charwidth, y + height, 0.0f);   // TR
-		glm::vec3 p3(x, y + height, 0.0f); 				 // TL
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, readFBO);
+	glFramebufferTexture2D(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, tex.textureID, 0);
+	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, drawFBO);
+	glFramebufferTextureLayer(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, arrayTexture, 0, layer);
 
-		int pixleft = cellWidth * ((c  - startChar) % char_per_line);
-		int pixtop = cellHeight * ((c  - startChar) / char_per_line);
-		float texleft = (float)pixleft / (float)imageWidth;
-		float textop = ((float)pixtop / (float)imageHeight);
-		float texw = (float)charWidth[c] / (float)imageWidth;
+	glBlitFramebuffer(0, 0, width, height, 0, 0, layerSize, layerSize, GL_COLOR_BUFFER_BIT, GL_LINEAR);
 
-		glm::vec2 t0(texleft, textop+texh);      // BL
-		glm::vec2 t1(texleft+texw, textop+texh); // BR
-		glm::vec2 t2(texleft+texw, textop);      // TR
-		glm::vec2 t3(texleft, textop);           // TL
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+//---------------------------------------------------------------------------
 
-		GLBillboardQuad& quad = quad3DList.emplace_back();
+void __fastcall GLTextureBatch::Cull(GLBufferView& view, GLFrustum* frustum, GLRenderStats& stats, bool occlusion, GLCullCompute* compute)
+{
+	/// Find the chunks of the combined triangles inside frustum, all chunks if nullptr
+	/// If occlusion chunks hidden at their last query are skipped
+	/// If compute is set the chunks are culled on the GPU, only when drawn from the array
+	/// view holds the chunks of the window drawing, after SyncView
+
+	view.chunks.Update(triangleList);
+	view.indirect = compute != nullptr;
+	if(view.indirect) view.chunks.CullIndirect(*compute, view.array.Ready() ? vertexBuffer.Count() : 0, stats);
+	else view.chunks.Cull(frustum, stats, occlusion);
+}
+//---------------------------------------------------------------------------
 
-		// triangle 1
-		memcpy(quad.tri1[0].pos, glm::value_ptr(p0), 3 * sizeof(float));
-		memcpy(quad.tri1[1].pos, glm::value_ptr(p1), 3 * sizeof(float));
-		memcpy(quad.tri1[2].pos, glm::value_ptr(p2), 3 * sizeof(float));
+void __fastcall GLTextureBatch::Render(GLBufferView& view, std::deque<GLTexture>& textures, GLStateCache& state, unsigned int depthshader)
+{
+	/// Draw the triangles of all textures in the chunks of view found by the last Cull
+	/// With a texture array this is one call, otherwise the uploaded runs of each
+	/// texture are combined into one glMultiDrawArrays
+	/// If depthshader is set it is used instead and no textures are bound
+
+	if(vertexBuffer.Count() == 0 || !view.array.Ready()) return;
+
+	std::vector<GLint>& drawFirst = view.drawFirst;
+	std::vector<GLsizei>& drawCount = view.drawCount;
+
+	if(UseArray(textures.size())) {
+		drawFirst.clear();
+		drawCount.clear();
+		if(!view.indirect) {
+			view.chunks.Clip(0, vertexBuffer.Count(), drawFirst, drawCount);
+			if(drawFirst.size() == 0) return;
+		}
 
-		memcpy(quad.tri1[0].center, glm::value_ptr(pos), 3 * sizeof(float));
-		memcpy(quad.tri1[1].center, glm::value_ptr(pos), 3 * sizeof(float));
-		memcpy(quad.tri1[2].center, glm::value_ptr(pos), 3 * sizeof(float));
+		state.UseProgram(depthshader != 0 ? depthshader : arrayShader);
+		if(depthshader == 0) state.BindTexture(0, arrayTexture, GL_TEXTURE_2D_ARRAY);
+		view.array.Bind(state);
+		if(view.indirect) view.chunks.DrawIndirect();
+		else glMultiDrawArrays(GL_TRIANGLES, drawFirst.data(), drawCount.data(), drawFirst.size());
+		return;
+	}
 
-		memcpy(quad.tri1[0].color, glm::value_ptr(color), 3 * sizeof(float));
-		memcpy(quad.tri1[1].color, glm::value_ptr(color), 3 * sizeof(float));
-		memcpy(quad.tri1[2].color, glm::value_ptr(color), 3 * sizeof(float));
+	state.UseProgram(depthshader != 0 ? depthshader : textureShader);
+	view.array.Bind(state);
 
-		memcpy(quad.tri1[0].tex, glm::value_ptr(t0), 2 * sizeof(float));
-		memcpy(quad.tri1[1].tex, glm::value_ptr(t1), 2 * sizeof(float));
-		memcpy(quad.tri1[2].tex, glm::value_ptr(t2), 2 * sizeof(float));
+	int uploaded = vertexBuffer.Count();
+	for(int group=0; group<groupRuns.size(); group++) {
+		if(!textures[group].Drawable()) continue;
+		drawFirst.clear();
+		drawCount.clear();
 
-		// triangle 2
-		memcpy(quad.tri2[0].pos, glm::value_ptr(p0), 3 * sizeof(float));
-		memcpy(quad.tri2[1].pos, glm::value_ptr(p2), 3 * sizeof(float));
-		memcpy(quad.tri2[2].pos, glm::value_ptr(p3), 3 * sizeof(float));
+		// visible parts, joined with ranges that follow on in the buffer
+		for(std::pair<int, int>& run : groupRuns[group]) {
+			int first = run.first;
+			int last = std::min(first + run.second, uploaded);
+			view.chunks.Clip(first, last, drawFirst, drawCount);
+		}
 
-		memcpy(quad.tri2[0].center, glm::value_ptr(pos), 3 * sizeof(float));
-		memcpy(quad.tri2[1].center, glm::value_ptr(pos), 3 * sizeof(float));
-		memcpy(quad.tri2[2].center, glm::value_ptr(pos), 3 * sizeof(float));
+		if(drawFirst.size() > 0) {
+			if(depthshader == 0) state.BindTexture(0, textures[group].textureID);
+			glMultiDrawArrays(GL_TRIANGLES, drawFirst.data(), drawCount.data(), drawFirst.size());
+		}
+	}
+}
+//---------------------------------------------------------------------------
+//---------------------------------------------------------------------------
 
-		memcpy(quad.tri2[0].color, glm::value_ptr(color), 3 * sizeof(float));
-		memcpy(quad.tri2[1].color, glm::value_ptr(color), 3 * sizeof(float));
-		memcpy(quad.tri2[2].color, glm::value_ptr(color), 3 * sizeof(float));
+void __fastcall GLFrustum::Set(const glm::mat4& pvm)
+{
+	/// Extract the six clip planes from the projection view matrix
+	/// Each plane is row 3 plus or minus row 0, 1 or 2, normals point inside
+
+	for(int row=0; row<3; row++) {
+		for(int side=0; side<2; side++) {
+			float sign = side == 0 ? 1.0f : -1.0f;
+			int plane = row * 2 + side;
+			nx[plane] = pvm[0][3] + sign * pvm[0][row];
+			ny[plane] = pvm[1][3] + sign * pvm[1][row];
+			nz[plane] = pvm[2][3] + sign * pvm[2][row];
+			d[plane] = pvm[3][3] + sign * pvm[3][row];
+		}
+	}
 
-		memcpy(quad.tri2[0].tex, glm::value_ptr(t0), 2 * sizeof(float));
-		memcpy(quad.tri2[1].tex, glm::value_ptr(t2), 2 * sizeof(float));
-		memcpy(quad.tri2[2].tex, glm::value_ptr(t3), 2 * sizeof(float));
+	// padding planes every point is inside
+	for(int plane=6; plane<8; plane++) {
+		nx[plane] = ny[plane] = nz[plane] = 0.0f;
+		d[plane] = 1.0f;
+	}
+}
+//---------------------------------------------------------------------------
 
-		x += charwidth;
+bool __fastcall GLFrustum::Intersects(const glm::vec3& center, const glm::vec3& extent)
+{
+	/// Test a box given by center and half size against the planes
+	/// Returns false if the box is completely outside any plane
+	/// Boxes near the corners of the frustum may pass without being visible
+
+#ifdef FRUSTUM_SSE
+	__m128 cx = _mm_set1_ps(center.x);
+	__m128 cy = _mm_set1_ps(center.y);
+	__m128 cz = _mm_set1_ps(center.z);
+	__m128 ex = _mm_set1_ps(extent.x);
+	__m128 ey = _mm_set1_ps(extent.y);
+	__m128 ez = _mm_set1_ps(extent.z);
+	__m128 signbit = _mm_set1_ps(-0.0f);
+
+	for(int plane=0; plane<8; plane+=4) {
+		__m128 px = _mm_loadu_ps(nx + plane);
+		__m128 py = _mm_loadu_ps(ny + plane);
+		__m128 pz = _mm_loadu_ps(nz + plane);
+
+		// distance of center and projected half size of box along each normal
+		__m128 dist = _mm_add_ps(_mm_add_ps(_mm_mul_ps(px, cx), _mm_mul_ps(py, cy)), _mm_add_ps(_mm_mul_ps(pz, cz), _mm_loadu_ps(d + plane)));
+		__m128 radius = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_andnot_ps(signbit, px), ex), _mm_mul_ps(_mm_andnot_ps(signbit, py), ey)), _mm_mul_ps(_mm_andnot_ps(signbit, pz), ez));
+
+		if(_mm_movemask_ps(_mm_cmplt_ps(_mm_add_ps(dist, radius), _mm_setzero_ps())) != 0) return false;
 	}
+	return true;
+#else
+	for(int plane=0; plane<6; plane++) {
+		float dist = nx[plane] * center.x + ny[plane] * center.y + nz[plane] * center.z + d[plane];
+		float radius = fabs(nx[plane]) * extent.x + fabs(ny[plane]) * extent.y + fabs(nz[plane]) * extent.z;
+		if(dist + radius < 0.0f) return false;
+	}
+	return true;
+#endif
+}
+//---------------------------------------------------------------------------
+//---------------------------------------------------------------------------
 
-	if(point) {
+GLChunkList::GLChunkList()
+{
+	/// Constructor
+	/// Everything is visible until the first Cull
+
+	counted = 0;
+	visible.push_back(std::make_pair(0, INT_MAX));
+	resultsChanged = false;
+	boxBuffer = 0;
+	boxesChanged = true;
+	commandBuffer = 0;
+	commandSize = 0;
+	commandCount = 0;
+}
+//---------------------------------------------------------------------------
 
-		glm::vec3 p0(-pointSize, -pointSize, 0.0f);   // BL
-		glm::vec3 p1(+pointSize, -pointSize, 0.0f);   // BR
-		glm::vec3 p2(+pointSize, +pointSize, 0.0f);   // TR
-		glm::vec3 p3(-pointSize, +pointSize, 0.0f); 	// TL
+GLChunkList::~GLChunkList()
+{
+	/// Destructor deletes queries
 
-		glm::vec2 t0(0.0f, 0.0f); // BL
-		glm::vec2 t1(1.0f, 0.0f); // BR
-		glm::vec2 t2(1.0f, 1.0f); // TR
-		glm::vec2 t3(0.0f, 1.0f); // TL
+	Release();
+}
+//---------------------------------------------------------------------------
 
-		GLBillboardQuad& quad = pointList.emplace_back();
+void __fastcall GLChunkList::Release()
+{
+	/// Delete query objects and cull buffers while the context is current
 
-		// quad - 2 triangles
-		memcpy(quad.tri1[0].pos, glm::value_ptr(p0), 3 * sizeof(float));
-		memcpy(quad.tri1[1].pos, glm::value_ptr(p1), 3 * sizeof(float));
-		memcpy(quad.tri1[2].pos, glm::value_ptr(p2), 3 * sizeof(float));
+	for(GLChunkQuery& q : queries) {
+		if(q.query > 0) glDeleteQueries(1, &q.query);
+	}
+	queries.clear();
 
-		memcpy(quad.tri1[0].center, glm::value_ptr(pos), 3 * sizeof(float));
-		memcpy(quad.tri1[1].center, glm::value_ptr(pos), 3 * sizeof(float));
-		memcpy(quad.tri1[2].center, glm::value_ptr(pos), 3 * sizeof(float));
+	if(boxBuffer > 0) glDeleteBuffers(1, &boxBuffer);
+	if(commandBuffer > 0) glDeleteBuffers(1, &commandBuffer);
+	boxBuffer = commandBuffer = 0;
+	boxesChanged = true;
+	commandSize = commandCount = 0;
+}
+//---------------------------------------------------------------------------
 
-		memcpy(quad.tri1[0].color, glm::value_ptr(color), 3 * sizeof(float));
-		memcpy(quad.tri1[1].color, glm::value_ptr(color), 3 * sizeof(float));
-		memcpy(quad.tri1[2].color, glm::value_ptr(color), 3 * sizeof(float));
+void __fastcall GLChunkList::Invalidate()
+{
+	/// Triangles removed or reordered
+	/// Boxes are recalculated at the next Update, query objects are reused
+
+	centers.clear();
+	extents.clear();
+	inView.clear();
+	counted = 0;
+	visible.assign(1, std::make_pair(0, INT_MAX));
+	boxesChanged = true;
+}
+//---------------------------------------------------------------------------
 
-		memcpy(quad.tri1[0].tex, glm::value_ptr(t0), 2 * sizeof(float));
-		memcpy(quad.tri1[1].tex, glm::value_ptr(t1), 2 * sizeof(float));
-		memcpy(quad.tri1[2].tex, glm::value_ptr(t2), 2 * sizeof(float));
+template<class T> void __fastcall GLChunkList::Update(std::vector<T>& list)
+{
+	/// Calculate boxes for triangles added to list since the last update
+	/// Only the last chunk, if it was partly filled, and new chunks are calculated
 
-		memcpy(quad.tri2[0].pos, glm::value_ptr(p0), 3 * sizeof(float));
-		memcpy(quad.tri2[1].pos, glm::value_ptr(p2), 3 * sizeof(float));
-		memcpy(quad.tri2[2].pos, glm::value_ptr(p3), 3 * sizeof(float));
+	if(list.size() < counted) Invalidate();   // removed without Invalidate
+	if(list.size() == counted) return;
 
-		memcpy(quad.tri2[0].center, glm::value_ptr(pos), 3 * sizeof(float));
-		memcpy(quad.tri2[1].center, glm::value_ptr(pos), 3 * sizeof(float));
-		memcpy(quad.tri2[2].center, glm::value_ptr(pos), 3 * sizeof(float));
+	// refill partly filled last chunk
+	if(counted % chunkSize != 0) {
+		centers.pop_back();
+		extents.pop_back();
+		counted -= counted % chunkSize;
+	}
 
-		memcpy(quad.tri2[0].color, glm::value_ptr(color), 3 * sizeof(float));
-		memcpy(quad.tri2[1].color, glm::value_ptr(color), 3 * sizeof(float));
-		memcpy(quad.tri2[2].color, glm::value_ptr(color), 3 * sizeof(float));
+	for(int first = counted; first < list.size(); first += chunkSize) {
+		int last = std::min(first + chunkSize, (int)list.size());
+		glm::vec3 minpos(FLT_MAX);
+		glm::vec3 maxpos(-FLT_MAX);
+		for(int t=first; t<last; t++) {
+			for(int v=0; v<3; v++) {
+				glm::vec3 pos = glm::make_vec3(list[t].vert[v].pos);
+				minpos = glm::min(minpos, pos);
+				maxpos = glm::max(maxpos, pos);
+			}
+		}
+		centers.push_back((minpos + maxpos) * 0.5f);
+		extents.push_back((maxpos - minpos) * 0.5f);
+
+		// box changed, result of a query still running is ignored
+		if(queries.size() < centers.size()) queries.emplace_back();
+		GLChunkQuery& q = queries[centers.size() - 1];
+		q.pending = false;
+		q.occluded = false;
+	}
+	counted = list.size();
+	boxesChanged = true;
+}
+//---------------------------------------------------------------------------
+
+void __fastcall GLChunkList::Cull(GLFrustum* frustum, GLRenderStats& stats, bool occlusion)
+{
+	/// Find the runs of triangles in chunks inside or crossing frustum
+	/// If frustum is nullptr every chunk is in view
+	/// If occlusion chunks whose last query found no samples are skipped, the
+	/// query result is only read once it is available so the GPU is never waited for
+	/// Counts are added to stats
+
+	visible.clear();
+	inView.clear();
+	resultsChanged = false;
+	stats.trianglesTotal += counted;
+	for(int c=0; c<centers.size(); c++) {
+		GLChunkQuery& q = queries[c];
+		if(q.pending) {
+			GLuint available = 0;
+			glGetQueryObjectuiv(q.query, GL_QUERY_RESULT_AVAILABLE, &available);
+			if(available) {
+				GLuint passed = 0;
+				glGetQueryObjectuiv(q.query, GL_QUERY_RESULT, &passed);
+				if(q.occluded != (passed == 0)) resultsChanged = true;
+				q.occluded = passed == 0;
+				q.pending = false;
+			}
+		}
+		if(!occlusion) q.occluded = false;
+
+		if(frustum != nullptr && !frustum->Intersects(centers[c], extents[c])) {
+			q.occluded = false;   // drawn when it comes back into view until tested again
+			continue;
+		}
+		inView.push_back(c);
+
+		int first = c * chunkSize;
+		int last = std::min(first + chunkSize, counted);
+		if(q.occluded) {
+			stats.chunksOccluded++;
+			stats.trianglesOccluded += last - first;
+			continue;
+		}
+		stats.chunksVisible++;
+		stats.trianglesVisible += last - first;
+
+		// join with previous chunk if it was visible
+		if(visible.size() > 0 && visible.back().second == first) {
+			visible.back().second = last;
+		}
+		else {
+			visible.push_back(std::make_pair(first, last));
+		}
+	}
+	if(frustum != nullptr) stats.chunksTested += centers.size();
+}
+//---------------------------------------------------------------------------
+
+void __fastcall GLChunkList::Query(GLBoxQuery& boxes)
+{
+	/// Start occlusion queries for the chunks in view at the last Cull
+	/// Called after drawing so the boxes are tested against everything drawn this frame
+	/// Chunks with a query still running are not tested again
+
+	for(int c : inView) {
+		GLChunkQuery& q = queries[c];
+		if(q.pending) continue;
+
+		if(q.query == 0) glGenQueries(1, &q.query);
+		if(boxes.Test(q.query, centers[c], extents[c])) {
+			q.pending = true;
+		}
+		else {
+			q.occluded = false;   // eye inside box
+		}
+	}
+}
+//---------------------------------------------------------------------------
+
+bool __fastcall GLChunkList::QueryPending()
+{
+	/// True if a query has been started whose result has not been read by Cull
+
+	for(int c=0; c<centers.size(); c++) {
+		if(queries[c].pending) return true;
+	}
+	return false;
+}
+//---------------------------------------------------------------------------
+
+void __fastcall GLChunkList::Clip(int first, int last, std::vector<GLint>& drawfirst, std::vector<GLsizei>& drawcount)
+{
+	/// Append the visible parts of triangles first to last as vertex ranges for glMultiDrawArrays
+	/// Ranges that follow on from the last range appended are joined
 
-		memcpy(quad.tri2[0].tex, glm::value_ptr(t0), 2 * sizeof(float));
-		memcpy(quad.tri2[1].tex, glm::value_ptr(t2), 2 * sizeof(float));
-		memcpy(quad.tri2[2].tex, glm::value_ptr(t3), 2 * sizeof(float));
+	for(std::pair<int, int>& run : visible) {
+		int start = std::max(run.first, first);
+		int end = std::min(run.second, last);
+		if(end <= start) continue;
 
+		if(drawcount.size() > 0 && drawfirst.back() + drawcount.back() == start * 3) {
+			drawcount.back() += (end - start) * 3;
+		}
+		else {
+			drawfirst.push_back(start * 3);
+			drawcount.push_back((end - start) * 3);
+		}
 	}
-
-	text3DChanged = true;
 }
 //---------------------------------------------------------------------------
 
-void __fastcall GLFont::Create2DArrays()
+void __fastcall GLChunkList::CullIndirect(GLCullCompute& compute, int triangles, GLRenderStats& stats)
 {
-	/// Set up vertex data and buffers and configure vertex attributes
-	/// for screen text triangles
-
-	if(VAO2D > 0) {
-		glDeleteVertexArrays(1, &VAO2D);
-		VAO2D = 0;
+	/// Have the cull shader write a draw command for each chunk, for DrawIndirect
+	/// triangles is the number that can be drawn, as uploaded so far
+	/// Boxes are uploaded again only when they change
+	/// Which chunks are visible is only known on the GPU, so only totals are added to stats
+
+	stats.trianglesTotal += counted;
+	if(compute.Culling()) stats.chunksTested += centers.size();
+
+	commandCount = centers.size();
+	if(commandCount == 0) return;
+
+	if(boxesChanged) {
+		// center and extent of each chunk, padded to vec4 for std430
+		std::vector<glm::vec4> boxes(commandCount * 2);
+		for(int c=0; c<commandCount; c++) {
+			boxes[c * 2] = glm::vec4(centers[c], 0.0f);
+			boxes[c * 2 + 1] = glm::vec4(extents[c], 0.0f);
+		}
+		if(boxBuffer == 0) glGenBuffers(1, &boxBuffer);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, boxBuffer);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, boxes.size() * sizeof(glm::vec4), boxes.data(), GL_STATIC_DRAW);
+		boxesChanged = false;
 	}
 
+	if(commandSize < commandCount) {
+		// DrawArraysIndirectCommand is four uints
+		if(commandBuffer == 0) glGenBuffers(1, &commandBuffer);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, commandBuffer);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, commandCount * 4 * sizeof(GLuint), NULL, GL_DYNAMIC_COPY);
+		commandSize = commandCount;
+	}
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
 
-	if(quad2DList.size() > 0) {
-
-		glGenVertexArrays(1, &VAO2D);
-		glBindVertexArray(VAO2D);
+	compute.Dispatch(boxBuffer, commandBuffer, commandCount, triangles);
+}
+//---------------------------------------------------------------------------
 
-		unsigned int VBO;
-		glGenBuffers(1, &VBO);
-		glBindBuffer(GL_ARRAY_BUFFER, VBO);
-		glBufferData(GL_ARRAY_BUFFER, quad2DList.size() * sizeof(GLBillboardQuad), quad2DList.data(), GL_STATIC_DRAW);
+void __fastcall GLChunkList::DrawIndirect()
+{
+	/// Draw the chunks with the commands written by the last CullIndirect
+	/// The caller binds the shader and vertex array
 
-		// position
-		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(GLBillboardVertex), (void*)0);
-		glEnableVertexAttribArray(0);
+	if(commandCount == 0) return;
 
-		// center
-		glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(GLBillboardVertex), (void*)(3 * sizeof(float)));
-		glEnableVertexAttribArray(1);
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, commandBuffer);
+	glMultiDrawArraysIndirect(GL_TRIANGLES, 0, commandCount, 0);
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+}
+//---------------------------------------------------------------------------
+//---------------------------------------------------------------------------
 
-		// color
-		glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(GLBillboardVertex), (void*)(6 * sizeof(float)));
-		glEnableVertexAttribArray(2);
+GLCullCompute::GLCullCompute()
+{
+	/// Constructor
+	/// Creates the cull shader, the context must be GL 4.3 or later
+
+	std::string source = cullComputeSource;
+	source.replace(source.find("CHUNK_SIZE"), 10, std::to_string(GLChunkList::chunkSize));
+	cullShader = CreateComputeShader(source.c_str());
+	planesLoc = glGetUniformLocation(cullShader, "planes");
+	chunksLoc = glGetUniformLocation(cullShader, "chunks");
+	trianglesLoc = glGetUniformLocation(cullShader, "triangles");
+	cullLoc = glGetUniformLocation(cullShader, "cull");
+	culling = false;
+	dispatched = false;
+}
+//---------------------------------------------------------------------------
 
-		// texture coord
-		glVertexAttribPointer(3, 2, GL_FLOAT, GL_FALSE, sizeof(GLBillboardVertex), (void*)(9 * sizeof(float)));
-		glEnableVertexAttribArray(3);
+GLCullCompute::~GLCullCompute()
+{
+	/// Destructor
+	glDeleteProgram(cullShader);
+}
+//---------------------------------------------------------------------------
 
-		glBindVertexArray(0);
-		glBindBuffer(GL_ARRAY_BUFFER, 0);
-		glDeleteBuffers(1, &VBO);
+void __fastcall GLCullCompute::Begin(GLStateCache& state, GLFrustum* frustum)
+{
+	/// Use the cull shader with the planes of frustum, every chunk is drawn if nullptr
+
+	state.UseProgram(cullShader);
+	culling = frustum != nullptr;
+	dispatched = false;
+	glUniform1i(cullLoc, culling ? 1 : 0);
+	if(culling) {
+		float planes[6 * 4];
+		for(int p=0; p<6; p++) {
+			planes[p * 4] = frustum->nx[p];
+			planes[p * 4 + 1] = frustum->ny[p];
+			planes[p * 4 + 2] = frustum->nz[p];
+			planes[p * 4 + 3] = frustum->d[p];
+		}
+		glUniform4fv(planesLoc, 6, planes);
 	}
 }
 //---------------------------------------------------------------------------
 
-void __fastcall GLFont::Create3DArrays()
+void __fastcall GLCullCompute::Dispatch(unsigned int boxes, unsigned int commands, int chunks, int triangles)
 {
-	/// Set up vertex data and buffers and configure vertex attributes
-	/// for world text and point triangles
+	/// Write the draw commands of chunks boxes into commands
+
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, boxes);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, commands);
+	glUniform1i(chunksLoc, chunks);
+	glUniform1i(trianglesLoc, triangles);
+	glDispatchCompute((chunks + 63) / 64, 1, 1);
+	dispatched = true;
+}
+//---------------------------------------------------------------------------
 
-	if(VAO3D > 0) {
-		glDeleteVertexArrays(1, &VAO3D);
-		VAO3D = 0;
-	}
+void __fastcall GLCullCompute::End()
+{
+	/// Make the commands written visible to the indirect draws that follow
 
-	if(quad3DList.size() > 0) {
+	if(dispatched) glMemoryBarrier(GL_COMMAND_BARRIER_BIT);
+	dispatched = false;
+}
+//---------------------------------------------------------------------------
+//---------------------------------------------------------------------------
 
-		glGenVertexArrays(1, &VAO3D);
-		glBindVertexArray(VAO3D);
+GLBufferView::GLBufferView(int vertexsize)
+	: array(vertexsize)
+{
+	/// Constructor
+	/// The owner adds the attributes to array before the first Sync
+
+	bufferGeneration = 0;
+	chunkLayout = 0;
+	indirect = false;
+}
+//---------------------------------------------------------------------------
 
-		unsigned int VBO;
-		glGenBuffers(1, &VBO);
-		glBindBuffer(GL_ARRAY_BUFFER, VBO);
-		glBufferData(GL_ARRAY_BUFFER, quad3DList.size() * sizeof(GLBillboardQuad), quad3DList.data(), GL_STATIC_DRAW);
+void __fastcall GLBufferView::Sync(GLVertexBuffer& buffer, unsigned int layout)
+{
+	/// Attach the vertex array again if buffer was replaced by a new object,
+	/// in this or another context, and recalculate the chunks if the triangles
+	/// were removed or reordered
+	/// Binds the vertex array directly so state cache bindings are out of date after
+
+	if(buffer.Generation() != bufferGeneration) {
+		bufferGeneration = buffer.Generation();
+		if(buffer.buffer > 0) array.Attach(buffer.buffer);
+	}
+	if(layout != chunkLayout) {
+		chunkLayout = layout;
+		chunks.Invalidate();
+	}
+}
+//---------------------------------------------------------------------------
 
-		// position
-		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(GLBillboardVertex), (void*)0);
-		glEnableVertexAttribArray(0);
+void __fastcall GLBufferView::Release()
+{
+	/// Delete the vertex array and queries with the context they were made in current
 
-		// center
-		glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(GLBillboardVertex), (void*)(3 * sizeof(float)));
-		glEnableVertexAttribArray(1);
+	array.Release();
+	chunks.Release();
+	bufferGeneration = 0;
+}
+//---------------------------------------------------------------------------
+//---------------------------------------------------------------------------
 
-		// color
-		glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(GLBillboardVertex), (void*)(6 * sizeof(float)));
-		glEnableVertexAttribArray(2);
+GLRenderTarget::GLRenderTarget()
+{
+	/// Constructor
+	/// Framebuffers are created by the first Resize
+
+	targetWidth = 0;
+	targetHeight = 0;
+	targetSamples = 0;
+	failedWidth = failedHeight = failedSamples = 0;
+	drawFBO = 0;
+	colorBuffer = 0;
+	depthBuffer = 0;
+	resolveFBO = 0;
+	colorTexture = 0;
+}
+//---------------------------------------------------------------------------
 
-		// texture coord
-		glVertexAttribPointer(3, 2, GL_FLOAT, GL_FALSE, sizeof(GLBillboardVertex), (void*)(9 * sizeof(float)));
-		glEnableVertexAttribArray(3);
+GLRenderTarget::~GLRenderTarget()
+{
+	/// Destructor deletes framebuffers
 
-		glBindVertexArray(0);
-		glBindBuffer(GL_ARRAY_BUFFER, 0);
-		glDeleteBuffers(1, &VBO);
-	}
+	Release();
+}
+//---------------------------------------------------------------------------
 
+void __fastcall GLRenderTarget::Release()
+{
+	/// Delete framebuffers, renderbuffers and texture
+
+	if(drawFBO > 0) glDeleteFramebuffers(1, &drawFBO);
+	if(resolveFBO > 0) glDeleteFramebuffers(1, &resolveFBO);
+	if(colorBuffer > 0) glDeleteRenderbuffers(1, &colorBuffer);
+	if(depthBuffer > 0) glDeleteRenderbuffers(1, &depthBuffer);
+	if(colorTexture > 0) glDeleteTextures(1, &colorTexture);
+	drawFBO = resolveFBO = colorBuffer = depthBuffer = colorTexture = 0;
+	targetWidth = targetHeight = targetSamples = 0;
+}
+//---------------------------------------------------------------------------
 
-	// point array
-	if(VAOP > 0) {
-		glDeleteVertexArrays(1, &VAOP);
-		VAOP = 0;
+bool __fastcall GLRenderTarget::Resize(int width, int height, int samples)
+{
+	/// Make the target width x height with samples per pixel, 0 or 1 for none
+	/// Samples are limited to what the driver supports
+	/// Does nothing if the size and samples have not changed
+	/// Returns false if the framebuffer could not be made, the caller draws without it
+	/// A size that failed is not tried again until the size or samples change
+
+	if(resolveFBO > 0 && width == targetWidth && height == targetHeight && samples == targetSamples) return true;
+	if(width == failedWidth && height == failedHeight && samples == failedSamples) return false;
+	Release();
+	if(width <= 0 || height <= 0) return false;
+
+	targetWidth = width;
+	targetHeight = height;
+	targetSamples = samples;
+
+	GLint maxsamples = 0;
+	glGetIntegerv(GL_MAX_SAMPLES, &maxsamples);
+	int count = std::min(samples, (int)maxsamples);
+
+	// single sample image read by later passes and GetImage
+	glGenTextures(1, &colorTexture);
+	glBindTexture(GL_TEXTURE_2D, colorTexture);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	glGenFramebuffers(1, &resolveFBO);
+	glBindFramebuffer(GL_FRAMEBUFFER, resolveFBO);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, colorTexture, 0);
+
+	glGenRenderbuffers(1, &depthBuffer);
+	glBindRenderbuffer(GL_RENDERBUFFER, depthBuffer);
+	if(count > 1) {
+		// drawn multisampled and resolved into the texture
+		glRenderbufferStorageMultisample(GL_RENDERBUFFER, count, GL_DEPTH_COMPONENT24, width, height);
+
+		glGenRenderbuffers(1, &colorBuffer);
+		glBindRenderbuffer(GL_RENDERBUFFER, colorBuffer);
+		glRenderbufferStorageMultisample(GL_RENDERBUFFER, count, GL_RGBA8, width, height);
+
+		glGenFramebuffers(1, &drawFBO);
+		glBindFramebuffer(GL_FRAMEBUFFER, drawFBO);
+		glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, colorBuffer);
+	}
+	else {
+		glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
 	}
-	if(VBOP > 0) {
-		glDeleteVertexArrays(1, &VBOP);
-		VBOP = 0;
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depthBuffer);
+	glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+	bool complete = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+	glBindFramebuffer(GL_FRAMEBUFFER, resolveFBO);
+	complete = complete && glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+	if(!complete) {
+		Release();
+		failedWidth = width;
+		failedHeight = height;
+		failedSamples = samples;
 	}
+	return complete;
+}
+//---------------------------------------------------------------------------
 
-	if(pointList.size() > 0) {
-
-		glGenVertexArrays(1, &VAOP);
-		glBindVertexArray(VAOP);
+void __fastcall GLRenderTarget::Bind()
+{
+	/// Draw to the target, the multisample framebuffer if there is one
 
-		// point buffer is GL_DYNAMIC_DRAW to allow changes to color for highlighting
-		glGenBuffers(1, &VBOP);
-		glBindBuffer(GL_ARRAY_BUFFER, VBOP);
-		glBufferData(GL_ARRAY_BUFFER, pointList.size() * sizeof(GLBillboardQuad), pointList.data(), GL_DYNAMIC_DRAW);
+	glBindFramebuffer(GL_FRAMEBUFFER, drawFBO > 0 ? drawFBO : resolveFBO);
+}
+//---------------------------------------------------------------------------
 
+void __fastcall GLRenderTarget::Resolve()
+{
+	/// Copy the multisampled frame into the texture
+	/// Leaves the default framebuffer bound
 
-		// position
-		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(GLBillboardVertex), (void*)0);
-		glEnableVertexAttribArray(0);
+	if(drawFBO > 0) {
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, drawFBO);
+		glBindFramebuffer(GL_DRAW_FRAMEBUFFER, resolveFBO);
+		glBlitFramebuffer(0, 0, targetWidth, targetHeight, 0, 0, targetWidth, targetHeight, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+	}
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+//---------------------------------------------------------------------------
+//---------------------------------------------------------------------------
 
-		// center
-		glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(GLBillboardVertex), (void*)(3 * sizeof(float)));
-		glEnableVertexAttribArray(1);
+GLScreenPass::GLScreenPass(const char* fragmentsource)
+{
+	/// Constructor
+	/// Creates the pass shader from the screen vertex shader and fragmentsource
 
-		// color
-		glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(GLBillboardVertex), (void*)(6 * sizeof(float)));
-		glEnableVertexAttribArray(2);
+	passShader = CreateShader(screenVertexSource, fragmentsource);
+	uvScaleLoc = glGetUniformLocation(passShader, "uvScale");
+	texelSizeLoc = glGetUniformLocation(passShader, "texelSize");
 
-		// texture coord
-		glVertexAttribPointer(3, 2, GL_FLOAT, GL_FALSE, sizeof(GLBillboardVertex), (void*)(9 * sizeof(float)));
-		glEnableVertexAttribArray(3);
+	// core profile draws need a vertex array even with no attributes
+	glGenVertexArrays(1, &emptyArray);
+}
+//---------------------------------------------------------------------------
 
-		glBindVertexArray(0);
-		glBindBuffer(GL_ARRAY_BUFFER, 0);
-	}
+GLScreenPass::~GLScreenPass()
+{
+	/// Destructor
+	glDeleteVertexArrays(1, &emptyArray);
+	glDeleteProgram(passShader);
 }
 //---------------------------------------------------------------------------
 
-void __fastcall GLFont::Render2D(GLFWwindow* window)
+void __fastcall GLScreenPass::Draw(GLStateCache& state, unsigned int texture, int texwidth, int texheight, int width, int height)
 {
-	/// Render 2D text
+	/// Draw the lower left width x height of a texwidth x texheight texture over the viewport
+	/// Depth test, culling and blending are turned off
 
-	if(text2DChanged) {
-		Create2DArrays();
-		text2DChanged = false;
-	}
+	if(texwidth <= 0 || texheight <= 0) return;
 
-	if(quad2DList.size() > 0) {
+	state.Enable(GL_DEPTH_TEST, false);
+	state.Enable(GL_CULL_FACE, false);
+	state.Enable(GL_BLEND, false);
+	state.UseProgram(passShader);
+	state.BindTexture(0, texture);
+	state.BindVertexArray(emptyArray);
 
-		glDisable(GL_CULL_FACE);
-		glDisable(GL_DEPTH_TEST);
+	glUniform2f(uvScaleLoc, (float)width / texwidth, (float)height / texheight);
+	glUniform2f(texelSizeLoc, 1.0f / texwidth, 1.0f / texheight);
+	glDrawArrays(GL_TRIANGLES, 0, 3);
+}
+//---------------------------------------------------------------------------
+//---------------------------------------------------------------------------
 
-		glEnable(GL_BLEND);
-		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+GLFrameCapture::GLFrameCapture(int buffers)
+{
+	/// Constructor
+	/// buffers is the number of reads that can be in progress, buffers are made by
+	/// the first reads that use them
 
-		// orthogonal projection
-		const GLfloat left = 0.0f;
-		const GLfloat right = 1.0f;
-		const GLfloat bottom = 0.0f;
-		const GLfloat top = 1.0f;
-		const GLfloat zNear = -1.0f;
-		const GLfloat zFar = 1.0f;
+	slots.resize(std::max(buffers, 1), GLCaptureSlot{ 0, 0, 0, 0, 0, nullptr });
+	next = 0;
+}
+//---------------------------------------------------------------------------
 
-		const GLfloat p[16] = {
-			(2.0f / (right - left)), 0.0f, 0.0f, 0.0f,
-			0.0f, (2.0f / (top - bottom)), 0.0f, 0.0f,
-			0.0f, 0.0f, (-2.0f / (zFar - zNear)), 0.0f,
+GLFrameCapture::~GLFrameCapture()
+{
+	/// Destructor deletes buffers
 
-			-((right + left) / (right - left)),
-			-((top + bottom) / (top - bottom)),
-			-((zFar + zNear) / (zFar - zNear)),
-			1.0f,
-		};
+	Release();
+}
+//---------------------------------------------------------------------------
 
-		glUseProgram(billboardShader);
+void __fastcall GLFrameCapture::Release()
+{
+	/// Delete buffers and fences, reads in progress are dropped without calling back
 
-		// projection matrix
-		int pvm_loc = glGetUniformLocation(billboardShader, "pvm");
-		glUniformMatrix4fv(pvm_loc, 1, GL_FALSE, p);
+	for(GLCaptureSlot& slot : slots) {
+		if(slot.fence != 0) glDeleteSync(slot.fence);
+		if(slot.PBO > 0) glDeleteBuffers(1, &slot.PBO);
+		slot = GLCaptureSlot{ 0, 0, 0, 0, 0, nullptr };
+	}
+	next = 0;
+}
+//---------------------------------------------------------------------------
 
-		// scale factor to correct for distortion from screen size
-		int width, height;
-		glfwGetWindowSize(window, &width, &height);
-		int scale_loc = glGetUniformLocation(billboardShader, "xscale");
-		glUniform1f(scale_loc, (float)height/(float)width);
+bool __fastcall GLFrameCapture::Pending()
+{
+	/// True if a read has not been handed to its callback yet
 
-		glActiveTexture(GL_TEXTURE0);
-		glBindTexture(GL_TEXTURE_2D, fontTexture.textureID);
-		glBindVertexArray(VAO2D);
+	for(GLCaptureSlot& slot : slots) {
+		if(slot.fence != 0) return true;
+	}
+	return false;
+}
+//---------------------------------------------------------------------------
 
-		glDrawArrays(GL_TRIANGLES, 0, quad2DList.size() * 6);
+void __fastcall GLFrameCapture::Read(unsigned int framebuffer, int width, int height, TGLCaptureEvent callback, TOpenGLWindow* sender)
+{
+	/// Start reading width x height BGRA pixels of framebuffer into the next buffer
+	/// callback gets the pixels when Poll finds the read finished
+	/// If the buffer's earlier read is still in progress it is waited for and handed
+	/// over first, which only happens when the GPU is more frames behind than there
+	/// are buffers
+
+	if(width <= 0 || height <= 0) return;
+
+	GLCaptureSlot& slot = slots[next];
+	next = (next + 1) % slots.size();
+	if(slot.fence != 0) Finish(slot, sender, true);
+
+	int size = width * height * 4;
+	if(slot.PBO == 0) glGenBuffers(1, &slot.PBO);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.PBO);
+	if(size != slot.size) {
+		glBufferData(GL_PIXEL_PACK_BUFFER, size, NULL, GL_STREAM_READ);
+		slot.size = size;
 	}
 
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffer);
+	glReadPixels(0, 0, width, height, GL_BGRA, GL_UNSIGNED_BYTE, 0);
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+	slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	slot.width = width;
+	slot.height = height;
+	slot.callback = callback;
 }
 //---------------------------------------------------------------------------
 
-void __fastcall GLFont::Render3D(GLFWwindow* window, glm::mat4& pvm, bool depthtext)
+void __fastcall GLFrameCapture::Poll(TOpenGLWindow* sender)
 {
-	/// Render 3D text
-	/// Uses projection matrix (pvm) from camera
+	/// Hand finished reads to their callbacks, oldest first, without waiting
 
-	glDisable(GL_CULL_FACE);
+	for(int i=0; i<slots.size(); i++) {
+		GLCaptureSlot& slot = slots[(next + i) % slots.size()];
+		if(slot.fence == 0) continue;
+		if(!Finish(slot, sender, false)) break;   // later reads have not finished either
+	}
+}
+//---------------------------------------------------------------------------
 
-	if(depthtext) glEnable(GL_DEPTH_TEST);
-    else glDisable(GL_DEPTH_TEST);
+bool __fastcall GLFrameCapture::Finish(GLCaptureSlot& slot, TOpenGLWindow* sender, bool wait)
+{
+	/// Map a finished read and pass it to its callback, the buffer is kept for reuse
+	/// Returns false if the read has not finished and wait is not set
 
-	glEnable(GL_BLEND);
-	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	if(wait) {
+		glClientWaitSync(slot.fence, GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+	}
+	else {
+		GLenum result = glClientWaitSync(slot.fence, 0, 0);
+		if(result != GL_ALREADY_SIGNALED && result != GL_CONDITION_SATISFIED) return false;
+	}
+	glDeleteSync(slot.fence);
+	slot.fence = 0;
+
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.PBO);
+	void* pixels = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, slot.size, GL_MAP_READ_BIT);
+	if(pixels != nullptr) {
+		if(slot.callback != nullptr) slot.callback(sender, (const unsigned char*)pixels, slot.width, slot.height);
+		glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+	}
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	return true;
+}
+//---------------------------------------------------------------------------
+//---------------------------------------------------------------------------
 
-	if(text3DChanged) {
-		Create3DArrays();
-		text3DChanged = false;
+GLBoxQuery::GLBoxQuery()
+	: boxArray(3 * sizeof(float))
+{
+	/// Constructor
+	/// Creates the box shader and a cube from -1 to 1 as 12 triangles
+
+	static const int corners[36] = { 0, 1, 3,  0, 3, 2,  4, 6, 7,  4, 7, 5,
+									 0, 4, 5,  0, 5, 1,  2, 3, 7,  2, 7, 6,
+									 0, 2, 6,  0, 6, 4,  1, 5, 7,  1, 7, 3 };
+	float cube[36 * 3];
+	for(int v=0; v<36; v++) {
+		cube[v * 3] = (corners[v] & 1) ? 1.0f : -1.0f;
+		cube[v * 3 + 1] = (corners[v] & 2) ? 1.0f : -1.0f;
+		cube[v * 3 + 2] = (corners[v] & 4) ? 1.0f : -1.0f;
 	}
 
-	if(quad3DList.size() > 0 || pointList.size() > 0) {
+	glGenBuffers(1, &boxBuffer);
+	glBindBuffer(GL_ARRAY_BUFFER, boxBuffer);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(cube), cube, GL_STATIC_DRAW);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
 
-		glUseProgram(billboardShader);
+	boxArray.Attribute(0, 3, 0);   // position
+	boxArray.Attach(boxBuffer);
 
-		// projection matrix
-		int pvm_loc = glGetUniformLocation(billboardShader, "pvm");
-		glUniformMatrix4fv(pvm_loc, 1, GL_FALSE, glm::value_ptr(pvm));
+	boxShader = CreateShader(boxVertexSource, boxFragmentSource);
+	centerLoc = glGetUniformLocation(boxShader, "center");
+	extentLoc = glGetUniformLocation(boxShader, "extent");
 
-		// scale factor to correct for distortion from screen size
-		int width, height;
-		glfwGetWindowSize(window, &width, &height);
-		int scale_loc = glGetUniformLocation(billboardShader, "xscale");
-		glUniform1f(scale_loc, (float)height/(float)width);
-	}
+	eyeMargin = 0.0f;
+}
+//---------------------------------------------------------------------------
 
-	if(quad3DList.size() > 0) {
+GLBoxQuery::~GLBoxQuery()
+{
+	/// Destructor
+	boxArray.Release();
+	glDeleteBuffers(1, &boxBuffer);
+	glDeleteProgram(boxShader);
+}
+//---------------------------------------------------------------------------
 
-		// draw text triangles
-		glActiveTexture(GL_TEXTURE0);
-		glBindTexture(GL_TEXTURE_2D, fontTexture.textureID);
-		glBindVertexArray(VAO3D);
+void __fastcall GLBoxQuery::Begin(GLStateCache& state, const glm::vec3& eye, float margin)
+{
+	/// Set state for drawing boxes with depth test but no color or depth writes
+	/// Boxes within margin of eye are not tested as their faces may be clipped by the near plane
+
+	eyePos = eye;
+	eyeMargin = margin;
+
+	state.UseProgram(boxShader);
+	boxArray.Bind(state);
+	state.Enable(GL_CULL_FACE, false);
+	state.Enable(GL_DEPTH_TEST, true);
+	glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+	glDepthMask(GL_FALSE);
+	glDepthFunc(GL_LEQUAL);
+}
+//---------------------------------------------------------------------------
 
-		glDrawArrays(GL_TRIANGLES, 0, quad3DList.size() * 6);
-	}
+bool __fastcall GLBoxQuery::Test(unsigned int query, const glm::vec3& center, const glm::vec3& extent)
+{
+	/// Draw a box inside an any samples passed query
+	/// The box is enlarged slightly so flat chunks do not hide themselves
+	/// Returns false without a query if the eye is inside the box
 
-	if(pointList.size() > 0) {
+	float pad = std::max(extent.x, std::max(extent.y, extent.z)) * 0.01f + 1e-4f;
+	glm::vec3 padded = extent + glm::vec3(pad);
 
-        // draw dots
-		glActiveTexture(GL_TEXTURE0);
-		glBindTexture(GL_TEXTURE_2D, pointTexture.textureID);
-		glBindVertexArray(VAOP);
+	glm::vec3 toeye = glm::abs(eyePos - center);
+	if(glm::all(glm::lessThanEqual(toeye, padded + glm::vec3(eyeMargin)))) return false;
 
-		glDrawArrays(GL_TRIANGLES, 0, pointList.size() * 6);
-	}
+	glUniform3fv(centerLoc, 1, glm::value_ptr(center));
+	glUniform3fv(extentLoc, 1, glm::value_ptr(padded));
 
+	glBeginQuery(GL_ANY_SAMPLES_PASSED, query);
+	glDrawArrays(GL_TRIANGLES, 0, 36);
+	glEndQuery(GL_ANY_SAMPLES_PASSED);
+	return true;
 }
 //---------------------------------------------------------------------------
 
-static bool RaySphere(glm::vec3& rayorigin, glm::vec3& raydir, glm::vec3& sphere, float radius, float& mindist)
+void __fastcall GLBoxQuery::End()
 {
-	/// Find intersection between ray and sphere
-	/// Returns true if intersection found less than mindist away
+	/// Restore color and depth writes
 
-   float a, b, c;
-   float bb4ac;
+	glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+	glDepthMask(GL_TRUE);
+	glDepthFunc(GL_LESS);
+}
+//---------------------------------------------------------------------------
+//---------------------------------------------------------------------------
 
-   a = raydir.x * raydir.x + raydir.y * raydir.y + raydir.z * raydir.z;
-   b = 2 * (raydir.x * (rayorigin.x - sphere.x) + raydir.y * (rayorigin.y - sphere.y) + raydir.z * (rayorigin.z - sphere.z));
-   c = sphere.x * sphere.x + sphere.y * sphere.y + sphere.z * sphere.z;
-   c += rayorigin.x * rayorigin.x + rayorigin.y * rayorigin.y + rayorigin.z * rayorigin.z;
-   c -= 2 * (sphere.x * rayorigin.x + sphere.y * rayorigin.y + sphere.z * rayorigin.z);
-   c -= radius * radius;
-   bb4ac = b * b - 4 * a * c;
+GLCommandQueue::GLCommandQueue(int size)
+	: ring(size)
+{
+	/// Constructor
+	/// One slot is always left empty to tell a full ring from an empty one
 
-   if (fabs(a) < 1e-20 || bb4ac < 0) {
-	  return false;
-   }
+	head = 0;
+	tail = 0;
+}
+//---------------------------------------------------------------------------
 
-   float mu1 = (-b + sqrt(bb4ac)) / (2 * a);
-   float mu2 = (-b - sqrt(bb4ac)) / (2 * a);
+bool __fastcall GLCommandQueue::Push(std::function<void()>& command)
+{
+	/// Add command at the tail, only called by the writing thread
+	/// Returns false if the ring is full
 
-   float dist;
-   if(mu1 < mu2) dist = mu1;
-   else dist = mu2;
+	int slot = tail;
+	int next = (slot + 1) % ring.size();
+	if(next == head) return false;
 
-   if(dist < mindist) {
-	   mindist = dist;
-	   return true;
-   }
+	ring[slot] = std::move(command);
+	tail = next;   // command visible to the reader
+	return true;
+}
+//---------------------------------------------------------------------------
 
-   return false;
+bool __fastcall GLCommandQueue::Pop(std::function<void()>& command)
+{
+	/// Take command from the head, only called by the reading thread
+	/// Returns false if the ring is empty
+
+	int slot = head;
+	if(slot == tail) return false;
+
+	command = std::move(ring[slot]);
+	ring[slot] = nullptr;
+	head = (slot + 1) % ring.size();   // slot free for the writer
+	return true;
 }
 //---------------------------------------------------------------------------
+//---------------------------------------------------------------------------
 
-int __fastcall GLFont::PickPoint(glm::vec3& raystart, glm::vec3& raydir, float& mindist)
+GLFrameTimer::GLFrameTimer(int samples)
 {
-	/// Finds point intersected by ray and closer than mindist
+	/// Constructor
+	/// samples is the number of frames kept for the statistics
+	/// Query objects are created at the first frame when the context is current
+
+	maxSamples = samples;
+	presented = false;
+	queryNext = 0;
+	queryActive = false;
+	gpuLatest = 0.0;
+	gpuFresh = false;
+	for(int q=0; q<queryCount; q++) {
+		queries[q] = 0;
+		queryPending[q] = false;
+	}
+}
+//---------------------------------------------------------------------------
 
-	int minp = -1;
-	for(int p=0; p<pointList.size(); p++) {
-		GLBillboardQuad& quad = pointList[p];
-		glm::vec3 circle(quad.tri1[0].center[0], quad.tri1[0].center[1], quad.tri1[0].center[2]);
-		if(RaySphere(raystart, raydir, circle, pointSize, mindist)) {
-			minp = p;
+GLFrameTimer::~GLFrameTimer()
+{
+	/// Destructor deletes queries
+
+	Release();
+}
+//---------------------------------------------------------------------------
+
+void __fastcall GLFrameTimer::Release()
+{
+	/// Delete query objects while the context is current
+
+	if(queries[0] > 0) glDeleteQueries(queryCount, queries);
+	for(int q=0; q<queryCount; q++) {
+		queries[q] = 0;
+		queryPending[q] = false;
+	}
+	queryActive = false;
+}
+//---------------------------------------------------------------------------
+
+void __fastcall GLFrameTimer::BeginFrame()
+{
+	/// Start timing a frame
+	/// Results of earlier GPU queries are collected if they are available
+	/// If all queries are still waiting for the GPU this frame is not GPU timed
+
+	frameStart = std::chrono::steady_clock::now();
+	if(queries[0] == 0) glGenQueries(queryCount, queries);
+
+	for(int q=0; q<queryCount; q++) {
+		if(!queryPending[q]) continue;
+
+		GLuint available = 0;
+		glGetQueryObjectuiv(queries[q], GL_QUERY_RESULT_AVAILABLE, &available);
+		if(available) {
+			GLuint64 elapsed = 0;
+			glGetQueryObjectui64v(queries[q], GL_QUERY_RESULT, &elapsed);
+			std::lock_guard<std::mutex> lock(mutex);
+			AddSample(gpuTimes, elapsed / 1000000.0);
+			queryPending[q] = false;
+			gpuLatest = elapsed / 1000000.0;
+			gpuFresh = true;
 		}
 	}
-	return minp;
+
+	queryActive = !queryPending[queryNext];
+	if(queryActive) glBeginQuery(GL_TIME_ELAPSED, queries[queryNext]);
 }
 //---------------------------------------------------------------------------
 
-void __fastcall GLFont::SetPointColor(int point, glm::vec3& color)
+void __fastcall GLFrameTimer::EndFrame()
 {
-	/// Sets the color of a point
+	/// Stop timing before the buffers are swapped
 
-	if(point < 0 || point >= pointList.size()) return;
+	if(queryActive) {
+		glEndQuery(GL_TIME_ELAPSED);
+		queryPending[queryNext] = true;
+		queryNext = (queryNext + 1) % queryCount;
+		queryActive = false;
+	}
 
-	glBindVertexArray(VAOP);
-	glBindBuffer(GL_ARRAY_BUFFER, VBOP);
+	std::chrono::duration<double, std::milli> cpu = std::chrono::steady_clock::now() - frameStart;
+	std::lock_guard<std::mutex> lock(mutex);
+	AddSample(cpuTimes, cpu.count());
+}
+//---------------------------------------------------------------------------
 
-	GLBillboardQuad& quad = pointList[point];
-	memcpy(quad.tri1[0].color, glm::value_ptr(color), sizeof(glm::vec3));
-	memcpy(quad.tri1[1].color, glm::value_ptr(color), sizeof(glm::vec3));
-	memcpy(quad.tri1[2].color, glm::value_ptr(color), sizeof(glm::vec3));
-	memcpy(quad.tri2[0].color, glm::value_ptr(color), sizeof(glm::vec3));
-	memcpy(quad.tri2[1].color, glm::value_ptr(color), sizeof(glm::vec3));
-	memcpy(quad.tri2[2].color, glm::value_ptr(color), sizeof(glm::vec3));
-	glBufferSubData(GL_ARRAY_BUFFER, point * sizeof(GLBillboardQuad), sizeof(GLBillboardQuad), &quad);
+void __fastcall GLFrameTimer::Presented()
+{
+	/// Record the time since the last frame was presented
+
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	if(presented) {
+		std::chrono::duration<double, std::milli> frame = now - lastPresent;
+		std::lock_guard<std::mutex> lock(mutex);
+		AddSample(frameTimes, frame.count());
+	}
+	lastPresent = now;
+	presented = true;
 }
 //---------------------------------------------------------------------------
 
-glm::vec3 __fastcall GLFont::GetPointColor(int point)
+bool __fastcall GLFrameTimer::LatestGPU(double& ms)
 {
-	/// Gets the color of a point
+	/// GPU time of the most recent frame whose query has been read
+	/// Returns false if no new time has been read since the last call
+	/// Called on the thread that draws
+
+	if(!gpuFresh) return false;
+	ms = gpuLatest;
+	gpuFresh = false;
+	return true;
+}
+//---------------------------------------------------------------------------
 
-	if(point < 0 || point >= pointList.size()) return glm::vec3(0.0f, 0.0f, 0.0f);
+void __fastcall GLFrameTimer::AddSample(std::deque<double>& times, double ms)
+{
+	// oldest sample dropped when full
+	times.push_back(ms);
+	if(times.size() > maxSamples) times.pop_front();
+}
+//---------------------------------------------------------------------------
 
-	glm::vec3 color;
-	GLBillboardQuad& quad = pointList[point];
-	memcpy(glm::value_ptr(color), quad.tri1[0].color, sizeof(glm::vec3));
-	return color;
+GLFrameStats __fastcall GLFrameTimer::Stats()
+{
+	/// Average, percentiles and maximum of the recorded times
+	/// Frames skipped by on demand rendering count as long frame times
+
+	std::lock_guard<std::mutex> lock(mutex);
+
+	GLFrameStats stats;
+	stats.frame = Summarize(frameTimes);
+	stats.cpu = Summarize(cpuTimes);
+	stats.gpu = Summarize(gpuTimes);
+	stats.samples = cpuTimes.size();
+	stats.gpuSamples = gpuTimes.size();
+	return stats;
 }
 //---------------------------------------------------------------------------
 
+GLTimeStats __fastcall GLFrameTimer::Summarize(std::deque<double>& times)
+{
+	GLTimeStats stats;
+	if(times.size() == 0) return stats;
+
+	std::vector<double> sorted(times.begin(), times.end());
+	std::sort(sorted.begin(), sorted.end());
+
+	double total = 0.0;
+	for(double t : sorted) total += t;
+
+	int last = sorted.size() - 1;
+	stats.average = total / sorted.size();
+	stats.p50 = sorted[std::min(last, (int)(sorted.size() * 0.50))];
+	stats.p95 = sorted[std::min(last, (int)(sorted.size() * 0.95))];
+	stats.p99 = sorted[std::min(last, (int)(sorted.size() * 0.99))];
+	stats.max = sorted[last];
+	return stats;
+}
+//---------------------------------------------------------------------------
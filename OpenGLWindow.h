@@ -15,6 +15,13 @@
 #include <string>
 #include <functional>
 #include <map>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
 
 #include "glad/glad.h"
 #define GLFW_INCLUDE_NONE
@@ -33,8 +40,13 @@ typedef void __fastcall (__closure *TGLResizeEvent)(TOpenGLWindow* Sender, int w
 typedef void __fastcall (__closure *TGLMouseButtonEvent)(TOpenGLWindow* Sender, int button, int action, int mods);
 typedef void __fastcall (__closure *TGLMousePositionEvent)(TOpenGLWindow* Sender, double x, double y);
 typedef void __fastcall (__closure *TGLMouseScrollEvent)(TOpenGLWindow* Sender, double delta);
+typedef void __fastcall (__closure *TGLCaptureEvent)(TOpenGLWindow* Sender, const unsigned char* pixels, int width, int height);
 
 enum class GLTextPos { LEFT, CENTER, RIGHT, ABOVE, BELOW };
+enum class GLTextureBatching { NONE, MULTIDRAW, ARRAY };
+enum class GLFramePacing { VSYNC, ADAPTIVE, UNCAPPED, TARGET };
+enum class GLWindowMode { VISIBLE, OFFSCREEN };
+enum class GLCulling { CPU, GPU };
 
 //---------------------------------------------------------------------------
 //---------------------------------------------------------------------------
@@ -56,6 +68,15 @@ struct GLTextureVertex {
 };
 //---------------------------------------------------------------------------
 
+struct GLBatchVertex {
+	float pos[3];
+	float norm[3];
+	float color[3];
+	float tex[2];
+	float layer;
+};
+//---------------------------------------------------------------------------
+
 struct GLBillboardVertex {
 	float pos[3];
 	float center[3];
@@ -82,6 +103,12 @@ struct GLTextureTriangle
 };
 //---------------------------------------------------------------------------
 
+struct GLBatchTriangle
+{
+	GLBatchVertex vert[3];
+};
+//---------------------------------------------------------------------------
+
 struct GLBillboardQuad
 {
 	GLBillboardVertex tri1[3];
@@ -89,6 +116,29 @@ struct GLBillboardQuad
 };
 //---------------------------------------------------------------------------
 
+// Camera and light state copied to the Scene uniform block
+// std140 layout, vec3 values are padded to vec4
+
+struct GLSceneUniforms
+{
+	float pvm[16];
+	float lightDir[4];
+	float lightColor[4];
+	float ambientColor[4];
+	int tiles[4];   // light tiles across and down, point light count
+};
+//---------------------------------------------------------------------------
+
+// Light shining in all directions from a point, fading to nothing at radius
+
+struct GLPointLight
+{
+	glm::vec3 position;
+	glm::vec3 color;
+	float radius;
+};
+//---------------------------------------------------------------------------
+
 enum class GLPickType { NONE, COLOR, TRIANGLE, POINT };
 struct GLPickResult
 {
@@ -123,19 +173,639 @@ struct GLPickResult
 		return false;
 	}
 };
+//---------------------------------------------------------------------------
+
+// Counts and timings of the last frame drawn
+
+struct GLRenderStats
+{
+	int stateIssued;        // state changes made
+	int stateSkipped;       // state changes skipped as redundant
+	int chunksTested;       // chunk bounding boxes tested against the view frustum
+	int chunksVisible;      // chunks inside or crossing the view frustum
+	int trianglesVisible;   // triangles in visible chunks
+	int chunksOccluded;     // chunks in the frustum hidden by other triangles in an earlier frame
+	int trianglesOccluded;  // triangles in occluded chunks
+	int trianglesTotal;     // triangles in all chunks
+	double occludedPercent; // percentage of triangles skipped as occluded
+	double cullTime;        // milliseconds spent culling
+	float renderScale;      // fraction of the window size the 3D pass was drawn at
+	bool targetFailed;      // a framebuffer could not be made, the frame was drawn or captured without it
+	int texturesFailed;     // textures whose file could not be loaded, drawn grey
+
+	GLRenderStats() {
+		stateIssued = stateSkipped = chunksTested = chunksVisible = trianglesVisible = 0;
+		chunksOccluded = trianglesOccluded = trianglesTotal = 0;
+		occludedPercent = cullTime = 0.0;
+		renderScale = 1.0f;
+		targetFailed = false;
+		texturesFailed = 0;
+	}
+};
 //---------------------------------------------------------------------------
  //---------------------------------------------------------------------------
 
+// Upload work done on a loader thread with a context shared with the window
+// The fence is set after the work so the renderer can tell when the GPU has the data
+
+struct GLUploadJob
+{
+	std::function<void()> work;
+	GLsync fence;
+	std::atomic<bool> done;
+};
+//---------------------------------------------------------------------------
+
+class GLUploadThread
+{
+public:
+	GLUploadThread(GLFWwindow* share);
+	~GLUploadThread();
+
+	std::shared_ptr<GLUploadJob> __fastcall Post(std::function<void()> work);
+	static bool __fastcall IsComplete(GLUploadJob& job);
+	static void __fastcall Wait(GLUploadJob& job);
+	bool __fastcall Running() { return thread.joinable(); }
+
+private:
+	GLFWwindow* context;
+	std::thread thread;
+	std::mutex mutex;
+	std::condition_variable signal;
+	std::deque<std::shared_ptr<GLUploadJob>> jobs;
+	bool stop;
+
+	void __fastcall Run();
+};
+//---------------------------------------------------------------------------
+
+// Uploads queued each frame and run in priority order within a byte and time budget
+
+struct GLUploadRequest
+{
+	float priority;
+	std::function<void()> upload;
+};
+//---------------------------------------------------------------------------
+
+class GLUploadScheduler
+{
+public:
+	GLUploadScheduler();
+
+	void __fastcall SetBudget(int bytes, double milliseconds);
+	void __fastcall Queue(float priority, std::function<void()> upload);
+	void __fastcall Drain();
+	long long __fastcall Take(long long bytes, int granularity);
+	bool __fastcall Limited() { return budgetBytes > 0 || budgetTime > 0.0; }
+	bool __fastcall Queued() { return requests.size() > 0; }
+
+	static const long long timeChunk = 1024 * 1024;   // most bytes given to one upload under a time budget
+
+private:
+	long long budgetBytes;
+	double budgetTime;
+	long long remainingBytes;
+	bool granted;   // an upload has been given budget this frame
+	std::chrono::steady_clock::time_point startTime;
+	std::vector<GLUploadRequest> requests;
+};
+//---------------------------------------------------------------------------
+
+// Ring of commands written by one thread and run by another
+// Neither side takes a lock, the writer only waits when the ring is full
+
+class GLCommandQueue
+{
+public:
+	GLCommandQueue(int size);
+	GLCommandQueue(const GLCommandQueue&) = delete;
+	GLCommandQueue& operator=(const GLCommandQueue&) = delete;
+
+	bool __fastcall Push(std::function<void()>& command);
+	bool __fastcall Pop(std::function<void()>& command);
+	bool __fastcall Empty() { return head == tail; }
+
+private:
+	std::vector<std::function<void()>> ring;
+	std::atomic<int> head;   // next command to run, only written by the reader
+	std::atomic<int> tail;   // next free slot, only written by the writer
+};
+//---------------------------------------------------------------------------
+
+// Vertex buffer that only uploads elements appended since the last upload
+// Storage grows geometrically so appending does not reallocate every time
+
+class GLVertexBuffer
+{
+public:
+	GLVertexBuffer(int elementsize, GLenum bufferusage);
+	~GLVertexBuffer();
+	GLVertexBuffer(const GLVertexBuffer&) = delete;
+	GLVertexBuffer& operator=(const GLVertexBuffer&) = delete;
+
+	bool __fastcall Upload(const void* data, int count, GLUploadThread* loader = nullptr, GLUploadScheduler* scheduler = nullptr);
+	void __fastcall MarkDirty(int first, int count);
+	void __fastcall Invalidate();
+	void __fastcall Release();
+	void __fastcall Finish() { if(pendingJob) GLUploadThread::Wait(*pendingJob); }
+	int  __fastcall Count() { return clean; }
+	bool __fastcall Pending() { return (bool)pendingJob; }
+	unsigned int __fastcall Generation() { return generation; }
+
+	unsigned int buffer;
+
+private:
+	unsigned int generation;   // changed whenever buffer is replaced by a new object
+	int elementSize;
+	GLenum usage;
+	int capacity;   // number of elements allocated in buffer
+	int clean;      // number of elements at start of buffer that match the data
+	std::vector<std::pair<int, int>> dirty;   // first element and count of edited ranges
+
+	// upload running on loader thread
+	std::shared_ptr<GLUploadJob> pendingJob;
+	unsigned int pendingBuffer;
+	int pendingCapacity;
+	int pendingCount;
+	bool pendingStale;   // Invalidate called while uploading
+
+	void __fastcall FlushDirty(const void* data);
+	void __fastcall UploadAsync(const void* data, int count, GLUploadThread* loader);
+	bool __fastcall FinishAsync();
+};
+//---------------------------------------------------------------------------
+
+// Tracks state set through it so calls that would not change anything are skipped
+// Bindings made directly with GL must be forgotten with InvalidateBindings
+
+class GLStateCache
+{
+public:
+	GLStateCache();
+
+	void __fastcall Enable(GLenum cap, bool enable);
+	void __fastcall CullFace(GLenum mode);
+	void __fastcall BlendFunc(GLenum src, GLenum dst);
+	void __fastcall UseProgram(unsigned int shader);
+	void __fastcall BindVertexArray(unsigned int vao);
+	void __fastcall BindTexture(int unit, unsigned int texture, GLenum target = GL_TEXTURE_2D);
+	void __fastcall Invalidate();
+	void __fastcall InvalidateBindings();
+	void __fastcall EndFrame();
+	int  __fastcall Issued() { return lastIssued; }
+	int  __fastcall Skipped() { return lastSkipped; }
+
+private:
+	static const unsigned int unknownState = 0xFFFFFFFF;
+
+	std::map<GLenum, bool> caps;
+	GLenum cullMode;
+	GLenum blendSrc;
+	GLenum blendDst;
+	unsigned int program;
+	unsigned int vertexArray;
+	int activeUnit;
+	unsigned int textures[16];
+	unsigned int textureArrays[16];
+	unsigned int textureBuffers[16];
+
+	// calls in the frame being drawn and in the last complete frame
+	int issued;
+	int skipped;
+	int lastIssued;
+	int lastSkipped;
+};
+//---------------------------------------------------------------------------
+
+// Vertex array kept for the lifetime of a group
+// The attribute format is described once, the buffer is attached again when it is reallocated
+
+struct GLVertexAttribute
+{
+	int index;
+	int components;
+	int offset;
+};
+//---------------------------------------------------------------------------
+
+class GLVertexArray
+{
+public:
+	GLVertexArray(int vertexsize);
+	~GLVertexArray();
+	GLVertexArray(const GLVertexArray&) = delete;
+	GLVertexArray& operator=(const GLVertexArray&) = delete;
+
+	void __fastcall Attribute(int index, int components, int offset);
+	void __fastcall Attach(unsigned int vertexbuffer);
+	void __fastcall Bind(GLStateCache& state) { state.BindVertexArray(VAO); }
+	void __fastcall Release();
+	bool __fastcall Ready() { return VAO > 0 && buffer > 0; }
+	unsigned int __fastcall Buffer() { return buffer; }
+
+private:
+	int vertexSize;
+	unsigned int VAO;
+	unsigned int buffer;   // attached vertex buffer
+	std::vector<GLVertexAttribute> attributes;
+};
+//---------------------------------------------------------------------------
+
+// Ring buffer for vertex data that changes every frame
+// Written with unsynchronized maps, data written in a frame is guarded by a fence
+
+struct GLStreamRegion
+{
+	int start;
+	int end;
+	GLsync fence;
+};
+//---------------------------------------------------------------------------
+
+class GLStreamBuffer
+{
+public:
+	GLStreamBuffer(int size);
+	~GLStreamBuffer();
+	GLStreamBuffer(const GLStreamBuffer&) = delete;
+	GLStreamBuffer& operator=(const GLStreamBuffer&) = delete;
+
+	int  __fastcall Write(const void* data, int size, int alignment);
+	void __fastcall EndFrame();
+	void __fastcall Release();
+
+	unsigned int buffer;
+
+private:
+	int bufferSize;
+	int head;     // byte after last write
+	std::deque<GLStreamRegion> regions;   // written ranges the GPU may still read, oldest first
+
+	bool __fastcall IsFree(int start, int end);
+	bool __fastcall ReleaseOldest();
+	void __fastcall ReleaseRegions();
+	void __fastcall Orphan();
+};
+//---------------------------------------------------------------------------
+
+// Summary of the times in milliseconds recorded over the last frames
+
+struct GLTimeStats
+{
+	double average;
+	double p50;
+	double p95;
+	double p99;
+	double max;
+
+	GLTimeStats() { average = p50 = p95 = p99 = max = 0.0; }
+};
+//---------------------------------------------------------------------------
+
+struct GLFrameStats
+{
+	GLTimeStats frame;   // time between frames presented
+	GLTimeStats cpu;     // time spent in Render
+	GLTimeStats gpu;     // GPU time from timer queries, a few frames behind
+	int samples;
+	int gpuSamples;
+
+	GLFrameStats() { samples = gpuSamples = 0; }
+};
+//---------------------------------------------------------------------------
+
+// Rolling record of frame, CPU and GPU times
+// GPU times come from GL_TIME_ELAPSED queries read when available so timing never stalls
+
+class GLFrameTimer
+{
+public:
+	GLFrameTimer(int samples);
+	~GLFrameTimer();
+	GLFrameTimer(const GLFrameTimer&) = delete;
+	GLFrameTimer& operator=(const GLFrameTimer&) = delete;
+
+	void __fastcall BeginFrame();
+	void __fastcall EndFrame();
+	void __fastcall Presented();
+	void __fastcall Release();
+	GLFrameStats __fastcall Stats();
+	bool __fastcall LatestGPU(double& ms);
+
+	static const int queryCount = 4;   // frames the GPU may be behind
+
+private:
+	int maxSamples;
+	std::deque<double> frameTimes;
+	std::deque<double> cpuTimes;
+	std::deque<double> gpuTimes;
+	std::mutex mutex;   // stats may be read on another thread than the render thread
+
+	std::chrono::steady_clock::time_point frameStart;
+	std::chrono::steady_clock::time_point lastPresent;
+	bool presented;   // lastPresent is set
+
+	unsigned int queries[queryCount];
+	bool queryPending[queryCount];
+	int queryNext;
+	bool queryActive;   // query started this frame
+	double gpuLatest;   // most recent GPU time read
+	bool gpuFresh;      // gpuLatest not yet taken by LatestGPU
+
+	void __fastcall AddSample(std::deque<double>& times, double ms);
+	static GLTimeStats __fastcall Summarize(std::deque<double>& times);
+};
+//---------------------------------------------------------------------------
+
+// View frustum planes, stored by component so four planes are tested at once
+// Planes 6 and 7 are padding that never reject
+
+struct GLFrustum
+{
+	float nx[8];
+	float ny[8];
+	float nz[8];
+	float d[8];
+
+	void __fastcall Set(const glm::mat4& pvm);
+	bool __fastcall Intersects(const glm::vec3& center, const glm::vec3& extent);
+};
+//---------------------------------------------------------------------------
+
+// Bounding boxes drawn inside GL_ANY_SAMPLES_PASSED queries without writing color or depth
+// Results are read in a later frame so the renderer never waits for the GPU
+
+class GLBoxQuery
+{
+public:
+	GLBoxQuery();
+	~GLBoxQuery();
+	GLBoxQuery(const GLBoxQuery&) = delete;
+	GLBoxQuery& operator=(const GLBoxQuery&) = delete;
+
+	void __fastcall Begin(GLStateCache& state, const glm::vec3& eye, float margin);
+	bool __fastcall Test(unsigned int query, const glm::vec3& center, const glm::vec3& extent);
+	void __fastcall End();
+
+private:
+	unsigned int boxShader;
+	int centerLoc;   // box shader uniform locations
+	int extentLoc;
+	unsigned int boxBuffer;
+	GLVertexArray boxArray;
+	glm::vec3 eyePos;
+	float eyeMargin;   // distance from eye to the corners of the near plane
+};
+//---------------------------------------------------------------------------
+
+// Compute shader testing chunk boxes against the view frustum on the GPU, GL 4.3
+// Writes a draw command for every chunk, with no instances if it is outside, so the
+// chunks are drawn with one glMultiDrawArraysIndirect and never read back
+
+class GLCullCompute
+{
+public:
+	GLCullCompute();
+	~GLCullCompute();
+	GLCullCompute(const GLCullCompute&) = delete;
+	GLCullCompute& operator=(const GLCullCompute&) = delete;
+
+	void __fastcall Begin(GLStateCache& state, GLFrustum* frustum);
+	void __fastcall Dispatch(unsigned int boxes, unsigned int commands, int chunks, int triangles);
+	void __fastcall End();
+	bool __fastcall Culling() { return culling; }
+
+private:
+	unsigned int cullShader;
+	int planesLoc;      // cull shader uniform locations
+	int chunksLoc;
+	int trianglesLoc;
+	int cullLoc;
+	bool culling;       // frustum set at Begin
+	bool dispatched;    // commands written since Begin
+};
+//---------------------------------------------------------------------------
+
+// Occlusion query of a chunk and the last result read
+
+struct GLChunkQuery
+{
+	unsigned int query;
+	bool pending;    // result not read yet
+	bool occluded;   // no samples passed in the last result
+
+	GLChunkQuery() { query = 0; pending = occluded = false; }
+};
+//---------------------------------------------------------------------------
+
+// Triangles of a list grouped in runs of chunkSize with a bounding box for each run
+// Runs outside the view frustum, or hidden in an earlier frame, are skipped when drawing
+
+class GLChunkList
+{
+public:
+	GLChunkList();
+	~GLChunkList();
+	GLChunkList(const GLChunkList&) = delete;
+	GLChunkList& operator=(const GLChunkList&) = delete;
+
+	static const int chunkSize = 4096;
+
+	template<class T> void __fastcall Update(std::vector<T>& list);
+	void __fastcall Invalidate();
+	void __fastcall Release();
+	void __fastcall Cull(GLFrustum* frustum, GLRenderStats& stats, bool occlusion);
+	void __fastcall Query(GLBoxQuery& boxes);
+	bool __fastcall QueryPending();
+	bool __fastcall ResultsChanged() { return resultsChanged; }
+	void __fastcall Clip(int first, int last, std::vector<GLint>& drawfirst, std::vector<GLsizei>& drawcount);
+	void __fastcall CullIndirect(GLCullCompute& compute, int triangles, GLRenderStats& stats);
+	void __fastcall DrawIndirect();
+
+private:
+	std::vector<glm::vec3> centers;   // bounding box of each chunk
+	std::vector<glm::vec3> extents;
+	std::vector<GLChunkQuery> queries;   // kept when boxes are invalidated so query objects are reused
+	int counted;   // triangles included in the boxes
+	std::vector<std::pair<int, int>> visible;   // first and end triangle of visible runs
+	std::vector<int> inView;   // chunks inside the frustum at the last Cull
+	bool resultsChanged;       // a query read by the last Cull hid or showed a chunk
+
+	// GL 4.3 path, boxes read and commands written by the cull shader
+	unsigned int boxBuffer;
+	bool boxesChanged;           // boxBuffer out of date
+	unsigned int commandBuffer;
+	int commandSize;             // chunks commandBuffer has room for
+	int commandCount;            // commands written by the last CullIndirect
+};
+//---------------------------------------------------------------------------
+
+// A window's vertex array and visible chunks for a vertex buffer of the scene
+// Vertex arrays and queries belong to one context, so each window sharing a scene
+// keeps its own view of every buffer
+
+class GLBufferView
+{
+public:
+	GLBufferView(int vertexsize);
+	GLBufferView(const GLBufferView&) = delete;
+	GLBufferView& operator=(const GLBufferView&) = delete;
+
+	void __fastcall Sync(GLVertexBuffer& buffer, unsigned int layout);
+	void __fastcall Release();
+
+	GLVertexArray array;
+	GLChunkList chunks;
+	std::vector<GLint> drawFirst;   // visible ranges, kept to avoid allocation
+	std::vector<GLsizei> drawCount;
+	bool indirect;   // chunks culled on the GPU, draw with chunks.DrawIndirect
+
+private:
+	unsigned int bufferGeneration;   // buffer object attached to array
+	unsigned int chunkLayout;        // triangle order the chunks were made for
+};
+//---------------------------------------------------------------------------
+
+// Framebuffer with a color texture and depth buffer to draw into instead of the window
+// When multisampled, frames are drawn to multisample renderbuffers and resolved to the texture
+
+class GLRenderTarget
+{
+public:
+	GLRenderTarget();
+	~GLRenderTarget();
+	GLRenderTarget(const GLRenderTarget&) = delete;
+	GLRenderTarget& operator=(const GLRenderTarget&) = delete;
+
+	bool __fastcall Resize(int width, int height, int samples);
+	void __fastcall Bind();
+	void __fastcall Resolve();
+	void __fastcall Release();
+	unsigned int __fastcall Framebuffer() { return resolveFBO; }
+	unsigned int __fastcall Texture() { return colorTexture; }
+	int  __fastcall Width() { return targetWidth; }
+	int  __fastcall Height() { return targetHeight; }
+
+private:
+	int targetWidth;
+	int targetHeight;
+	int targetSamples;          // as requested, may be more than the driver allows
+	int failedWidth;            // last size and samples the framebuffer could not be made at,
+	int failedHeight;           // not tried again until a different one is asked for
+	int failedSamples;
+	unsigned int drawFBO;       // multisample framebuffer, 0 if not multisampled
+	unsigned int colorBuffer;   // multisample color renderbuffer
+	unsigned int depthBuffer;
+	unsigned int resolveFBO;    // framebuffer of colorTexture
+	unsigned int colorTexture;
+};
+//---------------------------------------------------------------------------
+
+// Draws part of a texture over the whole viewport with one triangle
+// The fragment shader reads the texture as image at uv, given the size of a texel
+
+class GLScreenPass
+{
+public:
+	GLScreenPass(const char* fragmentsource);
+	~GLScreenPass();
+	GLScreenPass(const GLScreenPass&) = delete;
+	GLScreenPass& operator=(const GLScreenPass&) = delete;
+
+	void __fastcall Draw(GLStateCache& state, unsigned int texture, int texwidth, int texheight, int width, int height);
+
+private:
+	unsigned int passShader;
+	int uvScaleLoc;     // pass shader uniform locations
+	int texelSizeLoc;
+	unsigned int emptyArray;   // vertices are made from gl_VertexID
+};
+//---------------------------------------------------------------------------
+
+// Frames read back through a ring of pixel pack buffers
+// glReadPixels into a buffer returns at once, the buffer is mapped once its fence has
+// signalled, normally one or two frames later, so reading never waits for the GPU
+
+struct GLCaptureSlot
+{
+	unsigned int PBO;
+	int size;          // bytes allocated for PBO
+	GLsync fence;      // end of the read, 0 if the slot is free
+	int width;
+	int height;
+	TGLCaptureEvent callback;
+};
+
+class GLFrameCapture
+{
+public:
+	GLFrameCapture(int buffers);
+	~GLFrameCapture();
+	GLFrameCapture(const GLFrameCapture&) = delete;
+	GLFrameCapture& operator=(const GLFrameCapture&) = delete;
+
+	void __fastcall Read(unsigned int framebuffer, int width, int height, TGLCaptureEvent callback, TOpenGLWindow* sender);
+	void __fastcall Poll(TOpenGLWindow* sender);
+	bool __fastcall Pending();
+	void __fastcall Release();
+
+private:
+	std::vector<GLCaptureSlot> slots;
+	int next;   // slot for the next read, the oldest read in progress
+
+	bool __fastcall Finish(GLCaptureSlot& slot, TOpenGLWindow* sender, bool wait);
+};
+//---------------------------------------------------------------------------
+
+// Texture loaded through a pixel unpack buffer
+// Decoding and copying run on a worker, the state is only changed on the render thread
+
+enum class GLTransferState { DECODING, COPYING, UPLOADING };
+
+struct GLPixelTransfer
+{
+	GLTransferState state;
+	GLUploadThread* worker;
+	std::shared_ptr<GLUploadJob> job;   // worker job in progress
+	TBitmap* bitmap;      // decoded image, mapped until copied
+	TBitmapData data;
+	int width;
+	int height;
+	GLenum format;
+	bool converted;
+	bool failed;          // worker could not decode the image
+	int row;              // rows sent from the buffer to the texture
+	unsigned int PBO;
+	void* mapped;
+	GLsync fence;
+};
+//---------------------------------------------------------------------------
+
 class GLTexture
 {
 public:
 	GLTexture();
 	~GLTexture();
-	void __fastcall LoadTextureFromFile(const std::wstring& file, bool flip);
-	void __fastcall LoadTextureFromBitmap(TBitmap* textureBMP, bool flip);
+	GLTexture(const GLTexture&) = delete;
+	GLTexture& operator=(const GLTexture&) = delete;
+	void __fastcall LoadTextureFromFile(const std::wstring& file, bool flip, GLUploadThread* loader = nullptr, bool defer = false);
+	void __fastcall LoadTextureFromBitmap(TBitmap* textureBMP, bool flip, GLUploadThread* loader = nullptr, bool defer = false);
 	void __fastcall LoadTextureFromResource(const wchar_t* bmpresource, bool flip);
-	void __fastcall ClearTriangles() { triangleList.clear(); }
-	void __fastcall Render();
+	void __fastcall LoadTextureAsync(const std::wstring& file, bool flip, GLUploadThread* worker);
+	void __fastcall ClearTriangles();
+	void __fastcall SortTriangles();
+	void __fastcall Update(GLUploadThread* loader = nullptr, GLUploadScheduler* scheduler = nullptr, bool geometry = true);
+	void __fastcall SyncView(GLBufferView& view) { view.Sync(vertexBuffer, layout); }
+	void __fastcall Cull(GLBufferView& view, GLFrustum* frustum, GLRenderStats& stats, bool occlusion, GLCullCompute* compute = nullptr);
+	void __fastcall Render(GLBufferView& view, GLStateCache& state, bool bindtexture = true);
+	bool __fastcall NeedsUpload(bool geometry = true) { return (changed && geometry) || !Ready(); }
+	bool __fastcall Ready() { return !textureJob && !transfer && pendingPixels.size() == 0; }
+	bool __fastcall Drawable() { return !textureJob && pendingPixels.size() == 0; }
+	bool __fastcall LoadFailed() { return loadFailed; }
+	std::vector<GLTextureTriangle>& __fastcall Triangles() { return triangleList; }
+	int  __fastcall StorageIndex(int trinum) { return remap.size() > 0 ? remap[trinum] : trinum; }
+	void __fastcall FinishUploads();
 	void __fastcall AddTriangleVT(glm::vec3& p1, glm::vec3& p2, glm::vec3& p3, glm::vec2& t1, glm::vec2& t2, glm::vec2& t3);
 	void __fastcall AddTriangleVNT(glm::vec3& p1, glm::vec3& p2, glm::vec3& p3, glm::vec3& n1, glm::vec3& n2, glm::vec3& n3, glm::vec2& t1, glm::vec2& t2, glm::vec2& t3);
 	int  __fastcall PickTriangle(glm::vec3& raystart, glm::vec3& raydir, float& mindist);
@@ -143,25 +813,95 @@ public:
     glm::vec3 __fastcall GetTriangleColor(int trinum);
 
 	GLuint textureID;
+	glm::vec3 boundsMin;
+	glm::vec3 boundsMax;
 
 private:
 	std::wstring filename;
 	std::vector<GLTextureTriangle> triangleList;
-	unsigned int VAO;
-	unsigned int VBO;
+	std::vector<int> remap;   // storage index of each caller index, empty if not sorted
+	std::vector<int> unmap;   // caller index of each storage index, empty if not sorted
+	GLVertexBuffer vertexBuffer;
+	unsigned int layout;   // changed when triangles are removed or reordered
 	bool changed;
+	bool loadFailed;       // image of LoadTextureAsync could not be decoded, placeholder kept
+	std::shared_ptr<GLUploadJob> textureJob;   // texture upload running on loader thread
+	std::shared_ptr<GLPixelTransfer> transfer;   // texture loading through pixel buffer
+
+	// texture rows waiting for upload budget
+	std::vector<unsigned char> pendingPixels;
+	int pendingRow;
+	GLenum textureFormat;
+	int textureWidth;
+	int textureHeight;
 
-   	void __fastcall CreateArrays();
+   	void __fastcall CreateArrays(GLUploadThread* loader, GLUploadScheduler* scheduler);
+	void __fastcall UploadRows(GLUploadScheduler* scheduler);
+	void __fastcall UpdateTransfer(GLUploadScheduler* scheduler);
+	void __fastcall CancelTransfer();
 
 };
 //---------------------------------------------------------------------------
 
+// Triangles of every texture copied to one shared buffer to reduce draw calls
+// Drawn with one call using a texture array with a layer for each texture,
+// or one glMultiDrawArrays for each texture
+
+class GLTextureBatch
+{
+public:
+	GLTextureBatch(bool texturearray, int layersize, unsigned int textureshader);
+	~GLTextureBatch();
+	GLTextureBatch(const GLTextureBatch&) = delete;
+	GLTextureBatch& operator=(const GLTextureBatch&) = delete;
+
+	void __fastcall Invalidate();
+	void __fastcall Append(std::deque<GLTexture>& textures, int texid);
+	void __fastcall UpdateTriangle(std::deque<GLTexture>& textures, int texid, int trinum);
+	void __fastcall Update(std::deque<GLTexture>& textures, GLUploadThread* loader, GLUploadScheduler* scheduler);
+	void __fastcall SyncView(GLBufferView& view) { view.Sync(vertexBuffer, layout); }
+	void __fastcall Cull(GLBufferView& view, GLFrustum* frustum, GLRenderStats& stats, bool occlusion, GLCullCompute* compute = nullptr);
+	void __fastcall Render(GLBufferView& view, std::deque<GLTexture>& textures, GLStateCache& state, unsigned int depthshader = 0);
+	bool __fastcall UseArray(int textures) { return useArray && textures <= maxLayers; }
+	bool __fastcall NeedsUpdate(std::deque<GLTexture>& textures);
+
+private:
+	bool useArray;
+	int layerSize;
+	int layerCount;
+	int layerCapacity;   // layers allocated in the array
+	int maxLayers;
+	unsigned int arrayTexture;
+	std::vector<bool> layerValid;   // layer holds the loaded texture
+	unsigned int readFBO;   // only exist while copying, framebuffers are not shared between contexts
+	unsigned int drawFBO;
+	unsigned int arrayShader;
+	unsigned int textureShader;   // of the scene, not deleted with the batch
+
+	std::vector<GLBatchTriangle> triangleList;
+	std::vector<std::vector<std::pair<int, int>>> groupRuns;   // first triangle and count of each run of a texture
+	int runCount;
+	GLVertexBuffer vertexBuffer;
+	unsigned int layout;   // changed when the triangle list is rebuilt
+	bool changed;        // rebuild triangle list
+	bool uploadNeeded;
+
+	bool __fastcall LayersPending(std::deque<GLTexture>& textures);
+	void __fastcall ResizeArray(int layers);
+	void __fastcall CopyLayer(GLTexture& tex, int layer);
+	void __fastcall CopyTriangle(GLTextureTriangle& src, GLBatchTriangle& dest, int layer);
+};
+//---------------------------------------------------------------------------
+
+// Font image, character spacing and billboard shader, shared by the windows of a scene
+
 class GLFont
 {
 private:
+	friend class GLText;
+
 	GLTexture fontTexture;
 	GLTexture pointTexture;
-	TOpenGLWindow* glWindow;
 	std::map<std::string, int> props;
 	int charWidth[256];
 	int imageWidth;
@@ -171,42 +911,100 @@ private:
 	int startChar;
 	int fontHeight;
     float pointSize;
-	bool text2DChanged;
-	bool text3DChanged;
-
-	unsigned int VAO2D;
-	unsigned int VAO3D;
-	unsigned int VAOP;
-	unsigned int VBOP;
-	unsigned int unlitShader;
+
 	unsigned int billboardShader;
+	int pvmLoc;      // billboard shader uniform locations
+	int xscaleLoc;
+
+public:
+	GLFont(wchar_t* bmpresource, wchar_t* dataresource);
+    ~GLFont();
+	GLFont(const GLFont&) = delete;
+	GLFont& operator=(const GLFont&) = delete;
+};
+//---------------------------------------------------------------------------
+
+// Text and points of one window drawn with the font of its scene
+// Vertex arrays are not shared between contexts so each window has its own
+
+class GLText
+{
+private:
+	GLFont* font;
+	bool pointsChanged;
+
+	GLVertexArray streamArray;
+	GLVertexBuffer pointBuffer;
+	GLVertexArray pointArray;
 
 	std::vector<GLBillboardQuad> quad2DList;
 	std::vector<GLBillboardQuad> quad3DList;
 	std::vector<GLBillboardQuad> pointList;
 
-	void __fastcall Create2DArrays();
-	void __fastcall Create3DArrays();
+	void __fastcall CreatePointArrays();
+	void __fastcall DrawStream(GLStreamBuffer& stream, std::vector<GLBillboardQuad>& quadlist, GLStateCache& state);
 
 public:
-	GLFont(wchar_t* bmpresource, wchar_t* dataresource);
-    ~GLFont();
+	GLText(GLFont* textfont);
+	~GLText();
+	GLText(const GLText&) = delete;
+	GLText& operator=(const GLText&) = delete;
 	void __fastcall AddText2D(float centerx, float centery, float height, GLTextPos horiz_align, GLTextPos vert_align, const char* str, glm::vec3 color);
 	void __fastcall AddText3D(glm::vec3 pos, float height, GLTextPos horiz_align, GLTextPos vert_align, const char* str, glm::vec3 color, bool point);
-	void __fastcall ClearText2D() { quad2DList.clear(); text2DChanged = true; }
-	void __fastcall ClearText3D() { quad3DList.clear(); pointList.clear(); text3DChanged = true; }
-	void __fastcall Render2D(GLFWwindow* window);
-	void __fastcall Render3D(GLFWwindow* window, glm::mat4& pvm, bool depthtext);
+	void __fastcall ClearText2D() { quad2DList.clear(); }
+	void __fastcall ClearText3D() { quad3DList.clear(); pointList.clear(); pointsChanged = true; }
+	void __fastcall Render2D(int width, int height, GLStreamBuffer& stream, GLStateCache& state);
+	void __fastcall Render3D(int width, int height, glm::mat4& pvm, bool depthtext, GLStreamBuffer& stream, GLStateCache& state);
 	int  __fastcall PickPoint(glm::vec3& raystart, glm::vec3& raydir, float& dist);
 	void __fastcall SetPointColor(int point, glm::vec3& color);
     glm::vec3 __fastcall GetPointColor(int point);
 };
 //---------------------------------------------------------------------------
 
+// Triangles, textures and shaders drawn by one or more windows
+// Windows created with a share window draw the same scene with their own camera
+// Buffers, textures and shaders are shared between their contexts, vertex arrays and
+// queries are not so each window keeps a GLBufferView of every buffer
+
+struct GLScene
+{
+	GLScene();
+	~GLScene();
+	GLScene(const GLScene&) = delete;
+	GLScene& operator=(const GLScene&) = delete;
+
+	std::deque<GLTexture> textureList;
+	std::vector<GLColorTriangle> colorList;
+	std::vector<int> colorRemap;   // storage index of each caller index, empty if not sorted
+	std::vector<int> colorUnmap;   // caller index of each storage index, empty if not sorted
+	glm::vec3 colorMin;
+	glm::vec3 colorMax;
+	GLVertexBuffer colorBuffer;
+	unsigned int colorLayout;   // changed when color triangles are removed or reordered
+	std::vector<GLPointLight> pointLights;
+	unsigned int lightRevision;   // changed when point lights are added, changed or cleared
+
+	unsigned int colorShader;
+	unsigned int textureShader;
+	unsigned int depthShader;
+	GLFont* font;
+
+	GLUploadThread* uploadThread;
+	GLUploadThread* decodeThread;
+	GLTextureBatch* textureBatch;
+	GLUploadScheduler uploadScheduler;
+	GLsync uploadFence;   // end of the last uploads, waited for by the other windows
+
+	bool dataChanged;
+	unsigned int revision;   // changed by every edit so each window knows to draw again
+	int windows;             // windows drawing the scene
+};
+//---------------------------------------------------------------------------
+
 class TOpenGLWindow
 {
 public:
-	TOpenGLWindow(int width, int height, int samples, const char* title);
+	TOpenGLWindow(int width, int height, int samples, const char* title, TOpenGLWindow* share = nullptr, GLWindowMode mode = GLWindowMode::VISIBLE, GLCulling culling = GLCulling::CPU);
 	~TOpenGLWindow();
 
 	void __fastcall ClearTextures();
@@ -222,30 +1020,56 @@ public:
 	void __fastcall AddText2D(float x, float y, float scale, GLTextPos xpos, GLTextPos ypos, const char* str, glm::vec3 color);
 	void __fastcall AddText3D(glm::vec3 pos, float scale, GLTextPos xpos, GLTextPos ypos, const char* str, glm::vec3 color, bool point = false);
 	void __fastcall AddModel(const char* filename);
+	void __fastcall SortTriangles();
 	void __fastcall Render();
+	bool __fastcall RenderIfNeeded(double timeout = 0.0);
+	bool __fastcall RedrawNeeded();
+	void __fastcall Redraw();
+	void __fastcall RenderThread(bool enable);
+	void __fastcall SetImageSize(int width, int height);
+	bool __fastcall GetImage(TBitmap* bitmap);
+	void __fastcall CaptureFrame(TGLCaptureEvent callback, bool continuous = false);
 
 	void __fastcall SetLightDir(glm::vec3& dir);
-	void __fastcall BackFaceCull(bool docull) { backFaceCull = docull; };
+	void __fastcall BackFaceCull(bool docull);
+	void __fastcall FrustumCull(bool docull);
+	void __fastcall OcclusionCull(bool docull);
+	void __fastcall DepthPrepass(bool enable);
+	void __fastcall BackgroundUpload(bool enable);
+	void __fastcall SetUploadBudget(int bytes, double milliseconds);
+	void __fastcall BatchTextures(GLTextureBatching mode, int layersize = 512);
+	void __fastcall GetStateCalls(int& issued, int& skipped);
+	GLRenderStats __fastcall GetRenderStats();
+	void __fastcall SetFramePacing(GLFramePacing pacing, double fps = 60.0);
+	void __fastcall DynamicResolution(bool enable, double milliseconds = 14.0, float minscale = 0.5f);
+	void __fastcall FXAA(bool enable);
+	GLFrameStats __fastcall GetFrameStats() { return frameTimer.Stats(); }
 	void __fastcall SetCamera(glm::vec3& pos, glm::vec3& lookat, glm::vec3& up);
-	void __fastcall DepthText(bool dt) { depthText = dt; }
+	void __fastcall DepthText(bool dt);
 	void __fastcall SetAmbientColor(TAlphaColor color);
 	void __fastcall SetLightColor(TAlphaColor color);
+	void __fastcall AddPointLight(glm::vec3& pos, glm::vec3& color, float radius);
+	void __fastcall SetPointLight(int light, glm::vec3& pos, glm::vec3& color, float radius);
+	void __fastcall ClearPointLights();
 	glm::vec3 __fastcall CreateRay(double x, double y);
 
-	const char* __fastcall GetVersion() { if(window == nullptr) return ""; return (char*)glGetString(GL_VERSION); }
-	const char* __fastcall GetVendor(){ if(window == nullptr) return ""; return (char*)glGetString(GL_VENDOR); }
-	const char* __fastcall GetRenderer(){ if(window == nullptr) return ""; return (char*)glGetString(GL_RENDERER); }
-	const char* __fastcall GetShaderVersion(){ if(window == nullptr) return ""; return (char*)glGetString(GL_SHADING_LANGUAGE_VERSION); }
+	const char* __fastcall GetVersion() { return glVersion.c_str(); }
+	const char* __fastcall GetVendor() { return glVendor.c_str(); }
+	const char* __fastcall GetRenderer() { return glRenderer.c_str(); }
+	const char* __fastcall GetShaderVersion() { return glShaderVersion.c_str(); }
+	bool __fastcall GPUCulling() { return gpuCulling; }
 
 	void __fastcall GetMousePos(double& x, double& y);
 
 	void __fastcall KeyCallback(int key, int scancode, int action, int mods);
 	void __fastcall ResizeCallback(int width, int height);
+	void __fastcall RefreshCallback();
 	void __fastcall MouseButtonCallback(int button, int action, int mods);
 	void __fastcall MousePositionCallback(double x, double y);
 	void __fastcall MouseScrollCallback(double xoffset, double yoffset);
 	GLPickResult __fastcall PickElement(double x, double y);
 	void __fastcall SetElementColor(GLPickResult& pick, glm::vec3 newcolor);
+	void __fastcall SetElementColors(std::vector<GLPickResult>& picks, glm::vec3 newcolor);
 	void __fastcall SetColorTriangleColor(int tri, glm::vec3& color);
     glm::vec3 __fastcall GetColorTriangleColor(int trinum);
 
@@ -257,6 +1081,22 @@ public:
 
 private:
 	GLFWwindow* window;
+	bool glfwUser;   // counted in the windows keeping GLFW initialised
+	bool offscreen;  // window is hidden and frames are drawn to renderTarget
+	int imageWidth;  // size of offscreen frames
+	int imageHeight;
+	int imageSamples;  // samples of frames drawn to a framebuffer
+	GLRenderTarget* renderTarget;
+	bool gpuCulling;   // GPU culling asked for and the context is GL 4.3 or later
+	GLCullCompute* cullCompute;
+	GLFrameCapture frameCapture;
+	GLRenderTarget* captureTarget;     // single sample copy of the window for reading back
+	TGLCaptureEvent captureCallback;   // read the next frame drawn if set
+	bool captureContinuous;            // keep captureCallback after reading
+	std::string glVersion;   // read when the window is created, the context may be on the render thread
+	std::string glVendor;
+	std::string glRenderer;
+	std::string glShaderVersion;
 
 	glm::vec3 cameraPos;
 	glm::vec3 cameraLookat;
@@ -268,27 +1108,98 @@ private:
 	float cameraNear;
     float cameraFar;
 	bool backFaceCull;
+	bool frustumCull;
+	bool occlusionCull;
+	bool depthPrepass;
 	bool depthText;
 	int highlightPoint;
 	int highlightTexture;
 	int highlightTriangle;
 
-	unsigned int colorShader;
-	unsigned int textureShader;
+	std::shared_ptr<GLScene> scene;
+	unsigned int drawnRevision;   // scene revision of the last frame
+	unsigned int sceneUBO;
+	bool sceneChanged;   // camera, light or window size changed since last upload
+	int viewWidth;
+	int viewHeight;
+	glm::mat4 scenePVM;
+	GLFrustum sceneFrustum;
+	int tilesX;   // light tiles across and down the view
+	int tilesY;
+	unsigned int binnedLights;   // light revision of the tile lists
+	unsigned int lightBuffer;    // position, radius and color of each point light
+	unsigned int lightTexture;
+	unsigned int tileBuffer;     // first and count of each tile, then the light indices
+	unsigned int tileTexture;
+	std::vector<unsigned int> tileData;   // kept to avoid allocation
+	std::vector<glm::ivec4> lightTiles;   // tile range of each light, empty if off screen
+	GLRenderStats renderStats;
+	GLFrameTimer frameTimer;
+	GLFramePacing framePacing;
+	std::chrono::steady_clock::duration frameInterval;   // TARGET frame period
+	std::chrono::steady_clock::time_point frameDue;      // TARGET time of next frame
+	bool dynamicResolution;
+	double targetFrameTime;   // GPU milliseconds the render scale aims for
+	float minRenderScale;
+	float renderScale;        // fraction of the window size the 3D pass is drawn at
+	bool fxaa;
+	GLRenderTarget* sceneTarget;   // 3D pass drawn here when scaled or antialiased after
+	GLScreenPass* upscalePass;
+	GLScreenPass* fxaaPass;
 	unsigned int vertexArray;
-	unsigned int colorVAO;
-	unsigned int colorVBO;
+	GLBufferView colorView;
+	GLBufferView batchView;
+	std::deque<GLBufferView> textureViews;
+	GLStreamBuffer streamBuffer;
+	GLStateCache glState;
 
-    GLFont* defaultFont;
+	GLText* windowText;
+	GLBoxQuery* boxQuery;
 
-	bool dataChanged;
+	bool redrawNeeded;    // something drawn changed since the last frame
 
-	std::vector<GLTexture> textureList;
-	std::vector<GLColorTriangle> colorList;
+	// render thread, commands are queued by the thread that created the window
+	std::thread renderThread;
+	std::atomic<bool> threaded;      // render thread owns the context
+	std::atomic<bool> stopRender;
+	std::atomic<bool> renderIdle;    // render thread waiting for commands
+	GLCommandQueue commands;
+	std::mutex wakeMutex;
+	std::condition_variable wake;
+	std::recursive_mutex sceneMutex; // held while commands run so picking sees a whole scene
+	int queuedTextures;   // texture count including queued AddTexture commands
+	int windowWidth;      // window size sent by ResizeCallback for the render thread
+	int windowHeight;
 
-	void __fastcall CreateWindow(int width, int height, int samples, const char* title);
+	void __fastcall CreateWindow(int width, int height, int samples, const char* title, GLFWwindow* share, bool hidden, bool gpuculling);
 	void __fastcall CreateColorArrays();
 	void __fastcall LoadFont();
+	float __fastcall UploadPriority(glm::vec3& minpos, glm::vec3& maxpos);
+	void __fastcall UpdateScene();
+	void __fastcall BinLights();
+	void __fastcall RenderFrame();
+	bool __fastcall CaptureRead();
+	void __fastcall SyncViews();
+	bool __fastcall OcclusionPending();
+	bool __fastcall OcclusionChanged();
+	void __fastcall DrawTriangles(bool batched, unsigned int depthshader);
+	void __fastcall PaceFrame();
+	void __fastcall UpdateRenderScale();
+	void __fastcall RenderLoop();
+	void __fastcall Post(std::function<void()> command);
+	void __fastcall WindowSize(int& width, int& height);
+	void __fastcall MakeCurrent();
+	void __fastcall SceneEdited() { scene->revision++; redrawNeeded = true; }
+	int  __fastcall TextureCount() { return OffRenderThread() ? queuedTextures : scene->textureList.size(); }
+	bool __fastcall OffRenderThread() { return threaded && std::this_thread::get_id() != renderThread.get_id(); }
+
+	// queue command if called on another thread while the render thread runs
+	// returns false if the caller should do the work itself
+	template<class F> bool Defer(F command) {
+		if(!OffRenderThread()) return false;
+		Post(command);
+		return true;
+	}
 };
 //---------------------------------------------------------------------------
 